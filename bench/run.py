@@ -0,0 +1,316 @@
+#!/usr/bin/env python3
+"""Headless performance regression suite for ibantOS.
+
+Boots boot/kernel.elf in QEMU with the shell on COM1 and an isa-debug-exit
+port, types the scenarios below into the shell, and collects the line each
+"bench end" prints:
+
+    BENCH <name> kcycles=<n> kmalloc=<n> scrolls=<n> cursor=<n> lookups=<n>
+
+kcycles is the time (in thousands of TSC cycles) the shell spent handling
+the scenario's input; the rest are event counters. Every scenario runs in
+a fresh boot --runs times and keeps the lowest value of each metric.
+
+The counters depend only on the scripts and the kernel, so their baseline,
+bench/baseline.json, is committed. Cycle counts depend on the machine and
+on the QEMU settings (accel, -smp; TCG and KVM are not comparable), so
+they are compared only against bench/baseline.local.json, which stays out
+of git and is optional; without it kcycles is reported, not judged.
+
+    exit 0  no metric above its threshold
+    exit 1  regression: some metric grew past baseline * (1 + threshold)
+    exit 2  no counter baseline, or the harness itself failed (boot,
+            timeout, missing BENCH line)
+
+--update-baseline writes both files from this run.
+"""
+
+import argparse
+import json
+import os
+import re
+import select
+import subprocess
+import sys
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+BASELINE = os.path.join(ROOT, "bench", "baseline.json")
+LOCAL_BASELINE = os.path.join(ROOT, "bench", "baseline.local.json")
+MACHINE_METRICS = ("kcycles",)
+RESULTS = os.path.join(ROOT, "bench", "results.json")
+
+PROMPT = b"[ibant]> "
+SAVED = b"-- SAVED --"
+BENCH_LINE = re.compile(rb"BENCH (\S+) ([^\r\n]*)\r?\n")
+
+# Allowed growth before a metric counts as a regression. Cycles are noisy
+# under emulation; the counters are deterministic for a given script.
+THRESHOLDS = {"kcycles": 0.15, "default": 0.02}
+
+
+# ---------- scenarios ----------
+# A scenario is a list of steps: a shell command line, or ("edit", path,
+# text) to type text into the editor and save it with TAB. They run in
+# order in one boot, but each makes what it needs in its setup steps
+# (outside the measurement), so --only works for any of them.
+
+MASS_FILES = 1000
+DEEP_DIRS = 40
+EDIT_LINES = 128
+
+
+def mass_mkfile():
+    steps = ["mkdir mass_mk", "cd mass_mk"]
+    steps += ["mkfile f%d" % i for i in range(MASS_FILES)]
+    return steps + ["cd ~"]
+
+
+def deep_cd():
+    steps = []
+    for _ in range(DEEP_DIRS):
+        steps += ["mkdir d", "cd d"]
+    deep = "~/" + "/".join(["d"] * DEEP_DIRS)
+    for _ in range(25):
+        steps += ["cd ~", "cd " + deep]
+    steps += ["cd .."] * DEEP_DIRS
+    return steps + ["cd ~"]
+
+
+def big_text():
+    line = "the quick brown fox jumps over the lazy dog 0123456789 abcdefgh"
+    return "".join("%04d %s\r" % (i, line) for i in range(EDIT_LINES))
+
+
+def no_setup():
+    return []
+
+
+def mass_setup():
+    return ["mkdir mass"] + ["mkfile mass/f%d" % i for i in range(MASS_FILES)]
+
+
+def long_ls():
+    return ["cd mass", "ls", "ls", "ls", "cd ~"]
+
+
+def large_edfile():
+    return ["mkfile big.txt", ("edit", "big.txt", big_text())]
+
+
+def rdfile_setup():
+    return ["mkfile rd.txt", ("edit", "rd.txt", big_text())]
+
+
+def large_rdfile():
+    return ["rdfile rd.txt"] * 5
+
+
+# (name, setup, measured steps)
+SCENARIOS = [
+    ("mkfile", no_setup, mass_mkfile),
+    ("ls", mass_setup, long_ls),
+    ("deep_cd", no_setup, deep_cd),
+    ("edfile", no_setup, large_edfile),
+    ("rdfile", rdfile_setup, large_rdfile),
+]
+
+
+# ---------- talking to the VM ----------
+
+class HarnessError(Exception):
+    pass
+
+
+class Vm:
+    def __init__(self, args):
+        cmd = [args.qemu, "-kernel", args.kernel, "-append", "fastboot",
+               "-m", "256", "-smp", str(args.smp),
+               "-display", "none", "-monitor", "none", "-serial", "stdio",
+               "-device", "isa-debug-exit,iobase=0xf4,iosize=0x04", "-no-reboot"]
+        if args.kvm:
+            cmd += ["-enable-kvm", "-cpu", "host"]
+        self.verbose = args.verbose
+        self.timeout = args.timeout
+        self.proc = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        self.buf = b""
+
+    def _read(self, deadline):
+        left = deadline - time.monotonic()
+        if left <= 0:
+            raise HarnessError("timed out; last output: %r" % self.buf[-200:])
+        ready, _, _ = select.select([self.proc.stdout], [], [], left)
+        if not ready:
+            return
+        data = os.read(self.proc.stdout.fileno(), 65536)
+        if not data:
+            raise HarnessError("QEMU exited (status %s)" % self.proc.wait())
+        if self.verbose:
+            sys.stderr.write(data.decode("latin-1"))
+        self.buf += data
+
+    def expect(self, marker, timeout=None):
+        """Consume output up to and including marker; return what came before it."""
+        deadline = time.monotonic() + (timeout or self.timeout)
+        while marker not in self.buf:
+            self._read(deadline)
+        before, _, self.buf = self.buf.partition(marker)
+        return before
+
+    def send(self, text):
+        # the kernel holds back its UART when its input ring is full, so
+        # QEMU paces long writes for us
+        self.proc.stdin.write(text.encode("ascii"))
+        self.proc.stdin.flush()
+
+    def run(self, line):
+        self.send(line + "\r")
+        return self.expect(PROMPT)
+
+    def close(self):
+        if self.proc.poll() is None:
+            self.proc.kill()
+        self.proc.wait()
+
+
+def run_step(vm, step):
+    if isinstance(step, tuple):
+        _, path, text = step
+        vm.send("edfile " + path + "\r")
+        vm.send(text + "\t")
+        vm.expect(SAVED)
+        vm.expect(PROMPT)
+    else:
+        vm.run(step)
+
+
+def run_scenario(vm, name, setup, steps):
+    for step in setup:
+        run_step(vm, step)
+    vm.run("bench begin " + name)
+    for step in steps:
+        run_step(vm, step)
+    out = vm.run("bench end")
+    m = BENCH_LINE.search(out)
+    if not m or m.group(1).decode() != name:
+        raise HarnessError("%s: no BENCH line in %r" % (name, out[-200:]))
+    return {k: int(v) for k, v in (f.split("=") for f in m.group(2).decode().split())}
+
+
+def run_once(args, scenarios):
+    vm = Vm(args)
+    try:
+        vm.expect(PROMPT, timeout=60)
+        results = {}
+        for name, setup, steps in scenarios:
+            results[name] = run_scenario(vm, name, setup(), steps())
+        vm.send("exit 0\r")
+        status = vm.proc.wait(timeout=args.timeout)
+        if status != 1: # isa-debug-exit: (0 << 1) | 1
+            raise HarnessError("unexpected QEMU exit status %d" % status)
+        return results
+    finally:
+        vm.close()
+
+
+# ---------- comparing ----------
+
+def best_of(runs):
+    best = {}
+    for run in runs:
+        for name, metrics in run.items():
+            cur = best.setdefault(name, dict(metrics))
+            for k, v in metrics.items():
+                cur[k] = min(cur[k], v)
+    return best
+
+
+def load(path):
+    if not os.path.exists(path):
+        return {}
+    with open(path) as f:
+        return json.load(f)
+
+
+def save(path, results):
+    merged = load(path) # --only updates just those scenarios
+    merged.update(results)
+    with open(path, "w") as f:
+        json.dump(merged, f, indent=2, sort_keys=True)
+        f.write("\n")
+    print("bench: baseline written to %s" % os.path.relpath(path))
+
+
+def split(results, machine):
+    """The machine-dependent metrics (machine=True) or the counters."""
+    return {name: {k: v for k, v in metrics.items() if (k in MACHINE_METRICS) == machine}
+            for name, metrics in results.items()}
+
+
+def compare(results, baseline):
+    regressions = 0
+    print("%-10s %-9s %12s %12s %8s" % ("scenario", "metric", "baseline", "now", "change"))
+    for name, metrics in results.items():
+        base = baseline.get(name)
+        for k, v in sorted(metrics.items()):
+            if base is None or k not in base:
+                note = "no local" if k in MACHINE_METRICS else "new"
+                print("%-10s %-9s %12s %12d %8s" % (name, k, "-", v, note))
+                continue
+            b = base[k]
+            limit = THRESHOLDS.get(k, THRESHOLDS["default"])
+            change = (v - b) / b if b else (1.0 if v else 0.0)
+            flag = ""
+            if change > limit:
+                flag = "  REGRESSION (> +%d%%)" % round(limit * 100)
+                regressions += 1
+            print("%-10s %-9s %12d %12d %+7.1f%%%s" % (name, k, b, v, change * 100, flag))
+    return regressions
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("--kernel", default=os.path.join(ROOT, "boot", "kernel.elf"))
+    ap.add_argument("--qemu", default="qemu-system-i386")
+    ap.add_argument("--kvm", action="store_true", help="run under KVM instead of TCG")
+    ap.add_argument("--smp", type=int, default=1)
+    ap.add_argument("--runs", type=int, default=3, help="boots per scenario set; best value wins")
+    ap.add_argument("--timeout", type=float, default=120, help="seconds per step")
+    ap.add_argument("--only", action="append", help="run just this scenario (repeatable)")
+    ap.add_argument("--update-baseline", action="store_true")
+    ap.add_argument("-v", "--verbose", action="store_true", help="echo the console to stderr")
+    args = ap.parse_args()
+
+    scenarios = [s for s in SCENARIOS if not args.only or s[0] in args.only]
+    counters = load(BASELINE)
+    if not counters and not args.update_baseline:
+        print("bench: no counter baseline in %s; record one with --update-baseline"
+              % os.path.relpath(BASELINE), file=sys.stderr)
+        return 2
+
+    try:
+        runs = [run_once(args, scenarios) for _ in range(args.runs)]
+    except (HarnessError, OSError, subprocess.TimeoutExpired) as e:
+        print("bench: %s" % e, file=sys.stderr)
+        return 2
+    results = best_of(runs)
+    with open(RESULTS, "w") as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+
+    if args.update_baseline:
+        save(BASELINE, split(results, False))
+        save(LOCAL_BASELINE, split(results, True))
+        return 0
+
+    baseline = {name: dict(metrics) for name, metrics in counters.items()}
+    for name, metrics in load(LOCAL_BASELINE).items():
+        baseline.setdefault(name, {}).update(metrics)
+    regressions = compare(results, baseline)
+    if regressions:
+        print("bench: %d metric(s) regressed" % regressions, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
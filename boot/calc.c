@@ -0,0 +1,66 @@
+// calculator: calc <a> <op> <b> on ints
+#include "lib.h"
+
+void calc_command(const char* cmd)
+{
+    int a = 0, b = 0;
+    char op = 0;
+
+    a = atoi(cmd);
+
+    // move past first number
+    while (*cmd >= '0' && *cmd <= '9') cmd++;
+
+    // skip spaces
+    while (*cmd == ' ') cmd++;
+
+    op = *cmd++;
+
+    while (*cmd == ' ') cmd++;
+
+    b = atoi(cmd);
+
+    int result = 0;
+    int valid = 1;
+
+    switch (op) {
+        case '+': result = a + b; break;
+        case '-': result = a - b; break;
+        case '*': result = a * b; break;
+        case '/':
+            if (b == 0) {
+                vga_write("division by zero\n");
+                return;
+            }
+            result = a / b;
+            break;
+        default:
+            valid = 0;
+    }
+
+    if (!valid) {
+        vga_write("invalid operator\n");
+        return;
+    }
+
+    char buf[32];
+    int i = 30;
+    buf[31] = 0;
+
+    int r = result;
+    if (r == 0) buf[i--] = '0';
+
+    int neg = (r < 0);
+    if (neg) r = -r;
+
+    while (r > 0) {
+        buf[i--] = '0' + (r % 10);
+        r /= 10;
+    }
+
+    if (neg) buf[i--] = '-';
+
+    vga_write("= ");
+    vga_write(&buf[i + 1]);
+    vga_write("\n");
+}
@@ -0,0 +1,412 @@
+// ---------- file tree ----------
+// Nodes live in RAM; a directory's children sit in an open-addressing
+// table keyed by name hash. Nodes backed by ibfs carry an ino and reach the
+// disk through the fs_disk_*() hooks in platform.h.
+
+#include "lib.h"
+
+fs_node* fs_root = 0;
+fs_node* fs_cwd = 0;
+
+// FNV-1a over the entry name
+uint32_t fs_hash(const char* name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+fs_node* fs_create_node(const char* name, int is_dir) {
+    fs_node* n = kmalloc(sizeof(fs_node));
+    if (!n) return 0;
+    memset(n, 0, sizeof(fs_node)); // zerowanie struktury
+    strncpy(n->name, name, MAX_NAME_LEN - 1);
+    n->hash = fs_hash(n->name);
+    n->is_dir = is_dir;
+    return n;
+}
+
+// Slot holding name, or the empty slot where the probe ended
+static uint32_t fs_dir_probe(fs_dir* d, const char* name, uint32_t hash) {
+    uint32_t mask = d->cap - 1;
+    uint32_t i = hash & mask;
+    while (d->slots[i]) {
+        fs_node* n = d->slots[i];
+        if (n != FS_TOMBSTONE && n->hash == hash && strcmp(n->name, name) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Child already in dir's table
+fs_node* fs_dir_get(fs_node* dir, const char* name, uint32_t hash) {
+    if (!dir->dir || !dir->dir->used) return 0;
+    return dir->dir->slots[fs_dir_probe(dir->dir, name, hash)];
+}
+
+fs_node* fs_lookup(fs_node* dir, const char* name) {
+    uint32_t hash = fs_hash(name);
+    fs_node* n = fs_dir_get(dir, name, hash);
+    if (!n && dir->ino && !dir->loaded) n = fs_disk_lookup(dir, name, hash);
+    return n;
+}
+
+// Rebuild the table with new_cap slots, dropping tombstones on the way
+static int fs_dir_resize(fs_dir* d, uint32_t new_cap) {
+    fs_node** slots = kmalloc(new_cap * sizeof(fs_node*));
+    if (!slots) return -1;
+    memset(slots, 0, new_cap * sizeof(fs_node*));
+
+    for (uint32_t i = 0; i < d->cap; i++) {
+        fs_node* n = d->slots[i];
+        if (!n || n == FS_TOMBSTONE) continue;
+        uint32_t j = n->hash & (new_cap - 1);
+        while (slots[j]) j = (j + 1) & (new_cap - 1);
+        slots[j] = n;
+    }
+    kfree(d->slots);
+    d->slots = slots;
+    d->cap = new_cap;
+    d->tomb = 0;
+    return 0;
+}
+
+// Link child into dir; the caller has already checked the name is free
+int fs_dir_insert(fs_node* dir, fs_node* child) {
+    fs_dir* d = dir->dir;
+    if (!d) {
+        d = kmalloc(sizeof(fs_dir));
+        if (!d) return -1;
+        memset(d, 0, sizeof(fs_dir));
+        dir->dir = d;
+    }
+    // keep the load (live + tombstones) under 3/4
+    if ((d->used + d->tomb + 1) * 4 > d->cap * 3) {
+        uint32_t cap = d->cap ? d->cap : FS_DIR_MIN_SLOTS;
+        while ((d->used + 1) * 4 > cap * 3 / 2) cap *= 2; // room to grow after a rebuild
+        if (fs_dir_resize(d, cap) < 0) return -1;
+    }
+
+    uint32_t i = child->hash & (d->cap - 1);
+    while (d->slots[i] && d->slots[i] != FS_TOMBSTONE) i = (i + 1) & (d->cap - 1);
+    if (d->slots[i] == FS_TOMBSTONE) d->tomb--;
+    d->slots[i] = child;
+    d->used++;
+    child->parent = dir;
+    return 0;
+}
+
+void fs_dir_remove(fs_node* dir, fs_node* child) {
+    fs_dir* d = dir->dir;
+    uint32_t i = fs_dir_probe(d, child->name, child->hash);
+    if (d->slots[i] != child) return;
+    d->slots[i] = FS_TOMBSTONE;
+    d->used--;
+    d->tomb++;
+
+    // mostly tombstones: rebuild (smaller if possible) so probes stay short
+    if (d->tomb > d->cap / 4) {
+        uint32_t cap = d->cap;
+        while (cap > FS_DIR_MIN_SLOTS && d->used * 4 < cap) cap /= 2;
+        fs_dir_resize(d, cap);
+    }
+}
+
+// ---------- dentry cache ----------
+// Remembers (parent, name) -> node for recent path components, including
+// misses (node == 0). Entries sit on hash chains for lookup and on one LRU
+// list; a miss recycles the least recently used entry.
+
+#define DCACHE_ENTRIES 256
+#define DCACHE_BUCKETS 128
+
+struct dentry {
+    fs_node* parent; // 0 = unused
+    uint32_t hash;
+    fs_node* node;
+    char name[MAX_NAME_LEN];
+    struct dentry* hnext;
+    struct dentry* lru_prev;
+    struct dentry* lru_next;
+};
+
+static struct dentry dcache[DCACHE_ENTRIES];
+static struct dentry* dcache_buckets[DCACHE_BUCKETS];
+static struct dentry* dcache_mru = 0; // most recently used
+static struct dentry* dcache_lru = 0; // next to be recycled
+static uint32_t dcache_hits = 0, dcache_misses = 0;
+
+static inline uint32_t dcache_bucket(fs_node* parent, uint32_t hash) {
+    return (hash ^ (uint32_t)((uintptr_t)parent >> 4)) & (DCACHE_BUCKETS - 1);
+}
+
+static void dcache_lru_unlink(struct dentry* e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else dcache_mru = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else dcache_lru = e->lru_prev;
+}
+
+static void dcache_lru_push_front(struct dentry* e) {
+    e->lru_prev = 0;
+    e->lru_next = dcache_mru;
+    if (dcache_mru) dcache_mru->lru_prev = e;
+    dcache_mru = e;
+    if (!dcache_lru) dcache_lru = e;
+}
+
+static void dcache_lru_push_back(struct dentry* e) {
+    e->lru_next = 0;
+    e->lru_prev = dcache_lru;
+    if (dcache_lru) dcache_lru->lru_next = e;
+    dcache_lru = e;
+    if (!dcache_mru) dcache_mru = e;
+}
+
+static void dcache_init(void) {
+    memset(dcache, 0, sizeof(dcache));
+    memset(dcache_buckets, 0, sizeof(dcache_buckets));
+    dcache_mru = dcache_lru = 0;
+    for (int i = 0; i < DCACHE_ENTRIES; i++)
+        dcache_lru_push_back(&dcache[i]);
+    dcache_hits = dcache_misses = 0;
+}
+
+static struct dentry** dcache_find(fs_node* parent, const char* name, uint32_t hash) {
+    struct dentry** link = &dcache_buckets[dcache_bucket(parent, hash)];
+    while (*link) {
+        struct dentry* e = *link;
+        if (e->parent == parent && e->hash == hash && strcmp(e->name, name) == 0)
+            break;
+        link = &e->hnext;
+    }
+    return link;
+}
+
+// Drop whatever is cached for name under parent (after create or delete)
+void dcache_invalidate(fs_node* parent, const char* name) {
+    struct dentry** link = dcache_find(parent, name, fs_hash(name));
+    struct dentry* e = *link;
+    if (!e) return;
+    *link = e->hnext;
+    e->parent = 0;
+    dcache_lru_unlink(e);
+    dcache_lru_push_back(e);
+}
+
+fs_node* fs_lookup_cached(fs_node* parent, const char* name) {
+    uint32_t hash = fs_hash(name);
+    struct dentry* e = *dcache_find(parent, name, hash);
+    struct cpu_stats* st = cpu_stats_this();
+    st->fs_lookups++;
+    if (e) {
+        dcache_hits++;
+        if (!e->node) st->fs_misses++;
+        dcache_lru_unlink(e);
+        dcache_lru_push_front(e);
+        return e->node;
+    }
+
+    dcache_misses++;
+    fs_node* n = fs_lookup(parent, name);
+    if (!n) st->fs_misses++;
+
+    e = dcache_lru;
+    if (e->parent) { // evict it from its chain
+        struct dentry** link = dcache_find(e->parent, e->name, e->hash);
+        *link = e->hnext;
+    }
+    e->parent = parent;
+    e->hash = hash;
+    e->node = n;
+    strncpy(e->name, name, MAX_NAME_LEN - 1);
+    e->name[MAX_NAME_LEN - 1] = 0;
+    uint32_t b = dcache_bucket(parent, hash);
+    e->hnext = dcache_buckets[b];
+    dcache_buckets[b] = e;
+    dcache_lru_unlink(e);
+    dcache_lru_push_front(e);
+    return n;
+}
+
+// ---------- path resolution ----------
+
+// Next '/'-separated component of *path into name (truncated like node
+// names are); returns 0 at the end of the path
+int fs_next_component(const char** path, char* name) {
+    const char* p = *path;
+    while (*p == '/') p++;
+    if (!*p) return 0;
+
+    int i = 0;
+    while (*p && *p != '/') {
+        if (i < MAX_NAME_LEN - 1) name[i++] = *p;
+        p++;
+    }
+    name[i] = 0;
+    *path = p;
+    return 1;
+}
+
+// Walk path from ~ (if it starts with '~') or from the cwd.
+// Returns 0 if a component is missing or is not a directory.
+fs_node* fs_resolve(const char* path) {
+    fs_node* cur = fs_cwd;
+    char name[MAX_NAME_LEN];
+
+    if (*path == '~') {
+        cur = fs_root;
+        path++;
+    }
+    while (fs_next_component(&path, name)) {
+        if (!cur->is_dir) return 0;
+        if (strcmp(name, "..") == 0) cur = cur->parent;
+        else if (strcmp(name, ".") != 0) cur = fs_lookup_cached(cur, name);
+        if (!cur) return 0;
+    }
+    return cur;
+}
+
+// Resolve all but the last component of path, which is copied to leaf.
+// Returns the containing directory, or 0 if it does not exist.
+fs_node* fs_resolve_parent(const char* path, char* leaf) {
+    char dir[MAX_CMD_LEN];
+    const char* last = path;
+    for (const char* p = path; *p; p++)
+        if (*p == '/') last = p + 1;
+
+    const char* tmp = last;
+    if (*last == '~' && last == path) tmp = last + 1; // "~name"
+    if (!fs_next_component(&tmp, leaf)) return 0;
+    if (strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0) return 0;
+
+    int len = (last == path && *path == '~') ? 1 : last - path;
+    if (len >= MAX_CMD_LEN) return 0;
+    memcpy(dir, path, len);
+    dir[len] = 0;
+
+    fs_node* parent = fs_resolve(dir);
+    return parent && parent->is_dir ? parent : 0;
+}
+
+// Fresh tree holding only ~, which is its own parent
+void fs_init_root(void) {
+    dcache_init();
+    fs_root = fs_create_node("~", 1);
+    fs_root->parent = fs_root;
+    fs_cwd = fs_root;
+}
+
+void fs_free_tree(fs_node* n) {
+    FS_FOR_EACH_CHILD(n, c) fs_free_tree(c);
+    if (n->dir) kfree(n->dir->slots);
+    kfree(n->dir);
+    if (!n->readonly) kfree(n->data);
+    kfree(n);
+}
+
+// Create name under dir, complaining if it is already taken
+static fs_node* fs_add(fs_node* dir, const char* name, int is_dir) {
+    if (dir->readonly) {
+        vga_write("\nread-only: ");
+        vga_write(dir->name);
+        vga_write("\n");
+        return 0;
+    }
+    if (fs_lookup_cached(dir, name)) {
+        vga_write("\nalready exists: ");
+        vga_write(name);
+        vga_write("\n");
+        return 0;
+    }
+
+    fs_node* n = fs_create_node(name, is_dir);
+    if (!n) return 0;
+    if (dir->ino && fs_disk_create(dir, n) < 0) {
+        vga_write("\ndisk full\n");
+        klog(KLOG_ERR, "fs: disk full, creating in inode %u", dir->ino); // names are freed, the log is not
+        kfree(n);
+        return 0;
+    }
+    if (fs_dir_insert(dir, n) < 0) {
+        if (n->ino) fs_disk_unlink(dir, n);
+        kfree(n);
+        return 0;
+    }
+    dcache_invalidate(dir, n->name); // forget the cached miss
+    return n;
+}
+
+void fs_mkdir(const char* path) {
+    char name[MAX_NAME_LEN];
+    fs_node* dir = fs_resolve_parent(path, name);
+    if (!dir) {
+        vga_write("folder/dir doesnt exist\n");
+        return;
+    }
+    fs_add(dir, name, 1);
+}
+void fs_ls(void) {
+    fs_dir_load(fs_cwd);
+    FS_FOR_EACH_CHILD(fs_cwd, n) {
+        vga_write(n->is_dir ? "\n[FOLDERs] -> " : "\n[FILES] -> ");
+        vga_write(n->name);
+        vga_write("\n");
+    }
+}
+void fs_cd(const char* path) {
+    fs_node* n = fs_resolve(path);
+    if (!n || !n->is_dir) {
+        vga_write("folder/dir doesnt exist\n");
+        return;
+    }
+    fs_cwd = n;
+}
+void fs_dir_from(fs_node* dir) {
+    fs_dir_load(dir);
+    FS_FOR_EACH_CHILD(dir, n) {
+        if (n->is_dir) {
+            vga_write(n->name);
+            vga_write("\n");
+        }
+    }
+}
+
+void fs_mkfile(const char* path) {
+    char name[MAX_NAME_LEN];
+    fs_node* dir = fs_resolve_parent(path, name);
+    if (!dir) {
+        vga_write("folder/dir doesnt exist\n");
+        return;
+    }
+    if (!fs_add(dir, name, 0)) return;
+    vga_write("\nmade file: ");
+    vga_write(path);
+    vga_write("\n");
+}
+void fs_delfile(const char* path) {
+    char name[MAX_NAME_LEN];
+    fs_node* dir = fs_resolve_parent(path, name);
+    fs_node* n = dir ? fs_lookup_cached(dir, name) : 0;
+    if (n && !n->is_dir && n->readonly) {
+        vga_write("\nread-only file\n");
+        return;
+    }
+    if (n && !n->is_dir) {
+        if (n->ino) fs_disk_unlink(dir, n);
+        fs_dir_remove(dir, n);
+        dcache_invalidate(dir, name);
+        kfree(n->data);
+        kfree(n);
+
+        vga_write("\ndeleted file: ");
+        vga_write(path);
+        vga_write("\n");
+        return;
+    }
+    vga_write("file was not found\n");
+    klog(KLOG_DEBUG, "fs: delfile: file not found");
+}
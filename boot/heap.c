@@ -0,0 +1,271 @@
+// ---------- kernel heap ----------
+// Requests up to 512 bytes are rounded to a power-of-two size class and
+// recycled through per-class free lists. Bigger ones come from variable-
+// sized blocks that are split on allocation and coalesced with their
+// neighbours on kfree(); free ones sit in power-of-two size bins, searched
+// first-fit from the bin of the request upwards. Every block starts with a
+// 16-byte header, so all payloads are 16-byte aligned.
+
+#include "lib.h"
+
+#define HEAP_ALIGN 16
+#define HEAP_MAGIC 0x1BA7
+#define HEAP_NUM_CLASSES 6 // 16, 32, 64, 128, 256, 512
+#define HB_USED   1
+#define HB_FREE   2 // on the large free list
+#define HB_CACHED 3 // parked on a size-class list
+#define HB_LARGE  0xFF
+#define HEAP_LARGE_BINS 32 // bin i: free blocks of 2^i to 2^(i+1)-1 bytes
+
+struct heap_block {
+    uint32_t size;      // whole block including this header
+    uint32_t prev_size; // size of the block before us, 0 if first in its region
+    uint16_t magic;
+    uint8_t state;
+    uint8_t cls;        // size class, or HB_LARGE
+    uint32_t req;       // bytes the caller asked for
+};
+
+// free-list links live in the payload of free blocks
+struct heap_free {
+    struct heap_block* next;
+    struct heap_block* prev;
+};
+
+#define HB_PAYLOAD(b) ((void*)((uint8_t*)(b) + sizeof(struct heap_block)))
+#define HB_HEADER(p)  ((struct heap_block*)((uint8_t*)(p) - sizeof(struct heap_block)))
+#define HB_LINKS(b)   ((struct heap_free*)HB_PAYLOAD(b))
+
+static uint8_t heap[64 * 1024] __attribute__((aligned(HEAP_ALIGN)));
+static struct heap_block* heap_class_free[HEAP_NUM_CLASSES];
+static struct heap_block* heap_large_free[HEAP_LARGE_BINS];
+static uint32_t heap_large_bins = 0; // bit i set: bin i is not empty
+struct heap_stats heap_stats;
+
+static inline struct heap_block* heap_next(struct heap_block* b) {
+    return (struct heap_block*)((uint8_t*)b + b->size);
+}
+
+static inline int heap_bin_of(uint32_t size) {
+    return 31 - __builtin_clz(size);
+}
+
+static void heap_list_insert(struct heap_block* b) {
+    int bin = heap_bin_of(b->size);
+    b->state = HB_FREE;
+    b->cls = HB_LARGE;
+    HB_LINKS(b)->prev = 0;
+    HB_LINKS(b)->next = heap_large_free[bin];
+    if (heap_large_free[bin]) HB_LINKS(heap_large_free[bin])->prev = b;
+    heap_large_free[bin] = b;
+    heap_large_bins |= 1u << bin;
+}
+
+static void heap_list_remove(struct heap_block* b) {
+    int bin = heap_bin_of(b->size);
+    struct heap_free* l = HB_LINKS(b);
+    if (l->prev) HB_LINKS(l->prev)->next = l->next;
+    else heap_large_free[bin] = l->next;
+    if (l->next) HB_LINKS(l->next)->prev = l->prev;
+    if (!heap_large_free[bin]) heap_large_bins &= ~(1u << bin);
+}
+
+// Hand a chunk of memory to the allocator; it is closed off by a zero-size
+// sentinel block so neighbour walks never leave the region
+void heap_add_region(void* base, size_t len) {
+    uintptr_t start = ((uintptr_t)base + HEAP_ALIGN - 1) & ~(uintptr_t)(HEAP_ALIGN - 1);
+    uintptr_t end = ((uintptr_t)base + len) & ~(uintptr_t)(HEAP_ALIGN - 1);
+    if (end <= start || end - start < 4 * sizeof(struct heap_block)) return;
+
+    struct heap_block* b = (struct heap_block*)start;
+    b->size = end - start - sizeof(struct heap_block);
+    b->prev_size = 0;
+    b->magic = HEAP_MAGIC;
+
+    struct heap_block* sentinel = heap_next(b);
+    sentinel->size = 0;
+    sentinel->prev_size = b->size;
+    sentinel->magic = HEAP_MAGIC;
+    sentinel->state = HB_USED;
+    sentinel->cls = HB_LARGE;
+
+    heap_list_insert(b);
+    heap_stats.total += b->size;
+    heap_stats.regions++;
+}
+
+void kheap_init(void) {
+    memset(heap_class_free, 0, sizeof(heap_class_free));
+    memset(&heap_stats, 0, sizeof(heap_stats));
+    memset(heap_large_free, 0, sizeof(heap_large_free));
+    heap_large_bins = 0;
+    heap_add_region(heap, sizeof(heap));
+}
+
+static int heap_class_of(size_t size) {
+    int cls = 0;
+    while ((size_t)(HEAP_ALIGN << cls) < size) cls++;
+    return cls;
+}
+
+// First fit in need's own bin, else the head of the next non-empty bin
+// (everything there is big enough); the tail is split off if it is big enough
+static struct heap_block* heap_take_large(size_t need) {
+    if (need > 0x7FFFFFFF) return 0; // no region is that big; keeps the bins 32-bit
+    struct heap_block* best = 0;
+    int bin = heap_bin_of(need);
+    for (struct heap_block* b = heap_large_free[bin]; b && !best; b = HB_LINKS(b)->next)
+        if (b->size >= need) best = b;
+    if (!best) {
+        uint32_t above = bin + 1 < HEAP_LARGE_BINS ? heap_large_bins & (~0u << (bin + 1)) : 0;
+        if (!above) return 0;
+        best = heap_large_free[__builtin_ctz(above)];
+    }
+
+    heap_list_remove(best);
+    if (best->size - need >= 2 * sizeof(struct heap_block)) {
+        struct heap_block* rest = (struct heap_block*)((uint8_t*)best + need);
+        rest->size = best->size - need;
+        rest->prev_size = need;
+        rest->magic = HEAP_MAGIC;
+        heap_next(rest)->prev_size = rest->size;
+        best->size = need;
+        heap_list_insert(rest);
+    }
+    return best;
+}
+
+// Return a block to the large list, merging with free neighbours on both sides
+static void heap_release(struct heap_block* b) {
+    struct heap_block* next = heap_next(b);
+    if (next->state == HB_FREE) {
+        heap_list_remove(next);
+        b->size += next->size;
+    }
+    if (b->prev_size) {
+        struct heap_block* prev = (struct heap_block*)((uint8_t*)b - b->prev_size);
+        if (prev->state == HB_FREE) {
+            heap_list_remove(prev);
+            prev->size += b->size;
+            b = prev;
+        }
+    }
+    heap_next(b)->prev_size = b->size;
+    heap_list_insert(b);
+}
+
+// Drain the size-class lists so their blocks can coalesce again
+static void heap_reclaim_cached(void) {
+    for (int cls = 0; cls < HEAP_NUM_CLASSES; cls++) {
+        while (heap_class_free[cls]) {
+            struct heap_block* b = heap_class_free[cls];
+            heap_class_free[cls] = HB_LINKS(b)->next;
+            heap_release(b);
+        }
+    }
+    heap_stats.cached = 0;
+}
+
+static struct heap_block* heap_alloc_block(size_t size) {
+    struct heap_block* b;
+
+    if (size <= HEAP_MAX_SMALL) {
+        int cls = heap_class_of(size);
+        b = heap_class_free[cls];
+        if (b) {
+            heap_class_free[cls] = HB_LINKS(b)->next;
+            heap_stats.cached -= b->size;
+        } else {
+            b = heap_take_large(sizeof(struct heap_block) + (HEAP_ALIGN << cls));
+        }
+        if (b) b->cls = cls;
+    } else {
+        size_t need = ((size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1)) + sizeof(struct heap_block);
+        b = need > size ? heap_take_large(need) : 0;
+        if (b) b->cls = HB_LARGE;
+    }
+    return b;
+}
+
+// Pull at least HEAP_GROW_MIN bytes of fresh frames into the heap
+#define HEAP_GROW_MIN (64 * 1024)
+static int heap_grow(size_t size) {
+    if (size > 0x7FFF0000) return 0;
+    size_t bytes = size + 4 * sizeof(struct heap_block);
+    if (bytes < HEAP_GROW_MIN) bytes = HEAP_GROW_MIN;
+    bytes = (bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    void* pages = pmm_alloc_pages(bytes / PAGE_SIZE);
+    if (!pages) return 0;
+    heap_add_region(pages, bytes);
+    return 1;
+}
+
+void* kmalloc(size_t size) {
+    if (size == 0) size = 1;
+    struct cpu_stats* st = cpu_stats_this();
+    st->kmalloc_calls++;
+    st->kmalloc_bytes += size;
+
+    struct heap_block* b = heap_alloc_block(size);
+    if (!b && heap_stats.cached) {
+        heap_reclaim_cached();
+        b = heap_alloc_block(size);
+    }
+    if (!b && heap_grow(size))
+        b = heap_alloc_block(size);
+
+    if (!b) {
+        heap_stats.failed++;
+        vga_write("\nkmalloc: out of memory (");
+        vga_write_uint(size);
+        vga_write(" bytes)\n");
+        return NULL;
+    }
+
+    b->state = HB_USED;
+    b->req = size;
+    heap_stats.allocs++;
+    heap_stats.in_use += b->size;
+    if (heap_stats.in_use > heap_stats.high_water)
+        heap_stats.high_water = heap_stats.in_use;
+    return HB_PAYLOAD(b);
+}
+
+// Usable bytes in the block behind p (at least what was asked for)
+size_t ksize(void* p) {
+    return HB_HEADER(p)->size - sizeof(struct heap_block);
+}
+
+void kfree(void* p) {
+    if (!p) return;
+
+    struct heap_block* b = HB_HEADER(p);
+    if (b->magic != HEAP_MAGIC || b->state != HB_USED) {
+        vga_write("\nkfree: bad pointer\n");
+        klog(KLOG_ERR, "kfree: bad pointer %x", (uint32_t)(uintptr_t)p);
+        return;
+    }
+    heap_stats.frees++;
+    heap_stats.in_use -= b->size;
+
+    if (b->cls != HB_LARGE) {
+        b->state = HB_CACHED;
+        HB_LINKS(b)->next = heap_class_free[b->cls];
+        heap_class_free[b->cls] = b;
+        heap_stats.cached += b->size;
+        return;
+    }
+    heap_release(b);
+}
+
+// Free bytes in the large bins and the biggest single block there
+void heap_free_space(size_t* free_large, size_t* largest) {
+    *free_large = *largest = 0;
+    for (int bin = 0; bin < HEAP_LARGE_BINS; bin++) {
+        for (struct heap_block* b = heap_large_free[bin]; b; b = HB_LINKS(b)->next) {
+            *free_large += b->size;
+            if (b->size > *largest) *largest = b->size;
+        }
+    }
+}
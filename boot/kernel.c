@@ -1,8 +1,11 @@
-#include <stdint.h>
+#include "lib.h"
 
-#define NULL ((void*)0)
 #define MULTIBOOT_MAGIC 0x1BADB002
-#define MULTIBOOT_FLAGS 0x0
+#define MULTIBOOT_PAGE_ALIGN 0x1  // modules on 4 KiB boundaries
+#define MULTIBOOT_MEMORY_INFO 0x2 // ask for mem_* and the memory map
+#define MULTIBOOT_VIDEO_MODE 0x4  // ask for a graphics mode (grub.cfg gfxpayload can veto)
+#define MULTIBOOT_FLAGS (MULTIBOOT_PAGE_ALIGN | MULTIBOOT_MEMORY_INFO | MULTIBOOT_VIDEO_MODE)
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
 #define MULTIBOOT_CHECKSUM -(MULTIBOOT_MAGIC + MULTIBOOT_FLAGS)
 #define VGA13_MEMORY 0xA0000
 
@@ -10,33 +13,80 @@ __attribute__((section(".multiboot")))
 const uint32_t multiboot_header[] = {
     MULTIBOOT_MAGIC,
     MULTIBOOT_FLAGS,
-    MULTIBOOT_CHECKSUM
+    MULTIBOOT_CHECKSUM,
+    0, 0, 0, 0, 0, // load addresses, unused for ELF
+    0,             // linear framebuffer
+    1024, 768, 32  // preferred width, height, depth
 };
 
+// GRUB jumps here with EAX = magic and EBX = info block but no usable stack.
+// kernel_restart is also what the reboot command calls to start over clean.
+#define BOOT_STACK_SIZE (16 * 1024)
+#define STR_(x) #x
+#define STR(x) STR_(x)
+uint8_t boot_stack[BOOT_STACK_SIZE] __attribute__((aligned(16)));
+uint32_t multiboot_magic = 0;
+uint32_t multiboot_info_addr = 0;
+uint64_t boot_tsc_start = 0; // TSC when kernel_restart began, first boot stage
+
+__asm__(
+    ".text\n"
+    ".global _start\n"
+    "_start:\n"
+    "    mov %eax, multiboot_magic\n"
+    "    mov %ebx, multiboot_info_addr\n"
+    ".global kernel_restart\n"
+    "kernel_restart:\n"
+    "    cli\n"
+    "    rdtsc\n"
+    "    mov %eax, boot_tsc_start\n"
+    "    mov %edx, boot_tsc_start + 4\n"
+    "    mov $(boot_stack + " STR(BOOT_STACK_SIZE) "), %esp\n"
+    "    call kernel_main\n"
+    "1:  hlt\n"
+    "    jmp 1b\n"
+);
+
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
 #define VGA_MEMORY 0xB8000
 
 static volatile uint16_t* const vga_buffer = (volatile uint16_t*)VGA_MEMORY;
 
+// All text goes to this RAM copy first; vga_flush() pushes the dirty rows
+// [vga_dirty_lo, vga_dirty_hi] out to VGA memory in one pass. The shadow is
+// a ring of rows starting at vga_shadow_head, so scrolling moves no data.
+static uint16_t vga_shadow[VGA_WIDTH * VGA_HEIGHT] __attribute__((aligned(4)));
+static int vga_shadow_head = 0;
+static int vga_dirty_lo = VGA_HEIGHT;
+static int vga_dirty_hi = -1;
+#define VGA_ROW(r) (vga_shadow + ((vga_shadow_head + (r)) % VGA_HEIGHT) * VGA_WIDTH)
+
+// The visible screen is a 25-row window at row vga_top of the 32 KiB text
+// memory; scrolling just moves the CRTC start address down one row
+#define VGA_VRAM_ROWS ((0x8000 / 2) / VGA_WIDTH)
+static int vga_top = 0;
+static int vga_hw_top = -1;    // last start row programmed into the CRTC
+static int vga_hw_cursor = -1; // last position programmed into the CRTC
+
 static inline void outb(uint16_t port, uint8_t val);
 
 static int cursor_x = 0;
 static int cursor_y = 0;
 static int sp8lf_mode = 0;  // SP8LF mode: 0=Normal (black bg), 1=SP8LF (white bg)
 
-// Update hardware cursor position
+// Update hardware cursor position (skipped if it has not moved)
 static void update_cursor(void) {
-    uint16_t pos = cursor_y * VGA_WIDTH + cursor_x;
+    uint16_t pos = (vga_top + cursor_y) * VGA_WIDTH + cursor_x;
+    if (pos == vga_hw_cursor) return;
+    vga_hw_cursor = pos;
+    cpu_stats_this()->cursor_outs += 4;
     outb(0x3D4, 14);         // Cursor location high byte
     outb(0x3D5, (pos >> 8) & 0xFF);
     outb(0x3D4, 15);         // Cursor location low byte
     outb(0x3D5, pos & 0xFF);
 }
 
-#define MAX_CMD_LEN 128
-
-typedef unsigned int size_t;
 typedef unsigned char  u8;
 typedef unsigned short u16;
 typedef unsigned int   u32;
@@ -46,40 +96,33 @@ static int input_pos = 0;
 static int vga_color = 0x0E; // foreground=0x0E (yellow), background=0x00 (black)
 
 
-static inline void vga_set_mode13h(void);
 void init_framebuffer(uint32_t *framebuffer, int width, int height);
 void draw_test_fb(void);
 uint16_t vga_entry(char c, uint8_t color);
 void vga_clear(void);
 void vga_putc(char c);
 void vga_write(const char* str);
+void vga_flush(void);
+void gfx_console_flush(int lo, int hi);
+void gfx_console_rows(const uint16_t* const* rows);
+void vga_scrollback_page(int dir);
+void vga_put_at(int x, int y, char c, uint8_t color);
+void vga_save_screen(uint16_t* out);
+void vga_restore_screen(const uint16_t* in);
+void vga_write_uint(uint32_t v);
+void vga_write_hex(uint32_t v);
 void vga_set_color(uint8_t fg, uint8_t bg);
 void vga_set_text_mode(void);
 void vga_set_mode13h(void);
-void calc_command(const char* cmd);
-
-// ---------- minimal string functions ----------
-int strncmp(const char* s1, const char* s2, int n) {
-    for (int i = 0; i < n; i++) {
-        if (s1[i] != s2[i] || s1[i] == 0 || s2[i] == 0) return s1[i] - s2[i];
-    }
-    return 0;
-}
-
-int strlen(const char* s) {
-    int len = 0;
-    while (s[len]) len++;
-    return len;
-}
 
-int atoi(const char* str) {
-    int res = 0;
-    int i = 0;
-    while (str[i] >= '0' && str[i] <= '9') {
-        res = res * 10 + (str[i] - '0');
-        i++;
-    }
-    return res;
+// 64-bit divide by a 32-bit value without pulling in libgcc's __udivdi3
+uint64_t udiv64(uint64_t n, uint32_t d, uint32_t* rem) {
+    uint32_t hi = (uint32_t)(n >> 32), lo = (uint32_t)n;
+    uint32_t qhi = hi / d, qlo, r;
+    hi %= d;
+    __asm__ ("divl %4" : "=a"(qlo), "=d"(r) : "a"(lo), "d"(hi), "rm"(d));
+    if (rem) *rem = r;
+    return ((uint64_t)qhi << 32) | qlo;
 }
 
 // ---------- keyboard driver ---------
@@ -96,654 +139,4048 @@ static inline void outb(uint16_t port, uint8_t val) {
     __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
 }
 
-// Delay for approximately milliseconds using PIT
-void delay_ms(unsigned int ms) {
-    // PIT channel 0 data port
-    #define PIT_CHANNEL0 0x40
-    #define PIT_COMMAND 0x43
-    
-    // PIT operates at ~1193182 Hz
-    // Configure PIT to mode 0 (interrupt on terminal count)
-    outb(PIT_COMMAND, 0x30); // binary, mode 0, LSB then MSB, channel 0
-    
-    // Calculate divisor for desired delay (one-shot)
-    unsigned int divisor = 1193182 / 1000; // 1 ms tick
-    
-    // Send divisor (LSB then MSB)
-    outb(PIT_CHANNEL0, divisor & 0xFF);
-    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
-    
-    // Wait for the required number of milliseconds
-    for (unsigned int i = 0; i < ms; i++) {
-        // Wait for PIT counter to reach zero (read status then read counter)
-        unsigned char status;
-        do {
-            outb(PIT_COMMAND, 0xE2); // read-back command
-            status = inb(PIT_CHANNEL0);
-        } while (status & 0x80); // wait while output is high (counting down)
-        
-        // Reset counter for next millisecond
-        outb(PIT_COMMAND, 0x30);
-        outb(PIT_CHANNEL0, divisor & 0xFF);
-        outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
-    }
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    __asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
 }
 
-// Wait for a keypress and return its ASCII code
-// Only handle make codes (key press)
-// Track if Shift is pressed
-static int shift_pressed = 0;
+static inline void outl(uint16_t port, uint32_t val) {
+    __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
+}
 
-char get_char(void) {
-    while (1) {
-        uint8_t status = inb(0x64);
-        if (status & 0x01) {
-            uint8_t scancode = inb(0x60);
-
-            // Handle key release
-            if (scancode & 0x80) {
-                // if release, check if Shift released
-                if (scancode == 0xAA || scancode == 0xB6) shift_pressed = 0;
-                continue;
-            }
+// Block transfers of 16-bit words (ATA data port)
+static inline void insw(uint16_t port, void* buf, uint32_t count) {
+    __asm__ volatile ("rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
 
-            // Handle Shift press
-            if (scancode == 0x2A || scancode == 0x36) { // Left/Right Shift
-                shift_pressed = 1;
-                continue;
-            }
+static inline void outsw(uint16_t port, const void* buf, uint32_t count) {
+    __asm__ volatile ("rep outsw" : "+S"(buf), "+c"(count) : "d"(port));
+}
 
-            switch (scancode) {
-                case 0x0F: return '\t'; // TAB = save
-                case 0x1C: return '\n';    // Enter
-                case 0x0E: return '\b';    // Backspace
-                case 0x02: return shift_pressed ? '!' : '1';
-                case 0x03: return shift_pressed ? '@' : '2';
-                case 0x04: return shift_pressed ? '#' : '3';
-                case 0x05: return shift_pressed ? '$' : '4';
-                case 0x06: return shift_pressed ? '%' : '5';
-                case 0x07: return shift_pressed ? '^' : '6';
-                case 0x08: return shift_pressed ? '&' : '7';
-                case 0x09: return shift_pressed ? '*' : '8';
-                case 0x0A: return shift_pressed ? '(' : '9';
-                case 0x0B: return shift_pressed ? ')' : '0';
-                case 0x10: return shift_pressed ? 'Q' : 'q';
-                case 0x11: return shift_pressed ? 'W' : 'w';
-                case 0x12: return shift_pressed ? 'E' : 'e';
-                case 0x13: return shift_pressed ? 'R' : 'r';
-                case 0x14: return shift_pressed ? 'T' : 't';
-                case 0x15: return shift_pressed ? 'Y' : 'y';
-                case 0x16: return shift_pressed ? 'U' : 'u';
-                case 0x17: return shift_pressed ? 'I' : 'i';
-                case 0x18: return shift_pressed ? 'O' : 'o';
-                case 0x19: return shift_pressed ? 'P' : 'p';
-                case 0x1E: return shift_pressed ? 'A' : 'a';
-                case 0x1F: return shift_pressed ? 'S' : 's';
-                case 0x20: return shift_pressed ? 'D' : 'd';
-                case 0x21: return shift_pressed ? 'F' : 'f';
-                case 0x22: return shift_pressed ? 'G' : 'g';
-                case 0x23: return shift_pressed ? 'H' : 'h';
-                case 0x24: return shift_pressed ? 'J' : 'j';
-                case 0x25: return shift_pressed ? 'K' : 'k';
-                case 0x26: return shift_pressed ? 'L' : 'l';
-                case 0x2C: return shift_pressed ? 'Z' : 'z';
-                case 0x2D: return shift_pressed ? 'X' : 'x';
-                case 0x2E: return shift_pressed ? 'C' : 'c';
-                case 0x2F: return shift_pressed ? 'V' : 'v';
-                case 0x30: return shift_pressed ? 'B' : 'b';
-                case 0x31: return shift_pressed ? 'N' : 'n';
-                case 0x32: return shift_pressed ? 'M' : 'm';
-                case 0x39: return shift_pressed ? '\a' : ' ';
-                case 0x0C: return shift_pressed ? '_' : '-';
-                case 0x0D: return shift_pressed ? '+' : '=';
-                case 0x33: return shift_pressed ? '<' : ',';
-                case 0x34: return shift_pressed ? '>' : '.';
-                case 0x35: return shift_pressed ? '?' : '/';
-                case 0x27: return shift_pressed ? '"' : '\'';
-                case 0x28: return shift_pressed ? ':' : ';';
-                case 0x1A: return shift_pressed ? '{' : '[';
-                case 0x1B: return shift_pressed ? '}' : ']';
-                case 0x29: return shift_pressed ? '~' : '`';
-                case 0x2B: return shift_pressed ? '|' : '\\';
-                default: break;
-            }
-        }
-    }
+// Read the CPU timestamp counter
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
 }
 
+// ---------- interrupts (GDT, IDT, PIC) ----------
 
+// GRUB's GDT may be gone by the time we run, so load our own flat one.
+// Behind the flat segments is one small data segment per CPU for %fs
+// (cpu_fs_load()).
+#define GDT_CPU 3
+#define GDT_ENTRIES 16
+static uint64_t gdt[GDT_ENTRIES] = {
+    0,
+    0x00CF9A000000FFFFULL, // 0x08: kernel code
+    0x00CF92000000FFFFULL  // 0x10: kernel data
+};
 
+static void cpu_fs_load(int id);
 
-void _start(void);
-void draw_test(void); // add this near the top with other prototypes
-void grublmao(void);
+struct gdt_ptr {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
 
-// filesystem
+struct idt_entry {
+    uint16_t base_lo;
+    uint16_t sel;
+    uint8_t  zero;
+    uint8_t  flags;
+    uint16_t base_hi;
+} __attribute__((packed));
 
-#define MAX_CHILDREN 32
-#define MAX_NAME_LEN 32
+struct idt_ptr {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
 
-typedef struct fs_node {
-    char name[MAX_NAME_LEN];
-    int is_dir;
+// Register layout pushed by irq_common (pusha + vector/err + CPU frame)
+struct irq_frame {
+    uint32_t edi, esi, ebp, esp_dummy, ebx, edx, ecx, eax;
+    uint32_t vector, err;
+    uint32_t eip, cs, eflags;
+};
+
+typedef void (*irq_handler_t)(struct irq_frame* f);
+
+// 0-15 are the ISA IRQs; the rest are local APIC vectors right above them
+#define IRQ_LAPIC_TIMER 16
+#define IRQ_RESCHED     17 // IPI: run the scheduler
+#define IRQ_STOP        18 // IPI: halt (reboot, halt command)
+#define IRQ_VECTORS     19
+#define SPURIOUS_VECTOR 0xFF
 
-    struct fs_node* parent;
+static struct idt_entry idt[256];
+static irq_handler_t irq_handlers[IRQ_VECTORS];
+static uint16_t irq_mask = 0xFFFB; // everything masked except the cascade (IRQ2)
 
-    struct fs_node* children[MAX_CHILDREN];
-    int child_count;
+#define PIC1_CMD  0x20
+#define PIC1_DATA 0x21
+#define PIC2_CMD  0xA0
+#define PIC2_DATA 0xA1
+#define IRQ_BASE  32
 
-    uint8_t* data;
-    size_t size;
-} fs_node;
+// one stub per IRQ, all funnel into irq_common -> irq_dispatch()
+__asm__(
+    ".text\n"
+    ".macro IRQ_STUB n\n"
+    "irq_stub_\\n:\n"
+    "    push $0\n"
+    "    push $(32 + \\n)\n"
+    "    jmp irq_common\n"
+    ".endm\n"
+    "IRQ_STUB 0\n  IRQ_STUB 1\n  IRQ_STUB 2\n  IRQ_STUB 3\n"
+    "IRQ_STUB 4\n  IRQ_STUB 5\n  IRQ_STUB 6\n  IRQ_STUB 7\n"
+    "IRQ_STUB 8\n  IRQ_STUB 9\n  IRQ_STUB 10\n IRQ_STUB 11\n"
+    "IRQ_STUB 12\n IRQ_STUB 13\n IRQ_STUB 14\n IRQ_STUB 15\n"
+    "IRQ_STUB 16\n IRQ_STUB 17\n IRQ_STUB 18\n"
+    "irq_spurious:\n" // no EOI for these
+    "    iret\n"
+    "irq_common:\n"
+    "    pusha\n"
+    "    cld\n"
+    "    push %esp\n"
+    "    call irq_dispatch\n"
+    "    add $4, %esp\n"
+    "    popa\n"
+    "    add $8, %esp\n"
+    "    iret\n"
+    ".section .rodata\n"
+    ".align 4\n"
+    "irq_stub_table:\n"
+    "    .long irq_stub_0, irq_stub_1, irq_stub_2, irq_stub_3\n"
+    "    .long irq_stub_4, irq_stub_5, irq_stub_6, irq_stub_7\n"
+    "    .long irq_stub_8, irq_stub_9, irq_stub_10, irq_stub_11\n"
+    "    .long irq_stub_12, irq_stub_13, irq_stub_14, irq_stub_15\n"
+    "    .long irq_stub_16, irq_stub_17, irq_stub_18, irq_spurious\n"
+    ".text\n"
+);
+extern const uint32_t irq_stub_table[IRQ_VECTORS + 1];
 
-static uint8_t heap[64 * 1024];
-static size_t heap_pos = 0;
+// CPU exceptions 0-31; the ones that push an error code skip the dummy push,
+// and all of them end in exc_dispatch(), which does not return
+__asm__(
+    ".text\n"
+    ".macro EXC_STUB n\n"
+    "exc_stub_\\n:\n"
+    "    push $0\n"
+    "    push $\\n\n"
+    "    jmp exc_common\n"
+    ".endm\n"
+    ".macro EXC_STUB_ERR n\n"
+    "exc_stub_\\n:\n"
+    "    push $\\n\n"
+    "    jmp exc_common\n"
+    ".endm\n"
+    "EXC_STUB 0\n  EXC_STUB 1\n  EXC_STUB 2\n  EXC_STUB 3\n"
+    "EXC_STUB 4\n  EXC_STUB 5\n  EXC_STUB 6\n  EXC_STUB 7\n"
+    "EXC_STUB_ERR 8\n  EXC_STUB 9\n  EXC_STUB_ERR 10\n EXC_STUB_ERR 11\n"
+    "EXC_STUB_ERR 12\n EXC_STUB_ERR 13\n EXC_STUB_ERR 14\n EXC_STUB 15\n"
+    "EXC_STUB 16\n EXC_STUB_ERR 17\n EXC_STUB 18\n EXC_STUB 19\n"
+    "EXC_STUB 20\n EXC_STUB_ERR 21\n EXC_STUB 22\n EXC_STUB 23\n"
+    "EXC_STUB 24\n EXC_STUB 25\n EXC_STUB 26\n EXC_STUB 27\n"
+    "EXC_STUB 28\n EXC_STUB_ERR 29\n EXC_STUB_ERR 30\n EXC_STUB 31\n"
+    "exc_common:\n"
+    "    pusha\n"
+    "    cld\n"
+    "    push %esp\n"
+    "    call exc_dispatch\n"
+    ".section .rodata\n"
+    ".align 4\n"
+    "exc_stub_table:\n"
+    "    .long exc_stub_0, exc_stub_1, exc_stub_2, exc_stub_3\n"
+    "    .long exc_stub_4, exc_stub_5, exc_stub_6, exc_stub_7\n"
+    "    .long exc_stub_8, exc_stub_9, exc_stub_10, exc_stub_11\n"
+    "    .long exc_stub_12, exc_stub_13, exc_stub_14, exc_stub_15\n"
+    "    .long exc_stub_16, exc_stub_17, exc_stub_18, exc_stub_19\n"
+    "    .long exc_stub_20, exc_stub_21, exc_stub_22, exc_stub_23\n"
+    "    .long exc_stub_24, exc_stub_25, exc_stub_26, exc_stub_27\n"
+    "    .long exc_stub_28, exc_stub_29, exc_stub_30, exc_stub_31\n"
+    ".text\n"
+);
+extern const uint32_t exc_stub_table[32];
 
-void* kmalloc(size_t size) {
-    void* p = &heap[heap_pos];
-    heap_pos += size;
-    return p;
+// Local APIC and IO APIC, mapped once smp_init() finds them in the MADT.
+// Until then (or without them) IRQs come through the 8259s as before.
+#define LAPIC_ID      0x020
+#define LAPIC_TPR     0x080
+#define LAPIC_EOI     0x0B0
+#define LAPIC_SVR     0x0F0
+#define LAPIC_ICR_LO  0x300
+#define LAPIC_ICR_HI  0x310
+#define LAPIC_TIMER   0x320
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR  0x390
+#define LAPIC_TIMER_DIV  0x3E0
+
+static volatile uint32_t* lapic = 0;
+static volatile uint32_t* ioapic = 0;
+static uint32_t ioapic_gsi_base = 0;
+static uint32_t isa_gsi[16];   // ISA IRQ -> IO APIC input, after MADT overrides
+static uint16_t isa_flags[16]; // MPS INTI flags from the override (0 = ISA default)
+static uint8_t ioapic_dest = 0; // APIC ID that gets the device IRQs
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
 }
-// dodaj przed fs_create_node
-void* memset(void* dest, int val, size_t n) {
-    unsigned char* d = (unsigned char*)dest;
-    for (size_t i = 0; i < n; i++) d[i] = (unsigned char)val;
-    return dest;
+
+static inline void lapic_write(uint32_t reg, uint32_t val) {
+    lapic[reg / 4] = val;
 }
-void* memcpy(void* dest, const void* src, size_t n) {
-    unsigned char* d = (unsigned char*)dest;
-    const unsigned char* s = (const unsigned char*)src;
-    for (size_t i = 0; i < n; i++) {
-        d[i] = s[i];
-    }
-    return dest;
+
+static inline uint32_t ioapic_read(uint32_t reg) {
+    ioapic[0] = reg;
+    return ioapic[4];
 }
 
+static inline void ioapic_write(uint32_t reg, uint32_t val) {
+    ioapic[0] = reg;
+    ioapic[4] = val;
+}
 
-int strcmp(const char* a, const char* b) {
-    while (*a && (*a == *b)) { a++; b++; }
-    return *(unsigned char*)a - *(unsigned char*)b;
+// Point ISA IRQ irq at its vector on ioapic_dest, or mask it
+static void ioapic_route(int irq, int masked) {
+    uint32_t pin = isa_gsi[irq] - ioapic_gsi_base;
+    uint32_t lo = IRQ_BASE + irq;
+    if ((isa_flags[irq] & 0x3) == 0x3) lo |= 1 << 13;  // active low
+    if ((isa_flags[irq] & 0xC) == 0xC) lo |= 1 << 15;  // level triggered
+    if (masked) lo |= 1 << 16;
+    ioapic_write(0x11 + 2 * pin, (uint32_t)ioapic_dest << 24);
+    ioapic_write(0x10 + 2 * pin, lo);
 }
 
-char* strncpy(char* dst, const char* src, size_t n) {
-    size_t i;
-    for (i = 0; i < n && src[i]; i++) dst[i] = src[i];
-    for (; i < n; i++) dst[i] = 0;
-    return dst;
+static int ioapic_pins(void) {
+    return ((ioapic_read(0x01) >> 16) & 0xFF) + 1;
 }
 
+static inline void io_wait(void) {
+    outb(0x80, 0);
+}
 
-static int fs_edit_mode = 0;
-static fs_node* fs_edit_file = 0;
+static void gdt_init(void) {
+    struct gdt_ptr gp = { sizeof(gdt) - 1, (uint32_t)gdt };
+    __asm__ volatile (
+        "lgdt %0\n"
+        "ljmp $0x08, $1f\n"
+        "1:\n"
+        "mov $0x10, %%ax\n"
+        "mov %%ax, %%ds\n"
+        "mov %%ax, %%es\n"
+        "mov %%ax, %%fs\n"
+        "mov %%ax, %%gs\n"
+        "mov %%ax, %%ss\n"
+        : : "m"(gp) : "eax", "memory");
+    cpu_fs_load(0);
+}
 
-static char fs_edit_buffer[1024];
-static size_t fs_edit_pos = 0;
-static fs_node* fs_root = 0;
-static fs_node* fs_cwd = 0;
+static void idt_set_gate(int n, uint32_t handler) {
+    idt[n].base_lo = handler & 0xFFFF;
+    idt[n].sel = 0x08;
+    idt[n].zero = 0;
+    idt[n].flags = 0x8E; // present, ring 0, 32-bit interrupt gate
+    idt[n].base_hi = (handler >> 16) & 0xFFFF;
+}
 
+static void pic_write_mask(void) {
+    outb(PIC1_DATA, irq_mask & 0xFF);
+    outb(PIC2_DATA, (irq_mask >> 8) & 0xFF);
+}
 
-fs_node* fs_create_node(const char* name, int is_dir) {
-    fs_node* n = kmalloc(sizeof(fs_node));
-    memset(n, 0, sizeof(fs_node)); // zerowanie struktury
-    strncpy(n->name, name, MAX_NAME_LEN - 1);
-    n->is_dir = is_dir;
-    return n;
+// Move the PICs off the CPU exception vectors (0x08-0x0F) to 32-47
+static void pic_remap(void) {
+    outb(PIC1_CMD, 0x11); io_wait(); // ICW1: init + ICW4
+    outb(PIC2_CMD, 0x11); io_wait();
+    outb(PIC1_DATA, IRQ_BASE); io_wait();     // ICW2: vector offset
+    outb(PIC2_DATA, IRQ_BASE + 8); io_wait();
+    outb(PIC1_DATA, 0x04); io_wait(); // ICW3: slave on IRQ2
+    outb(PIC2_DATA, 0x02); io_wait();
+    outb(PIC1_DATA, 0x01); io_wait(); // ICW4: 8086 mode
+    outb(PIC2_DATA, 0x01); io_wait();
+    pic_write_mask();
 }
 
-void fs_init(void) {
-    fs_root = fs_create_node("~", 1);
-    fs_root->parent = fs_root;
-    fs_cwd = fs_root;
+void irq_install_handler(int irq, irq_handler_t handler) {
+    irq_handlers[irq] = handler;
+    if (irq >= 16) return; // local APIC vector, nothing to unmask
+    irq_mask &= ~(1 << irq);
+    if (ioapic) ioapic_route(irq, 0);
+    else pic_write_mask();
 }
 
-void fs_mkdir(const char* name) {
-    if (fs_cwd->child_count >= MAX_CHILDREN) {
-        vga_write("dir full\n");
-        return;
-    }
+void sched_irq_exit(void);
 
-    fs_node* d = fs_create_node(name, 1);
-    d->parent = fs_cwd;
-    fs_cwd->children[fs_cwd->child_count++] = d;
-}
-void fs_ls(void) {
-    for (int i = 0; i < fs_cwd->child_count; i++) {
-        fs_node* n = fs_cwd->children[i];
-        vga_write(n->is_dir ? "\n[FOLDERs] -> " : "\n[FILES] -> ");
-        vga_write(n->name);
-        vga_write("\n");
-    }
-}
-void fs_cd(const char* path) {
-    fs_node* cur;
+void irq_dispatch(struct irq_frame* f) {
+    int irq = f->vector - IRQ_BASE;
+    if (irq_handlers[irq])
+        irq_handlers[irq](f);
 
-    if (strncmp(path, "~", 1) == 0) {
-        cur = fs_root;
-        path++;
-        if (*path == '/') path++;
+    if (irq >= 16 || ioapic) {
+        lapic_write(LAPIC_EOI, 0);
     } else {
-        cur = fs_cwd;
+        if (irq >= 8) outb(PIC2_CMD, 0x20); // EOI
+        outb(PIC1_CMD, 0x20);
     }
+    sched_irq_exit(); // may switch threads; we come back here later
+}
 
-    while (*path) {
-        if (strncmp(path, "..", 2) == 0) {
-            cur = cur->parent;
-            path += 2;
-        } else {
-            // read dir name
-            char name[MAX_NAME_LEN];
-            int i = 0;
-            while (*path && *path != '/' && i < MAX_NAME_LEN - 1) {
-                name[i++] = *path++;
-            }
-            name[i] = 0;
-
-            int found = 0;
-            for (int j = 0; j < cur->child_count; j++) {
-                fs_node* n = cur->children[j];
-                if (n->is_dir && strcmp(n->name, name) == 0) {
-                    cur = n;
-                    found = 1;
-                    break;
-                }
-            }
-
-            if (!found) {
-                vga_write("folder/dir doesnt exist\n");
-                return;
-            }
-        }
-
-        if (*path == '/') path++;
+void interrupts_init(void) {
+    __asm__ volatile ("cli");
+    if (ioapic) { // reboot: back to the 8259s until smp_init() runs again
+        for (int pin = 0; pin < ioapic_pins(); pin++)
+            ioapic_write(0x10 + 2 * pin, 1 << 16);
     }
+    ioapic = 0;
+    lapic = 0;
+    gdt_init();
+    memset(idt, 0, sizeof(idt));
+    for (int i = 0; i < 32; i++)
+        idt_set_gate(i, exc_stub_table[i]);
+    for (int i = 0; i < IRQ_VECTORS; i++)
+        idt_set_gate(IRQ_BASE + i, irq_stub_table[i]);
+    idt_set_gate(SPURIOUS_VECTOR, irq_stub_table[IRQ_VECTORS]);
 
-    fs_cwd = cur;
+    struct idt_ptr ip = { sizeof(idt) - 1, (uint32_t)idt };
+    __asm__ volatile ("lidt %0" : : "m"(ip));
+    pic_remap();
 }
-void fs_dir_from(fs_node* dir) {
-    for (int i = 0; i < dir->child_count; i++) {
-        fs_node* n = dir->children[i];
-        if (n->is_dir) {
-            vga_write(n->name);
-            vga_write("\n");
-        }
-    }
+
+static inline void irq_enable(void) {
+    __asm__ volatile ("sti");
 }
 
-void fs_mkfile(const char* name) {
-    if (fs_cwd->child_count >= MAX_CHILDREN) {
-        vga_write("folder is full\n");
-        return;
-    }
+// Disable interrupts and return the previous EFLAGS for irq_restore()
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ volatile ("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
 
-    fs_node* f = fs_create_node(name, 0);
-    f->parent = fs_cwd;
-    fs_cwd->children[fs_cwd->child_count++] = f;
-    vga_write("\nmade file: ");
-    vga_write(name);
-    vga_write("\n");
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200) __asm__ volatile ("sti" : : : "memory");
 }
-void fs_delfile(const char* name) {
-    for (int i = 0; i < fs_cwd->child_count; i++) {
-        fs_node* n = fs_cwd->children[i];
-        if (!n->is_dir && strcmp(n->name, name) == 0) {
 
-            // shift children left
-            for (int j = i; j < fs_cwd->child_count - 1; j++) {
-                fs_cwd->children[j] = fs_cwd->children[j + 1];
-            }
+// ---------- spinlocks ----------
+// irq_save() only keeps this CPU out; data other CPUs touch needs one of
+// these as well (take it with interrupts off)
+
+struct spinlock {
+    volatile uint32_t locked;
+};
 
-            fs_cwd->child_count--;
+static inline void spin_lock(struct spinlock* l) {
+    while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE))
+        while (l->locked) __asm__ volatile ("pause");
+}
 
-            vga_write("\nmade file: ");
-            vga_write(name);
-            vga_write("\n");
-            return;
-        }
-    }
-    vga_write("file was not found\n");
+static inline void spin_unlock(struct spinlock* l) {
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
 }
 
-void fs_edfile_start(const char* name) {
-    for (int i = 0; i < fs_cwd->child_count; i++) {
-        fs_node* f = fs_cwd->children[i];
-        if (!f->is_dir && strcmp(f->name, name) == 0) {
-            fs_edit_mode = 1;
-            fs_edit_file = f;
-            fs_edit_pos = 0;
-            vga_write("\n-- editing --\n");
-            vga_write("TAB = save & leave\n");
-            fs_edit_mode = 1;
-            fs_edit_file = f;
-            fs_edit_pos = 0;
-            return;
+// ---------- timer (PIT channel 0 -> IRQ0) ----------
 
-        }
-    }
-    vga_write("file was not found.\n");
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND 0x43
+#define PIT_BASE_HZ 1193182
+#define TIMER_HZ 1000 // 1 tick = 1 ms
+
+static volatile uint64_t timer_ticks = 0;
+
+// A pending deadline; fn runs from IRQ0 once timer_ticks reaches it
+struct timer {
+    uint64_t deadline;
+    void (*fn)(void* arg);
+    void* arg;
+};
+
+// binary min-heap ordered by deadline, so IRQ0 only ever looks at [0]
+#define MAX_TIMERS 32
+static struct timer* timer_heap[MAX_TIMERS];
+static int timer_count = 0;
+static struct spinlock timer_lock; // timer_add() may run on any CPU
+
+static void timer_heap_swap(int a, int b) {
+    struct timer* t = timer_heap[a];
+    timer_heap[a] = timer_heap[b];
+    timer_heap[b] = t;
 }
-void fs_rdfile(const char* name) {
-    for (int i = 0; i < fs_cwd->child_count; i++) {
-        fs_node* f = fs_cwd->children[i];
-        if (!f->is_dir && strcmp(f->name, name) == 0) {
-            if (f->data)
-                vga_write((char*)f->data);
-            vga_write("\n");
-            return;
-        }
+
+static struct timer* timer_heap_pop(void) {
+    struct timer* top = timer_heap[0];
+    timer_heap[0] = timer_heap[--timer_count];
+
+    int i = 0;
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < timer_count && timer_heap[l]->deadline < timer_heap[m]->deadline) m = l;
+        if (r < timer_count && timer_heap[r]->deadline < timer_heap[m]->deadline) m = r;
+        if (m == i) break;
+        timer_heap_swap(i, m);
+        i = m;
     }
-    vga_write("file was not found.\n");
+    return top;
 }
 
+// Returns -1 if the heap is full
+int timer_add(struct timer* t) {
+    uint32_t flags = irq_save();
+    spin_lock(&timer_lock);
+    if (timer_count >= MAX_TIMERS) {
+        spin_unlock(&timer_lock);
+        irq_restore(flags);
+        return -1;
+    }
 
-uint16_t vga_entry(char c, uint8_t color)
-{
-    return (uint16_t)c | (uint16_t)color << 8;
+    int i = timer_count++;
+    timer_heap[i] = t;
+    while (i > 0 && timer_heap[(i - 1) / 2]->deadline > timer_heap[i]->deadline) {
+        timer_heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    spin_unlock(&timer_lock);
+    irq_restore(flags);
+    return 0;
 }
 
-// Get default color based on SP8LF mode
-static uint8_t vga_get_default_color(void) {
-    if (sp8lf_mode) {
-        return 0x70;  // SP8LF mode: black on white (fg=0x00, bg=0x07)
+static void sched_tick(void);
+void perf_sample(uint32_t eip);
+
+static void timer_irq(struct irq_frame* f) {
+    timer_ticks++;
+    perf_sample(f->eip);
+    spin_lock(&timer_lock);
+    while (timer_count > 0 && timer_heap[0]->deadline <= timer_ticks) {
+        struct timer* t = timer_heap_pop();
+        spin_unlock(&timer_lock); // fn may add a timer
+        t->fn(t->arg);
+        spin_lock(&timer_lock);
     }
-    return 0x07;  // Normal mode: white on black (fg=0x07, bg=0x00)
+    spin_unlock(&timer_lock);
+    sched_tick();
 }
 
-void vga_clear(void)
-{
-    uint8_t default_color = vga_get_default_color();
-    for (int y = 0; y < VGA_HEIGHT; y++)
-        for (int x = 0; x < VGA_WIDTH; x++)
-            vga_buffer[y * VGA_WIDTH + x] = vga_entry(' ', default_color);
+// Monotonic milliseconds since timer_init(). IRQ0 may be bumping the
+// count on another CPU, so read the halves until they agree.
+uint64_t timer_now(void) {
+    volatile uint32_t* half = (volatile uint32_t*)&timer_ticks;
+    uint32_t hi, lo;
+    do {
+        hi = half[1];
+        lo = half[0];
+    } while (hi != half[1]);
+    return (uint64_t)hi << 32 | lo;
+}
 
-    cursor_x = 0;
-    cursor_y = 0;
-    update_cursor();
+void timer_init(void) {
+    uint32_t divisor = PIT_BASE_HZ / TIMER_HZ;
+    outb(PIT_COMMAND, 0x36); // channel 0, LSB then MSB, mode 3 (square wave), binary
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+    timer_count = 0;
+    timer_lock.locked = 0;
+    irq_install_handler(0, timer_irq);
 }
 
-static void vga_scroll(void)
-{
-    uint8_t default_color = vga_get_default_color();
-    for (int y = 1; y < VGA_HEIGHT; y++)
-        for (int x = 0; x < VGA_WIDTH; x++)
-            vga_buffer[(y - 1) * VGA_WIDTH + x] =
-                vga_buffer[y * VGA_WIDTH + x];
+// ---------- kernel threads ----------
+// Every thread owns a stack; switch_to() pushes the callee-saved registers
+// and EFLAGS on the old one and pops them off the new one. The timer tick
+// charges the running thread and ends its slice; the switch itself happens
+// on the way out of irq_dispatch() after the EOI, so a preempted thread
+// later resumes through its own iret.
+//
+// Each CPU has its own run queue and an idle thread (its boot context) that
+// only runs when the queue is empty. A CPU that runs dry steals from the
+// longest queue. A thread stays on_cpu until the CPU it ran on is off its
+// stack; until then it stays queued and nobody picks it, since waiting for
+// it with interrupts off can deadlock two CPUs that each wait on the other.
 
-    for (int x = 0; x < VGA_WIDTH; x++)
-        vga_buffer[(VGA_HEIGHT - 1) * VGA_WIDTH + x] =
-            vga_entry(' ', default_color);
+#define THREAD_MAX 32
+#define THREAD_STACK_SIZE (16 * 1024)
+#define SCHED_SLICE_MS 10
+#define CPU_MAX 8
 
-    cursor_y = VGA_HEIGHT - 1;
-    update_cursor();
+enum { T_FREE, T_RUNNABLE, T_SLEEPING, T_DEAD };
+
+struct thread {
+    uint32_t esp;        // saved by switch_to()
+    int state;
+    int id;
+    const char* name;
+    uint32_t stack;      // pmm frames, kept for the next thread in this slot
+    void (*fn)(void* arg);
+    void* arg;
+    int cpu;             // last CPU it ran on, whose run queue it goes back to
+    volatile int on_cpu;
+    uint64_t ticks;      // ms spent running
+    uint32_t switches;   // times switched in
+    struct thread* next; // run queue / wait queue link
+};
+
+// FIFO of threads, linked through thread.next
+struct waitq {
+    struct spinlock lock;
+    struct thread* head;
+    struct thread* tail;
+};
+
+// Sleeping lock; the owner may block while holding it
+struct mutex {
+    struct thread* owner;
+    struct waitq waiters;
+};
+
+struct cpu {
+    struct cpu* self; // at %fs:0
+    int id;
+    uint8_t apic_id;
+    volatile int online;
+    struct thread* current;
+    struct thread* idle;
+    struct thread* switch_prev; // thread we are switching away from
+    struct waitq runq;          // lock guards nrun too
+    volatile int nrun;
+    volatile int need_resched;
+    int slice;
+    uint32_t steals;
+    struct cpu_stats stats;
+};
+
+static struct thread threads[THREAD_MAX];
+static struct spinlock threads_lock; // slot allocation
+static int thread_next_id = 0;
+static struct cpu cpus[CPU_MAX];
+_Static_assert(GDT_CPU + CPU_MAX <= GDT_ENTRIES, "one GDT entry per CPU");
+static int cpu_count = 1;
+static uint8_t cpu_by_apic[256];
+
+// Big lock over the shell's world (fs tree, block cache, disk, heap);
+// background threads take it around anything that touches those
+static struct mutex kernel_lock;
+
+uint32_t pmm_alloc_frames(uint32_t count);
+void switch_to(uint32_t* save_esp, uint32_t esp);
+
+__asm__(
+    ".text\n"
+    "switch_to:\n"
+    "    mov 4(%esp), %eax\n"
+    "    mov 8(%esp), %edx\n"
+    "    push %ebp\n"
+    "    push %ebx\n"
+    "    push %esi\n"
+    "    push %edi\n"
+    "    pushf\n"
+    "    mov %esp, (%eax)\n"
+    "    mov %edx, %esp\n"
+    "    popf\n"
+    "    pop %edi\n"
+    "    pop %esi\n"
+    "    pop %ebx\n"
+    "    pop %ebp\n"
+    "    ret\n"
+);
+
+// %fs on each CPU is a data segment based at its struct cpu, so finding
+// it is one load rather than an uncached local APIC ID read
+static void cpu_fs_load(int id) {
+    struct cpu* c = &cpus[id];
+    uint32_t base = (uint32_t)c, limit = sizeof(*c) - 1;
+    c->self = c;
+    gdt[GDT_CPU + id] = (limit & 0xFFFF) | (uint64_t)(base & 0xFFFFFF) << 16 |
+                        0x92ULL << 40 | // present, ring 0, read/write data
+                        (uint64_t)(limit >> 16 & 0xF) << 48 | 0x4ULL << 52 | // 32-bit, byte limit
+                        (uint64_t)(base >> 24) << 56;
+    __asm__ volatile ("mov %0, %%fs" : : "r"((uint16_t)((GDT_CPU + id) * 8)) : "memory");
 }
 
-void vga_putc(char c)
-{
-    if (c == '\n')
-    {
-        cursor_x = 0;
-        cursor_y++;
-    }
-    else
-    {
-        vga_buffer[cursor_y * VGA_WIDTH + cursor_x] =
-            vga_entry(c, vga_color);
-        cursor_x++;
-    }
+static inline struct cpu* cpu_this(void) {
+    struct cpu* c;
+    __asm__ volatile ("mov %%fs:0, %0" : "=r"(c)); // volatile: threads migrate
+    return c;
+}
 
-    if (cursor_x >= VGA_WIDTH)
-    {
-        cursor_x = 0;
-        cursor_y++;
-    }
+// Just the index, for hot paths that want nothing else (klog)
+static inline int cpu_id_this(void) {
+    int id;
+    __asm__ volatile ("mov %%fs:%c1, %0" : "=r"(id) : "i"(__builtin_offsetof(struct cpu, id)));
+    return id;
+}
 
-    if (cursor_y >= VGA_HEIGHT)
-        vga_scroll();
-    
-    update_cursor();
+struct cpu_stats* cpu_stats_this(void) {
+    return &cpu_this()->stats;
 }
 
-void vga_write(const char* str)
-{
-    while (*str)
-        vga_putc(*str++);
+static void waitq_push(struct waitq* q, struct thread* t) {
+    t->next = 0;
+    if (q->tail) q->tail->next = t;
+    else q->head = t;
+    q->tail = t;
 }
 
-void vga_set_color(uint8_t fg, uint8_t bg)
-{
-    vga_color = fg | bg << 4;
+static struct thread* waitq_pop(struct waitq* q) {
+    struct thread* t = q->head;
+    if (t) {
+        q->head = t->next;
+        if (!q->head) q->tail = 0;
+        t->next = 0;
+    }
+    return t;
 }
 
-void testascii()
-{
-    vga_write("test ascii nie istnieje.\n");
+static void runq_push(struct cpu* c, struct thread* t) {
+    spin_lock(&c->runq.lock);
+    waitq_push(&c->runq, t);
+    c->nrun++;
+    t->cpu = c->id;
+    spin_unlock(&c->runq.lock);
 }
 
-// ---------- command handling ----------
-// ---------- command handling ----------
-void handle_command(const char* cmd)
-{
-    if (strncmp(cmd, "help", 5) == 0) {
-        vga_write("\nexisting commands:\n");
-        vga_write("help - list of all commands\ncalc <a> <operator> <b> - very easy and dumb calculator\n");
-        vga_write("clear - clear screen\n");
-        vga_write("about - about ibant-os\n");
-        vga_write("version - show version\n");
-        vga_write("halt - stop/halt CPU\n");
-        vga_write("reboot - go back to _start();\nclick any key to continue...\n");
-        get_char(); //wait for key input
-        vga_write("bgcolor <0-15> - change background color\n");
-        vga_write("fgcolor <0-15> - change foreground color\n");
-        vga_write("echo <text> - echo your text!\n");
-        vga_write("mkdir <dirname> - make new folder/directory\n");
-        get_char(); //wait for key input
-        vga_write("mkfile <filename> - make new file\nedfile <filename> - edit your files contents\nrdfile <filename> - read file contents\ndelfile <filename> - delete file\ndir - show all continuing directories in your current directory\ndir ~ - show all directories\ncd <directroy> - change directory\nls - list everything");
-        get_char(); //wait for key input
-    }
-    else if (strncmp(cmd, "\n", 1) == 0){vga_write("");}
-    else if (strncmp(cmd, "vgatest", 8) == 0) {testascii();}
-    else if (strncmp(cmd, "edfile ", 7) == 0){
-        vga_set_color(0x01, 0x07); //blue on white
-        fs_edfile_start(cmd + 7);
-        vga_set_color(0x00, 0x07); //default black on white
-    }
-    else if (strncmp(cmd, "cd ", 3) == 0){
-        vga_set_color(0x0E, 0x07); //yellow on white
-        fs_cd(cmd + 3);
-        vga_set_color(0x01, 0x07); //blue on white
-        }
-    else if (strncmp(cmd, "ls", 2) == 0){
-        vga_set_color(0x0E, 0x07); //yellow on white
-        fs_ls();
-        vga_set_color(0x01, 0x07); //blue on white
-    }
-    else if (strncmp(cmd, "mkfile ", 7) == 0) {
-    const char* name = cmd + 7;
-    vga_set_color(0x0E, 0x07); //yellow on black
-    fs_mkfile(name);
-    vga_write("\nMade new file: ");
-    vga_write(name);
-    vga_write(" in dir: ");
-    vga_write(fs_cwd->name);
-    vga_write("\n");
-    vga_set_color(0x01, 0x07); //blue on white
+// First thread on c's queue that no CPU is still leaving
+static struct thread* runq_pop(struct cpu* c) {
+    spin_lock(&c->runq.lock);
+    struct thread* before = 0;
+    struct thread* t = c->runq.head;
+    while (t && t->on_cpu) {
+        before = t;
+        t = t->next;
     }
-    else if (strncmp(cmd, "mkdir ", 6) == 0) {
-        const char* name = cmd + 6;
-        vga_set_color(0x0E, 0x07); //blue on white
-        fs_mkdir(name);
-        vga_write("\nMade new directory: ");
-        vga_write(name);
-        vga_write(" in dir: ");
-        vga_write(fs_cwd->name);
-        vga_write("\n");
-        vga_set_color(0x01, 0x07); //blue on white
+    if (t) {
+        if (before) before->next = t->next;
+        else c->runq.head = t->next;
+        if (c->runq.tail == t) c->runq.tail = before;
+        t->next = 0;
+        c->nrun--;
     }
-    else if (strncmp(cmd, "rdfile ", 7) == 0) {
-        vga_set_color(0x0E, 0x07); //default
-        fs_rdfile(cmd + 7);
-        vga_set_color(0x01, 0x07); //blue on white
+    spin_unlock(&c->runq.lock);
+    return t;
+}
+
+// Nothing queued here: take a thread from the longest queue elsewhere
+static struct thread* sched_steal(struct cpu* self) {
+    struct cpu* victim = 0;
+    int most = 0;
+    for (int i = 0; i < cpu_count; i++) {
+        if (&cpus[i] == self || !cpus[i].online) continue;
+        if (cpus[i].nrun > most) {
+            most = cpus[i].nrun;
+            victim = &cpus[i];
+        }
     }
-    else if (strncmp(cmd, "dir ~", 5) == 0) {
-    vga_set_color(0x0E, 0x07); //blue on white
-    fs_dir_from(fs_root);
-    vga_set_color(0x01, 0x07); //blue on white
+    struct thread* t = victim ? runq_pop(victim) : 0;
+    if (t) self->steals++;
+    return t;
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint32_t icr);
+
+// Make c look at its run queue soon; another CPU gets an IPI
+static void sched_kick(struct cpu* c) {
+    c->need_resched = 1;
+    if (c != cpu_this() && lapic)
+        lapic_send_ipi(c->apic_id, IRQ_BASE + IRQ_RESCHED);
 }
-else if (strncmp(cmd, "dir", 3) == 0) {
-    fs_dir_from(fs_cwd);
+
+// Runs as the new thread, once we are off the old one's stack
+static void sched_switch_done(void) {
+    struct cpu* c = cpu_this();
+    c->switch_prev->on_cpu = 0;
 }
-    else if (strncmp(cmd, "delfile ", 8) == 0) {
-        fs_delfile(cmd + 8);
-    }
-    else if (strncmp(cmd, "clear", 6) == 0) {
-        vga_clear();
-    }
-    else if (strncmp(cmd, "calc ", 5) == 0) {
-        vga_set_color(0x0A, 0x00); //blue on black
-        calc_command(cmd);
-        vga_set_color(0x01, 0x00); //blue on black
+
+// Switch to the next runnable thread; interrupts must be off. requeue puts
+// the current thread back on the run queue (preemption, yield).
+static void schedule(int requeue) {
+    struct cpu* c = cpu_this();
+    struct thread* prev = c->current;
+    c->need_resched = 0;
+    c->slice = SCHED_SLICE_MS;
+    requeue = requeue && prev != c->idle;
+
+    struct thread* next = runq_pop(c);
+    if (!next) next = sched_steal(c);
+    if (!next && requeue) return; // nothing else is ready: keep running
+    if (requeue) runq_push(c, prev);
+    if (!next) next = c->idle;
+    if (next == prev) return;
+
+    next->on_cpu = 1;
+    next->cpu = c->id;
+    next->switches++;
+    c->current = next;
+    c->switch_prev = prev;
+    switch_to(&prev->esp, next->esp);
+    sched_switch_done();
+}
+
+// Timer tick on this CPU: charge the running thread, end its slice, and
+// have an idle CPU go looking for work
+static void sched_tick(void) {
+    struct cpu* c = cpu_this();
+    if (!c->current) return;
+    c->current->ticks++;
+    if (c->current == c->idle) {
+        for (int i = 0; i < cpu_count && !c->need_resched; i++)
+            if (cpus[i].nrun) c->need_resched = 1;
         return;
     }
-    else if (strncmp(cmd, "about", 6) == 0) {
-        vga_set_color(0x04, 0x07);
-        vga_write("\niBANT-OS: x86 aka: (i386) OS.\n");
-        vga_write("Made by Julian Dziubak.\n");
-        vga_write("Made in C\n");
-        vga_set_color(0x01, 0x00); //blue on black
-    }
-    else if (strncmp(cmd, "version", 8) == 0) {
-        vga_write("\niBANT-OS Version 1.6 ENGLISH\n");
-    }
-    else if (strncmp(cmd, "halt", 5) == 0) {
-        while (1) { } // hang
-    }
-    else if (strncmp(cmd, "reboot", 7) == 0) {
-        _start(); // restart
-    }
-    else if (strncmp(cmd, "bgcolor", 8) == 0) {
-        int bg = atoi(cmd + 9); // skip "bgcolor "
-        if (bg >= 0 && bg <= 15) vga_set_color(vga_color & 0x0F, bg);
-        else vga_write("\nInvalid color. Use 0-15.\n");
-    }
-    else if (strncmp(cmd, "fgcolor", 8) == 0) {
-        int fg = atoi(cmd + 9); // skip "fgcolor "
-        if (fg >= 0 && fg <= 15) vga_set_color(fg, vga_color >> 4);
-        else vga_write("\nInvalid color. Use 0-15.\n");
-    }
-    else if (strncmp(cmd, "echo", 5) == 0) {
-        vga_write("\n");
-        vga_write(cmd + 6); // skip "echo "
-        vga_write("\n");
-    }
-    else {
-        vga_write("\nUnknown command. Type help for commands.\n");
+    if (--c->slice <= 0) {
+        if (c->nrun) c->need_resched = 1;
+        else c->slice = SCHED_SLICE_MS;
     }
 }
 
-// calculator
-void calc_command(const char* cmd)
-{
-    int a = 0, b = 0;
-    char op = 0;
-
-    // skip "calc "
-    cmd += 5;
+// Last thing irq_dispatch() does, after the EOI
+void sched_irq_exit(void) {
+    struct cpu* c = cpu_this();
+    if (c->need_resched && c->current) schedule(1);
+}
 
-    a = atoi(cmd);
+// Can the caller block? Not before sched_init(), and never an idle thread
+static int sched_can_block(void) {
+    struct cpu* c = cpu_this();
+    return c->current && c->current != c->idle;
+}
 
-    // move past first number
-    while (*cmd >= '0' && *cmd <= '9') cmd++;
+static void mutex_init(struct mutex* m) {
+    memset(m, 0, sizeof(*m));
+}
 
-    // skip spaces
-    while (*cmd == ' ') cmd++;
+// Make the running context c's idle thread
+static void sched_init_cpu(struct cpu* c, const char* name, uint32_t stack) {
+    spin_lock(&threads_lock);
+    struct thread* t = 0;
+    for (int i = 0; i < THREAD_MAX && !t; i++)
+        if (threads[i].state == T_FREE) t = &threads[i];
+    t->state = T_RUNNABLE;
+    t->id = thread_next_id++;
+    t->name = name;
+    t->stack = stack;
+    t->cpu = c->id;
+    t->on_cpu = 1;
+    spin_unlock(&threads_lock);
 
-    op = *cmd++;
+    c->runq.head = c->runq.tail = 0;
+    c->runq.lock.locked = 0;
+    c->nrun = 0;
+    c->need_resched = 0;
+    c->slice = SCHED_SLICE_MS;
+    c->idle = c->current = t;
+}
 
-    while (*cmd == ' ') cmd++;
+// Adopt the boot context as CPU 0's idle thread; APs add theirs later
+void sched_init(void) {
+    uint32_t flags = irq_save();
+    memset(threads, 0, sizeof(threads)); // after a reboot the old stacks are gone too
+    memset(cpus, 0, sizeof(cpus));
+    memset(cpu_by_apic, 0, sizeof(cpu_by_apic));
+    cpu_fs_load(0); // self went with the memset
+    threads_lock.locked = 0;
+    thread_next_id = 0;
+    cpu_count = 1;
+    mutex_init(&kernel_lock);
+    cpus[0].online = 1;
+    sched_init_cpu(&cpus[0], "idle0", 0);
+    irq_restore(flags);
+}
 
-    b = atoi(cmd);
+void thread_exit(void) {
+    irq_save();
+    cpu_this()->current->state = T_DEAD; // slot and stack are reused by thread_create()
+    schedule(0);
+    while (1) __asm__ volatile ("hlt"); // not reached
+}
 
-    int result = 0;
-    int valid = 1;
+// First code a new thread runs; switch_to() got here with interrupts off
+static void thread_start(void) {
+    sched_switch_done();
+    struct thread* t = cpu_this()->current;
+    irq_enable();
+    t->fn(t->arg);
+    thread_exit();
+}
 
-    switch (op) {
-        case '+': result = a + b; break;
-        case '-': result = a - b; break;
-        case '*': result = a * b; break;
-        case '/':
-            if (b == 0) {
-                vga_write("division by zero\n");
-                return;
-            }
-            result = a / b;
-            break;
-        default:
-            valid = 0;
+// Returns the new thread's id, or -1 if out of slots or memory. It starts
+// on the CPU with the shortest run queue.
+int thread_create(const char* name, void (*fn)(void* arg), void* arg) {
+    uint32_t flags = irq_save();
+    spin_lock(&threads_lock);
+    struct thread* t = 0;
+    for (int i = 0; i < THREAD_MAX && !t; i++) {
+        struct thread* s = &threads[i];
+        if (s->state == T_FREE || (s->state == T_DEAD && !s->on_cpu)) t = s;
     }
-
-    if (!valid) {
-        vga_write("invalid operator\n");
-        return;
+    if (t && !t->stack) t->stack = pmm_alloc_frames(THREAD_STACK_SIZE / 4096);
+    if (!t || !t->stack) {
+        spin_unlock(&threads_lock);
+        irq_restore(flags);
+        return -1;
     }
 
-    char buf[32];
-    int i = 30;
-    buf[31] = 0;
+    // the frame switch_to() pops: EFLAGS, edi, esi, ebx, ebp, return address
+    uint32_t* sp = (uint32_t*)(t->stack + THREAD_STACK_SIZE);
+    *--sp = 0;                       // thread_start never returns
+    *--sp = (uint32_t)thread_start;
+    for (int i = 0; i < 4; i++) *--sp = 0;
+    *--sp = 0x002;                   // IF clear until thread_start
 
-    int r = result;
-    if (r == 0) buf[i--] = '0';
+    t->esp = (uint32_t)sp;
+    t->id = thread_next_id++;
+    t->name = name;
+    t->fn = fn;
+    t->arg = arg;
+    t->on_cpu = 0;
+    t->ticks = 0;
+    t->switches = 0;
+    t->state = T_RUNNABLE;
+    int id = t->id;
+    spin_unlock(&threads_lock);
 
-    int neg = (r < 0);
-    if (neg) r = -r;
+    struct cpu* target = cpu_this();
+    for (int i = 0; i < cpu_count; i++)
+        if (cpus[i].online && cpus[i].nrun + (cpus[i].current != cpus[i].idle) <
+                              target->nrun + (target->current != target->idle))
+            target = &cpus[i];
+    runq_push(target, t);
+    sched_kick(target);
+    irq_restore(flags);
+    return id;
+}
 
-    while (r > 0) {
-        buf[i--] = '0' + (r % 10);
-        r /= 10;
-    }
+void thread_yield(void) {
+    uint32_t flags = irq_save();
+    schedule(1);
+    irq_restore(flags);
+}
 
-    if (neg) buf[i--] = '-';
+// Block on q until thread_wake_all(). Call with interrupts off and q->lock
+// held, having just seen the condition false; returns with the lock
+// dropped, and the caller rechecks.
+void thread_wait(struct waitq* q) {
+    struct thread* t = cpu_this()->current;
+    t->state = T_SLEEPING;
+    waitq_push(q, t);
+    spin_unlock(&q->lock);
+    schedule(0);
+}
 
-    vga_write("= ");
-    vga_write(&buf[i + 1]);
-    vga_write("\n");
+// Make everything on q runnable on the CPU it last ran on; q->lock held
+static void waitq_wake_locked(struct waitq* q) {
+    struct thread* t;
+    while ((t = waitq_pop(q))) {
+        t->state = T_RUNNABLE;
+        runq_push(&cpus[t->cpu], t);
+        sched_kick(&cpus[t->cpu]); // woken threads are usually interactive
+    }
 }
 
+// Same, taking the lock; fine to call from an IRQ handler
+void thread_wake_all(struct waitq* q) {
+    uint32_t flags = irq_save();
+    spin_lock(&q->lock);
+    waitq_wake_locked(q);
+    spin_unlock(&q->lock);
+    irq_restore(flags);
+}
 
+void mutex_lock(struct mutex* m) {
+    uint32_t flags = irq_save();
+    spin_lock(&m->waiters.lock);
+    while (m->owner) {
+        thread_wait(&m->waiters);
+        spin_lock(&m->waiters.lock);
+    }
+    m->owner = cpu_this()->current;
+    spin_unlock(&m->waiters.lock);
+    irq_restore(flags);
+}
 
-// ---------- input handling ----------
-void read_input_char(char c)
-{
-    if (fs_edit_mode) {
-        if (c == '\t') { // TAB = zapis
-            fs_edit_buffer[fs_edit_pos] = 0;
+void mutex_unlock(struct mutex* m) {
+    uint32_t flags = irq_save();
+    spin_lock(&m->waiters.lock);
+    m->owner = 0;
+    waitq_wake_locked(&m->waiters);
+    spin_unlock(&m->waiters.lock);
+    irq_restore(flags);
+}
 
-            fs_edit_file->data = kmalloc(fs_edit_pos + 1);
-            memcpy(fs_edit_file->data, fs_edit_buffer, fs_edit_pos + 1);
-            fs_edit_file->size = fs_edit_pos;
+struct delay {
+    volatile int done;
+    struct waitq q;
+};
 
-            fs_edit_mode = 0;
-            fs_edit_file = 0;
+// Runs from IRQ0; d lives on the sleeper's stack, so finish with it
+// before dropping the lock
+static void delay_wake(void* arg) {
+    struct delay* d = arg;
+    spin_lock(&d->q.lock);
+    d->done = 1;
+    waitq_wake_locked(&d->q);
+    spin_unlock(&d->q.lock);
+}
 
-            vga_write("\n-- SAVED --\n");
-            vga_write("[ibant]> ");
+// Sleep for ms milliseconds; other threads run meanwhile, or (idle, early
+// boot) the CPU halts until the deadline fires
+void delay_ms(unsigned int ms) {
+    struct delay d;
+    memset(&d, 0, sizeof(d));
+    struct timer t = { timer_now() + ms, delay_wake, &d };
+
+    uint32_t flags = irq_save();
+    if (timer_add(&t) < 0) {
+        // heap full: fall back to checking the clock on every tick
+        while (timer_now() < t.deadline)
+            __asm__ volatile ("sti; hlt; cli");
+    } else {
+        while (!d.done) {
+            if (!sched_can_block()) {
+                __asm__ volatile ("sti; hlt; cli"); // sti shadow: no wakeup lost
+                continue;
+            }
+            spin_lock(&d.q.lock);
+            if (d.done) spin_unlock(&d.q.lock);
+            else thread_wait(&d.q);
+        }
+        // delay_wake() may still hold d on another CPU
+        spin_lock(&d.q.lock);
+        spin_unlock(&d.q.lock);
+    }
+    irq_restore(flags);
+}
+
+// TSC rate measured against the PIT on first use
+static uint32_t tsc_khz = 0;
+
+uint32_t tsc_get_khz(void) {
+    if (!tsc_khz) {
+        uint64_t t0 = timer_now();
+        while (timer_now() == t0) __asm__ volatile ("hlt"); // line up with a tick
+        uint64_t c0 = rdtsc();
+        delay_ms(50);
+        tsc_khz = (uint32_t)udiv64(rdtsc() - c0, 50, 0);
+        if (!tsc_khz) tsc_khz = 1;
+    }
+    return tsc_khz;
+}
+
+// ---------- kernel log ----------
+// klog() drops a fixed-size binary record (TSC, CPU, level, format pointer,
+// up to KLOG_ARGS 32-bit arguments) into a ring; nothing is formatted until
+// dmesg reads it. Producers on any CPU or in IRQ handlers claim a slot with
+// one atomic add and publish it by storing its sequence number last, so
+// logging never takes a lock or waits for the console. The newest
+// KLOG_SIZE records survive; older ones are overwritten.
+// %s arguments are kept as pointers and must still be valid at dmesg time.
+
+#define KLOG_SIZE 1024 // records, power of two
+#define KLOG_ARGS 3 // klog() itself and the levels are in platform.h
+
+struct klog_rec {
+    volatile uint32_t seq; // ring position + 1 once complete, 0 while written
+    uint8_t level;
+    uint8_t cpu;
+    uint8_t nargs;
+    uint8_t reserved;
+    uint64_t tsc;
+    const char* fmt;
+    uint32_t arg[KLOG_ARGS];
+};
+
+static struct klog_rec klog_ring[KLOG_SIZE];
+static volatile uint32_t klog_head = 0; // next position to claim
+static uint32_t klog_tail = 0;          // dmesg -c: first position still shown
+
+void klog_write(int level, const char* fmt, int nargs, ...) {
+    uint32_t pos = __atomic_fetch_add(&klog_head, 1, __ATOMIC_RELAXED);
+    struct klog_rec* r = &klog_ring[pos & (KLOG_SIZE - 1)];
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // readers see seq 0 before the new fields
+
+    r->level = level;
+    r->cpu = cpu_id_this();
+    r->nargs = nargs;
+    r->tsc = rdtsc();
+    r->fmt = fmt;
+    __builtin_va_list ap;
+    __builtin_va_start(ap, nargs);
+    for (int i = 0; i < nargs && i < KLOG_ARGS; i++)
+        r->arg[i] = __builtin_va_arg(ap, uint32_t);
+    __builtin_va_end(ap);
+
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Copy record pos out; 0 if it is unfinished or got overwritten meanwhile
+static int klog_read(uint32_t pos, struct klog_rec* out) {
+    struct klog_rec* r = &klog_ring[pos & (KLOG_SIZE - 1)];
+    uint32_t seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+    if (seq != pos + 1) return 0;
+    out->level = r->level;
+    out->cpu = r->cpu;
+    out->nargs = r->nargs;
+    out->tsc = r->tsc;
+    out->fmt = r->fmt;
+    for (int i = 0; i < KLOG_ARGS; i++) out->arg[i] = r->arg[i];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq;
+}
+
+void klog_init(void) {
+    memset(klog_ring, 0, sizeof(klog_ring));
+    klog_head = klog_tail = 0;
+}
+
+// ---------- serial console (COM1, 16550) ----------
+// Console output is queued in serial_tx and drained by the THR-empty
+// interrupt, a FIFO load (16 bytes) at a time, so printing never waits on
+// the line unless the ring is full. Received bytes land in serial_rx and
+// get_char() reads them next to the PS/2 keyboard. When serial_rx is full
+// the RX interrupt goes off and bytes wait in the UART, so a fast sender
+// (a script pasting into the editor) stalls instead of losing input.
+
+#define COM1 0x3F8
+#define SERIAL_TX_SIZE 4096 // powers of two
+#define SERIAL_RX_SIZE 256
+#define SERIAL_FIFO 16
+
+static volatile uint8_t serial_tx[SERIAL_TX_SIZE];
+static volatile uint32_t serial_tx_head = 0, serial_tx_tail = 0;
+static volatile uint8_t serial_rx[SERIAL_RX_SIZE];
+static volatile uint32_t serial_rx_head = 0, serial_rx_tail = 0;
+static volatile int serial_tx_irq = 0; // THR-empty interrupt enabled
+static volatile int serial_rx_held = 0; // RX interrupt off until serial_rx drains
+static int serial_present = 0;
+static int serial_unget = -1;
+static struct waitq input_waitq; // threads waiting in kbd_read_scancode()
+static struct spinlock serial_lock; // TX ring: any CPU fills it, IRQ4 drains it
+
+// RX unless held, TX while there is work; serial_lock held
+static void serial_set_ier(void) {
+    outb(COM1 + 1, (serial_rx_held ? 0 : 0x01) | (serial_tx_irq ? 0x02 : 0));
+}
+
+// Refill the (empty) transmit FIFO from the ring; interrupts are off
+static void serial_fill_fifo(void) {
+    for (int n = 0; n < SERIAL_FIFO && serial_tx_tail != serial_tx_head; n++)
+        outb(COM1, serial_tx[serial_tx_tail++ & (SERIAL_TX_SIZE - 1)]);
+    int more = serial_tx_tail != serial_tx_head;
+    if (more != serial_tx_irq) {
+        serial_tx_irq = more;
+        serial_set_ier();
+    }
+}
+
+static void serial_irq(struct irq_frame* f) {
+    (void)f;
+    uint8_t iir;
+    spin_lock(&serial_lock);
+    while (!((iir = inb(COM1 + 2)) & 0x01)) {
+        switch (iir & 0x0E) {
+            case 0x04: // received data
+            case 0x0C: // FIFO timeout
+                while (inb(COM1 + 5) & 0x01) {
+                    if (serial_rx_head - serial_rx_tail == SERIAL_RX_SIZE) {
+                        serial_rx_held = 1; // serial_getc() turns it back on
+                        serial_set_ier();
+                        break;
+                    }
+                    serial_rx[serial_rx_head++ & (SERIAL_RX_SIZE - 1)] = inb(COM1);
+                }
+                thread_wake_all(&input_waitq);
+                break;
+            case 0x02: serial_fill_fifo(); break;
+            case 0x06: inb(COM1 + 5); break; // line status
+            default:   inb(COM1 + 6); break; // modem status
+        }
+    }
+    spin_unlock(&serial_lock);
+}
+
+void serial_init(void) {
+    serial_present = 0;
+    serial_lock.locked = 0;
+    outb(COM1 + 1, 0x00); // no interrupts while we set it up
+    outb(COM1 + 4, 0x1E); // loopback: is there a UART at all?
+    outb(COM1, 0xAE);
+    if (inb(COM1) != 0xAE) return;
+
+    outb(COM1 + 3, 0x80); // DLAB: divisor 1 = 115200 baud
+    outb(COM1 + 0, 0x01);
+    outb(COM1 + 1, 0x00);
+    outb(COM1 + 3, 0x03); // 8N1
+    outb(COM1 + 2, 0xC7); // FIFO on and cleared, RX trigger at 14 bytes
+    outb(COM1 + 4, 0x0B); // DTR, RTS, OUT2 (routes the IRQ)
+
+    serial_tx_head = serial_tx_tail = 0;
+    serial_rx_head = serial_rx_tail = 0;
+    serial_tx_irq = 0;
+    serial_rx_held = 0;
+    serial_unget = -1;
+    serial_present = 1;
+    irq_install_handler(4, serial_irq);
+    klog(KLOG_INFO, "serial: COM1 at 115200 baud");
+    outb(COM1 + 1, 0x01);
+}
+
+void serial_putc(char c) {
+    if (!serial_present) return;
+    if (c == '\n') serial_putc('\r');
+
+    uint32_t flags = irq_save();
+    spin_lock(&serial_lock);
+    while (serial_tx_head - serial_tx_tail >= SERIAL_TX_SIZE) {
+        // ring full: push some out by hand rather than drop output
+        if (inb(COM1 + 5) & 0x20) serial_fill_fifo();
+    }
+    serial_tx[serial_tx_head++ & (SERIAL_TX_SIZE - 1)] = c;
+    if (!serial_tx_irq) {
+        serial_tx_irq = 1;
+        serial_set_ier(); // THR is empty, so this interrupts right away
+    }
+    spin_unlock(&serial_lock);
+    irq_restore(flags);
+}
+
+static inline int serial_ready(void) {
+    return serial_unget >= 0 || serial_rx_head != serial_rx_tail;
+}
+
+// Next received byte, or -1 if there is none
+int serial_getc(void) {
+    int c = serial_unget;
+    if (c >= 0) {
+        serial_unget = -1;
+        return c;
+    }
+    if (serial_rx_head == serial_rx_tail) return -1;
+    c = serial_rx[serial_rx_tail & (SERIAL_RX_SIZE - 1)];
+    serial_rx_tail++;
+    if (serial_rx_held && serial_rx_head - serial_rx_tail <= SERIAL_RX_SIZE / 2) {
+        uint32_t flags = irq_save();
+        spin_lock(&serial_lock);
+        serial_rx_held = 0;
+        serial_set_ier(); // what waited in the UART interrupts right away
+        spin_unlock(&serial_lock);
+        irq_restore(flags);
+    }
+    return c;
+}
+
+// Wait until everything queued has left the UART (before power-off)
+void serial_drain(void) {
+    if (!serial_present) return;
+    uint32_t flags = irq_save();
+    spin_lock(&serial_lock);
+    while (serial_tx_tail != serial_tx_head)
+        if (inb(COM1 + 5) & 0x20) serial_fill_fifo();
+    while (!(inb(COM1 + 5) & 0x40)) ; // transmitter empty
+    spin_unlock(&serial_lock);
+    irq_restore(flags);
+}
+
+// ---------- CPU exceptions ----------
+// Nothing recovers from a fault in the kernel: stop the other CPUs, say
+// what happened on the console and in the log, and halt. A fault while
+// reporting one just halts.
+
+static const char* const exc_names[32] = {
+    [0] = "divide error", [1] = "debug", [2] = "NMI", [3] = "breakpoint",
+    [4] = "overflow", [5] = "bound range", [6] = "invalid opcode",
+    [7] = "no FPU", [8] = "double fault", [10] = "invalid TSS",
+    [11] = "segment not present", [12] = "stack fault",
+    [13] = "general protection", [14] = "page fault", [16] = "FPU error",
+    [17] = "alignment check", [18] = "machine check", [19] = "SIMD error",
+};
+
+void smp_stop_others(int restart);
+
+void exc_dispatch(struct irq_frame* f) {
+    static volatile int in_exc;
+    if (__atomic_exchange_n(&in_exc, 1, __ATOMIC_ACQUIRE))
+        while (1) __asm__ volatile ("cli; hlt");
+    smp_stop_others(0);
+
+    const char* name = exc_names[f->vector] ? exc_names[f->vector] : "reserved";
+    klog(KLOG_ERR, "%s at %x, error %x", name, f->eip, f->err);
+    serial_lock.locked = 0; // whoever held it is not coming back
+    vga_write("\nCPU exception ");
+    vga_write_uint(f->vector);
+    vga_write(" (");
+    vga_write(name);
+    vga_write("), error ");
+    vga_write_hex(f->err);
+    vga_write(", eip ");
+    vga_write_hex(f->eip);
+    vga_write("\n");
+    serial_drain();
+    while (1) __asm__ volatile ("cli; hlt");
+}
+
+// Same, but give the sender up to ms milliseconds (escape sequences)
+static int serial_getc_wait(uint32_t ms) {
+    uint64_t until = timer_now() + ms;
+    int c;
+    while ((c = serial_getc()) < 0 && timer_now() < until)
+        __asm__ volatile ("hlt");
+    return c;
+}
+
+// Scancodes land here from IRQ1; the IRQ handler is the only producer and
+// get_char() the only consumer, so head/tail need no locking
+#define KBD_BUF_SIZE 128
+static volatile uint8_t kbd_buf[KBD_BUF_SIZE];
+static volatile uint32_t kbd_head = 0; // written by IRQ1 only
+static volatile uint32_t kbd_tail = 0; // written by get_char only
+
+static void kbd_irq(struct irq_frame* f) {
+    (void)f;
+    uint8_t scancode = inb(0x60);
+    uint32_t head = kbd_head;
+    if (head - kbd_tail < KBD_BUF_SIZE) { // drop when full
+        kbd_buf[head & (KBD_BUF_SIZE - 1)] = scancode;
+        kbd_head = head + 1;
+    }
+    thread_wake_all(&input_waitq);
+}
+
+void kbd_init(void) {
+    // drain whatever the controller buffered before we took over
+    while (inb(0x64) & 0x01) inb(0x60);
+    kbd_head = kbd_tail = 0;
+    memset(&input_waitq, 0, sizeof(input_waitq)); // reboot: its sleepers are gone
+    irq_install_handler(1, kbd_irq);
+}
+
+#define KBD_SERIAL 0x100 // kbd_read_scancode(): a byte from COM1, not a scancode
+
+// Block until IRQ1 hands us a scancode or COM1 a byte
+static int kbd_read_scancode(void) {
+    while (1) {
+        __asm__ volatile ("cli");
+        if (kbd_head != kbd_tail) {
+            uint8_t scancode = kbd_buf[kbd_tail & (KBD_BUF_SIZE - 1)];
+            kbd_tail++;
+            __asm__ volatile ("sti");
+            return scancode;
+        }
+        if (serial_ready()) {
+            int c = serial_getc();
+            __asm__ volatile ("sti");
+            return KBD_SERIAL | c;
+        }
+        if (sched_can_block()) {
+            spin_lock(&input_waitq.lock); // the IRQ handlers wake us
+            if (kbd_head == kbd_tail && !serial_ready()) thread_wait(&input_waitq);
+            else spin_unlock(&input_waitq.lock);
+            continue;
+        }
+        __asm__ volatile ("sti; hlt"); // sti shadow: no IRQ lost before hlt
+    }
+}
+
+// Codes get_char() returns for keys without an ASCII meaning
+#define KEY_UP    0x11
+#define KEY_DOWN  0x12
+#define KEY_LEFT  0x13
+#define KEY_RIGHT 0x14
+#define KEY_HOME  0x15
+#define KEY_END   0x16
+#define KEY_DEL   0x17
+#define KEY_ESC   0x1B
+
+// Byte from a serial terminal -> what get_char() returns (0 = nothing).
+// Arrow/Home/End/Del arrive as ANSI escape sequences.
+static char serial_key(uint8_t c) {
+    static int last_cr = 0;
+    int was_cr = last_cr;
+    last_cr = c == '\r';
+
+    if (c == '\r') return '\n';
+    if (c == '\n') return was_cr ? 0 : '\n'; // CR LF is one Enter
+    if (c == 0x7F || c == 0x08) return '\b';
+    if (c == '\t') return '\t';
+    if (c >= 0x20 && c < 0x7F) return c;
+    if (c != 0x1B) return 0;
+
+    int next = serial_getc_wait(20); // a lone ESC is just ESC
+    if (next != '[') {
+        if (next >= 0) serial_unget = next;
+        return KEY_ESC;
+    }
+    int param = 0;
+    while (1) {
+        next = serial_getc_wait(20);
+        if (next >= '0' && next <= '9') param = param * 10 + (next - '0');
+        else break;
+    }
+    switch (next) {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+        case '~':
+            switch (param) {
+                case 1: case 7: return KEY_HOME;
+                case 4: case 8: return KEY_END;
+                case 3: return KEY_DEL;
+                case 5: vga_scrollback_page(1); return 0;  // PgUp
+                case 6: vga_scrollback_page(-1); return 0; // PgDn
+            }
+            return 0;
+        default: return 0;
+    }
+}
+
+// Wait for a keypress and return its ASCII code
+// Only handle make codes (key press)
+// Track if Shift is pressed
+static int shift_pressed = 0;
+
+char get_char(void) {
+    int extended = 0;
+    while (1) {
+        int in = kbd_read_scancode();
+        if (in & KBD_SERIAL) {
+            char c = serial_key(in & 0xFF);
+            if (c) return c;
+            continue;
+        }
+        uint8_t scancode = in;
+
+        // 0xE0 prefixes the grey keys (PgUp/PgDn, arrows, ...)
+        if (scancode == 0xE0) {
+            extended = 1;
+            continue;
+        }
+        int was_extended = extended;
+        extended = 0;
+
+        // Handle key release
+        if (scancode & 0x80) {
+            // if release, check if Shift released
+            if (!was_extended && (scancode == 0xAA || scancode == 0xB6)) shift_pressed = 0;
+            continue;
+        }
+
+        // Handle Shift press (E0 2A is the fake shift some keyboards send around grey keys)
+        if (scancode == 0x2A || scancode == 0x36) { // Left/Right Shift
+            if (!was_extended) shift_pressed = 1;
+            continue;
+        }
+
+        // Shift+PgUp / Shift+PgDn page through the console history
+        if (shift_pressed && (scancode == 0x49 || scancode == 0x51)) {
+            vga_scrollback_page(scancode == 0x49 ? 1 : -1);
+            continue;
+        }
+
+        if (was_extended) {
+            switch (scancode) {
+                case 0x48: return KEY_UP;
+                case 0x50: return KEY_DOWN;
+                case 0x4B: return KEY_LEFT;
+                case 0x4D: return KEY_RIGHT;
+                case 0x47: return KEY_HOME;
+                case 0x4F: return KEY_END;
+                case 0x53: return KEY_DEL;
+                default: break;
+            }
+        }
+
+        switch (scancode) {
+            case 0x01: return KEY_ESC;
+            case 0x0F: return '\t'; // TAB = save
+            case 0x1C: return '\n';    // Enter
+            case 0x0E: return '\b';    // Backspace
+            case 0x02: return shift_pressed ? '!' : '1';
+            case 0x03: return shift_pressed ? '@' : '2';
+            case 0x04: return shift_pressed ? '#' : '3';
+            case 0x05: return shift_pressed ? '$' : '4';
+            case 0x06: return shift_pressed ? '%' : '5';
+            case 0x07: return shift_pressed ? '^' : '6';
+            case 0x08: return shift_pressed ? '&' : '7';
+            case 0x09: return shift_pressed ? '*' : '8';
+            case 0x0A: return shift_pressed ? '(' : '9';
+            case 0x0B: return shift_pressed ? ')' : '0';
+            case 0x10: return shift_pressed ? 'Q' : 'q';
+            case 0x11: return shift_pressed ? 'W' : 'w';
+            case 0x12: return shift_pressed ? 'E' : 'e';
+            case 0x13: return shift_pressed ? 'R' : 'r';
+            case 0x14: return shift_pressed ? 'T' : 't';
+            case 0x15: return shift_pressed ? 'Y' : 'y';
+            case 0x16: return shift_pressed ? 'U' : 'u';
+            case 0x17: return shift_pressed ? 'I' : 'i';
+            case 0x18: return shift_pressed ? 'O' : 'o';
+            case 0x19: return shift_pressed ? 'P' : 'p';
+            case 0x1E: return shift_pressed ? 'A' : 'a';
+            case 0x1F: return shift_pressed ? 'S' : 's';
+            case 0x20: return shift_pressed ? 'D' : 'd';
+            case 0x21: return shift_pressed ? 'F' : 'f';
+            case 0x22: return shift_pressed ? 'G' : 'g';
+            case 0x23: return shift_pressed ? 'H' : 'h';
+            case 0x24: return shift_pressed ? 'J' : 'j';
+            case 0x25: return shift_pressed ? 'K' : 'k';
+            case 0x26: return shift_pressed ? 'L' : 'l';
+            case 0x2C: return shift_pressed ? 'Z' : 'z';
+            case 0x2D: return shift_pressed ? 'X' : 'x';
+            case 0x2E: return shift_pressed ? 'C' : 'c';
+            case 0x2F: return shift_pressed ? 'V' : 'v';
+            case 0x30: return shift_pressed ? 'B' : 'b';
+            case 0x31: return shift_pressed ? 'N' : 'n';
+            case 0x32: return shift_pressed ? 'M' : 'm';
+            case 0x39: return shift_pressed ? '\a' : ' ';
+            case 0x0C: return shift_pressed ? '_' : '-';
+            case 0x0D: return shift_pressed ? '+' : '=';
+            case 0x33: return shift_pressed ? '<' : ',';
+            case 0x34: return shift_pressed ? '>' : '.';
+            case 0x35: return shift_pressed ? '?' : '/';
+            case 0x27: return shift_pressed ? '"' : '\'';
+            case 0x28: return shift_pressed ? ':' : ';';
+            case 0x1A: return shift_pressed ? '{' : '[';
+            case 0x1B: return shift_pressed ? '}' : ']';
+            case 0x29: return shift_pressed ? '~' : '`';
+            case 0x2B: return shift_pressed ? '|' : '\\';
+            default: break;
+        }
+    }
+}
+
+
+
+
+void kernel_main(void);
+void kernel_restart(void);
+void smp_stop_others(int restart);
+void draw_test(void); // add this near the top with other prototypes
+void grublmao(void);
+
+// shell commands
+// COMMAND() entries can sit next to the code they drive; the linker gathers
+// them into the "commands" section and cmd_init() indexes them at boot.
+
+struct cmd_args {
+    const char* str; // text after the command name, leading spaces skipped
+    uint32_t num;    // set by cmd_arg_uint
+};
+
+struct command {
+    const char* name;
+    const char* args; // synopsis for help and usage errors
+    const char* help;
+    int (*parse)(struct cmd_args* a); // 0 = arguments accepted
+    void (*run)(struct cmd_args* a);
+};
+
+#define COMMAND(id, name, args, help, parse, run) \
+    static const struct command cmd_##id __attribute__((used, section("commands"), aligned(4))) = \
+        { name, args, help, parse, run }
+
+extern const struct command __start_commands[], __stop_commands[]; // provided by the linker
+
+int cmd_arg_none(struct cmd_args* a);
+int cmd_arg_any(struct cmd_args* a);
+int cmd_arg_str(struct cmd_args* a);
+int cmd_arg_uint(struct cmd_args* a);
+
+// ---------- physical memory (Multiboot memory map + frame bitmap) ----------
+
+#define PMM_MAX_RANGES 32
+
+struct multiboot_info {
+    uint32_t flags;
+    uint32_t mem_lower, mem_upper; // KiB, valid if flags bit 0
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count, mods_addr; // valid if flags bit 3
+    uint32_t syms[4]; // flags bit 5: ELF section headers (num, entsize, addr, shstrndx)
+    uint32_t mmap_length, mmap_addr; // valid if flags bit 6
+    uint32_t drives_length, drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+    uint32_t vbe_control_info, vbe_mode_info;
+    uint16_t vbe_mode, vbe_interface_seg, vbe_interface_off, vbe_interface_len;
+    uint64_t framebuffer_addr; // valid if flags bit 12
+    uint32_t framebuffer_pitch; // bytes per row
+    uint32_t framebuffer_width, framebuffer_height;
+    uint8_t framebuffer_bpp;
+    uint8_t framebuffer_type; // 1 = direct RGB
+    uint8_t color_info[6];
+} __attribute__((packed));
+
+struct multiboot_mmap_entry {
+    uint32_t size; // of the rest of the entry, not counting this field
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type; // 1 = usable RAM
+} __attribute__((packed));
+
+struct multiboot_module {
+    uint32_t mod_start, mod_end;
+    uint32_t string;
+    uint32_t reserved;
+};
+
+// GRUB loads every section of our ELF, .symtab and .strtab included, and
+// hands over the section headers
+#define SHT_SYMTAB 2
+#define STT_FUNC 2
+
+struct elf_shdr {
+    uint32_t name, type, flags, addr, offset, size, link, info, addralign, entsize;
+};
+
+struct elf_sym {
+    uint32_t name, value, size;
+    uint8_t info, other;
+    uint16_t shndx;
+};
+
+// Section headers from the Multiboot info, or 0
+static struct elf_shdr* mb_elf_sections(struct multiboot_info* mbi, uint32_t* count) {
+    if (!(mbi->flags & (1 << 5)) || mbi->syms[1] != sizeof(struct elf_shdr)) return 0;
+    *count = mbi->syms[0];
+    return (struct elf_shdr*)mbi->syms[2];
+}
+
+struct pmm_range {
+    uint32_t start, end; // page aligned, end exclusive
+};
+
+extern char _end[]; // end of the kernel image, provided by the linker
+
+static struct multiboot_info* multiboot_info = 0;
+static struct pmm_range pmm_ranges[PMM_MAX_RANGES];
+static int pmm_range_count = 0;
+
+// one bit per 4 KiB frame, 1 = used; lives in RAM we take from the map itself
+static uint8_t* pmm_bitmap = 0;
+static uint32_t pmm_frames = 0;
+static uint32_t pmm_usable = 0;
+static uint32_t pmm_free = 0;
+static uint32_t pmm_hint = 0;
+
+static void pmm_add_range(uint64_t addr, uint64_t len) {
+    if (addr >= 0x100000000ULL || pmm_range_count >= PMM_MAX_RANGES) return;
+    uint64_t end = addr + len;
+    if (end > 0x100000000ULL) end = 0x100000000ULL;
+
+    uint32_t start = ((uint32_t)addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint32_t stop = (uint32_t)(end & ~(uint64_t)(PAGE_SIZE - 1));
+    if (stop <= start) return;
+    pmm_ranges[pmm_range_count].start = start;
+    pmm_ranges[pmm_range_count].end = stop;
+    pmm_range_count++;
+}
+
+static inline int pmm_test(uint32_t frame) {
+    return pmm_bitmap[frame >> 3] & (1 << (frame & 7));
+}
+
+static void pmm_set_range(uint32_t frame, uint32_t count, int used) {
+    for (uint32_t f = frame; f < frame + count && f < pmm_frames; f++) {
+        if (used && !pmm_test(f)) {
+            pmm_bitmap[f >> 3] |= 1 << (f & 7);
+            pmm_free--;
+        } else if (!used && pmm_test(f)) {
+            pmm_bitmap[f >> 3] &= ~(1 << (f & 7));
+            pmm_free++;
+        }
+    }
+}
+
+static void pmm_reserve(uint32_t addr, uint32_t len) {
+    if (!len) return;
+    uint32_t first = addr / PAGE_SIZE;
+    uint32_t last = (addr + len - 1) / PAGE_SIZE;
+    pmm_set_range(first, last - first + 1, 1);
+}
+
+// Call fn on every piece of memory the bootloader handed us that must
+// survive, wherever it put it: the kernel image, the info block, the
+// command line (boot_option() after a reboot), the memory map, the module
+// list and names (read again by fs_init), the modules and the ELF sections
+// (symbols for perf). Each is reserved on its own, so one piece loaded
+// high does not cost the RAM below it.
+static void pmm_boot_data(void (*fn)(uint32_t addr, uint32_t len, void* arg), void* arg) {
+    struct multiboot_info* mb = multiboot_info;
+    fn(0x100000, (uint32_t)_end - 0x100000, arg);
+    fn((uint32_t)mb, sizeof(*mb), arg);
+    if ((mb->flags & (1 << 2)) && mb->cmdline)
+        fn(mb->cmdline, strlen((char*)mb->cmdline) + 1, arg);
+    if (mb->flags & (1 << 6))
+        fn(mb->mmap_addr, mb->mmap_length, arg);
+    if (mb->flags & (1 << 3)) {
+        struct multiboot_module* mods = (struct multiboot_module*)mb->mods_addr;
+        fn(mb->mods_addr, mb->mods_count * sizeof(*mods), arg);
+        for (uint32_t i = 0; i < mb->mods_count; i++) {
+            fn(mods[i].mod_start, mods[i].mod_end - mods[i].mod_start, arg);
+            if (mods[i].string) fn(mods[i].string, strlen((char*)mods[i].string) + 1, arg);
+        }
+    }
+    uint32_t nsec;
+    struct elf_shdr* sec = mb_elf_sections(mb, &nsec);
+    if (sec) fn((uint32_t)sec, nsec * sizeof(*sec), arg);
+    for (uint32_t i = 0; sec && i < nsec; i++)
+        if (sec[i].addr) fn(sec[i].addr, sec[i].size, arg);
+}
+
+// Candidate spot for the bitmap; clash ends up past every piece it overlaps
+struct pmm_hole {
+    uint32_t start, len, clash;
+};
+
+static void pmm_boot_clash(uint32_t addr, uint32_t len, void* arg) {
+    struct pmm_hole* h = arg;
+    if (len && addr < h->start + h->len && h->start < addr + len && addr + len > h->clash)
+        h->clash = addr + len;
+}
+
+static void pmm_boot_reserve(uint32_t addr, uint32_t len, void* arg) {
+    (void)arg;
+    pmm_reserve(addr, len);
+}
+
+void pmm_init(uint32_t magic, uint32_t info_addr) {
+    pmm_bitmap = 0;
+    pmm_frames = pmm_usable = pmm_free = pmm_hint = 0;
+    pmm_range_count = 0;
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC) return; // not booted by Multiboot: static heap only
+
+    multiboot_info = (struct multiboot_info*)info_addr;
+    if (multiboot_info->flags & (1 << 6)) {
+        uint32_t p = multiboot_info->mmap_addr;
+        while (p < multiboot_info->mmap_addr + multiboot_info->mmap_length) {
+            struct multiboot_mmap_entry* e = (struct multiboot_mmap_entry*)p;
+            if (e->type == 1) pmm_add_range(e->addr, e->len);
+            p += e->size + sizeof(e->size);
+        }
+    } else if (multiboot_info->flags & (1 << 0)) {
+        pmm_add_range(0x100000, (uint64_t)multiboot_info->mem_upper * 1024);
+    }
+
+    for (int i = 0; i < pmm_range_count; i++)
+        if (pmm_ranges[i].end / PAGE_SIZE > pmm_frames)
+            pmm_frames = pmm_ranges[i].end / PAGE_SIZE;
+    if (!pmm_frames) return;
+
+    // park the bitmap in the first usable hole above 1 MiB that overlaps
+    // none of the boot data
+    uint32_t bitmap_bytes = (pmm_frames + 7) / 8;
+    for (int i = 0; i < pmm_range_count && !pmm_bitmap; i++) {
+        uint32_t start = pmm_ranges[i].start > 0x100000 ? pmm_ranges[i].start : 0x100000;
+        while (start < pmm_ranges[i].end && pmm_ranges[i].end - start >= bitmap_bytes) {
+            struct pmm_hole h = { start, bitmap_bytes, 0 };
+            pmm_boot_data(pmm_boot_clash, &h);
+            if (!h.clash) {
+                pmm_bitmap = (uint8_t*)start;
+                break;
+            }
+            uint32_t next = (h.clash + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+            if (next <= start) break; // wrapped at 4 GiB
+            start = next;
+        }
+    }
+    if (!pmm_bitmap) {
+        pmm_frames = 0;
+        return;
+    }
+
+    memset(pmm_bitmap, 0xFF, bitmap_bytes);
+    for (int i = 0; i < pmm_range_count; i++) {
+        uint32_t count = (pmm_ranges[i].end - pmm_ranges[i].start) / PAGE_SIZE;
+        pmm_set_range(pmm_ranges[i].start / PAGE_SIZE, count, 0);
+        pmm_usable += count;
+    }
+
+    pmm_reserve(0, 0x100000); // BIOS, VGA and whatever GRUB left in low memory
+    pmm_boot_data(pmm_boot_reserve, 0);
+    pmm_reserve((uint32_t)pmm_bitmap, bitmap_bytes);
+    klog(KLOG_INFO, "pmm: %u KiB usable, %u KiB free", pmm_usable * 4, pmm_free * 4);
+}
+
+// Contiguous run of count frames, or 0 if there is none
+uint32_t pmm_alloc_frames(uint32_t count) {
+    if (!count || count > pmm_free) return 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t run = 0;
+        uint32_t from = pass ? 0 : pmm_hint;
+        uint32_t to = pass ? pmm_hint + count : pmm_frames;
+        if (to > pmm_frames) to = pmm_frames;
+
+        for (uint32_t f = from; f < to; f++) {
+            if (pmm_test(f)) {
+                run = 0;
+                continue;
+            }
+            if (++run == count) {
+                uint32_t first = f + 1 - count;
+                pmm_set_range(first, count, 1);
+                pmm_hint = f + 1;
+                return first * PAGE_SIZE;
+            }
+        }
+    }
+    return 0;
+}
+
+// The same run as a pointer, for the heap
+void* pmm_alloc_pages(uint32_t count) {
+    return (void*)pmm_alloc_frames(count);
+}
+
+void pmm_free_frames(uint32_t addr, uint32_t count) {
+    pmm_set_range(addr / PAGE_SIZE, count, 0);
+}
+
+// ---------- kernel heap ----------
+// The allocator is in heap.c (it grows through pmm_alloc_pages()); meminfo
+// reports on it and on the frames left.
+
+void meminfo_command(struct cmd_args* a) {
+    (void)a;
+    size_t free_large, largest;
+    heap_free_space(&free_large, &largest);
+    size_t free_total = free_large + heap_stats.cached;
+    // share of free memory that cannot serve a request as big as the largest hole
+    uint32_t frag = free_total ? (uint32_t)udiv64((uint64_t)(free_total - largest) * 100, free_total, 0) : 0;
+
+    vga_write("\nheap: ");
+    vga_write_uint(heap_stats.total);
+    vga_write(" bytes in ");
+    vga_write_uint(heap_stats.regions);
+    vga_write(" regions, used ");
+    vga_write_uint(heap_stats.in_use);
+    vga_write(", free ");
+    vga_write_uint(free_total);
+    vga_write(" (");
+    vga_write_uint(heap_stats.cached);
+    vga_write(" cached)\nhigh-water: ");
+    vga_write_uint(heap_stats.high_water);
+    vga_write(", largest free block: ");
+    vga_write_uint(largest);
+    vga_write(", fragmentation: ");
+    vga_write_uint(frag);
+    vga_write("%\nallocs: ");
+    vga_write_uint(heap_stats.allocs);
+    vga_write(", frees: ");
+    vga_write_uint(heap_stats.frees);
+    vga_write(", failed: ");
+    vga_write_uint(heap_stats.failed);
+    vga_write("\nframes: ");
+    vga_write_uint(pmm_free);
+    vga_write(" free of ");
+    vga_write_uint(pmm_usable);
+    vga_write(" usable (");
+    vga_write_uint(pmm_free / 256);
+    vga_write(" MiB free)\n");
+}
+COMMAND(meminfo, "meminfo", "", "heap usage and fragmentation", cmd_arg_none, meminfo_command);
+
+// ---------- ATA disk (primary master, PIO or bus-master DMA) ----------
+
+#define ATA_DATA     0x1F0
+#define ATA_ERROR    0x1F1
+#define ATA_SECCOUNT 0x1F2
+#define ATA_LBA0     0x1F3
+#define ATA_LBA1     0x1F4
+#define ATA_LBA2     0x1F5
+#define ATA_DRIVE    0x1F6
+#define ATA_STATUS   0x1F7 // read
+#define ATA_COMMAND  0x1F7 // write
+#define ATA_CTRL     0x3F6
+
+#define ATA_SR_BSY  0x80
+#define ATA_SR_DF   0x20
+#define ATA_SR_DRQ  0x08
+#define ATA_SR_ERR  0x01
+
+#define ATA_CMD_READ_PIO   0x20
+#define ATA_CMD_WRITE_PIO  0x30
+#define ATA_CMD_READ_DMA   0xC8
+#define ATA_CMD_WRITE_DMA  0xCA
+#define ATA_CMD_FLUSH      0xE7
+#define ATA_CMD_IDENTIFY   0xEC
+
+#define SECTOR_SIZE 512
+#define BLOCK_SIZE PAGE_SIZE
+#define BLOCK_SECTORS (BLOCK_SIZE / SECTOR_SIZE)
+#define ATA_MAX_BLOCKS (256 / BLOCK_SECTORS) // one command moves at most 256 sectors
+
+// bus-master IDE registers, relative to BAR4 of the PCI IDE controller
+#define BMIDE_CMD    0
+#define BMIDE_STATUS 2
+#define BMIDE_PRDT   4
+
+struct ata_prd {
+    uint32_t addr;
+    uint16_t bytes;
+    uint16_t flags; // 0x8000 = last entry
+} __attribute__((packed));
+
+static struct ata_prd ata_prdt[ATA_MAX_BLOCKS] __attribute__((aligned(256))); // never crosses 64 KiB
+static int ata_present = 0;
+static uint32_t ata_sectors = 0;
+static uint16_t ata_bmide = 0; // 0 = PIO only
+static char ata_model[41];
+static volatile int ata_irq_done = 0;
+// IRQ14 only reaches the boot CPU: a thread waiting for DMA elsewhere
+// sleeps here, and the wakeup's resched IPI brings it back at once.
+// ata_timer bounds the sleep in case the IRQ never comes.
+static struct waitq ata_waitq;
+static struct timer ata_timer;
+static volatile int ata_timer_armed = 0; // in the timer heap; ata_waitq.lock
+
+static uint32_t pci_read(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+    outl(0xCF8, 0x80000000 | (bus << 16) | (dev << 11) | (fn << 8) | (off & 0xFC));
+    return inl(0xCFC);
+}
+
+static void pci_write(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint32_t val) {
+    outl(0xCF8, 0x80000000 | (bus << 16) | (dev << 11) | (fn << 8) | (off & 0xFC));
+    outl(0xCFC, val);
+}
+
+// Find the IDE controller on bus 0 and switch on bus mastering
+static uint16_t ata_find_bmide(void) {
+    for (int dev = 0; dev < 32; dev++) {
+        for (int fn = 0; fn < 8; fn++) {
+            uint32_t id = pci_read(0, dev, fn, 0x00);
+            if ((id & 0xFFFF) == 0xFFFF) continue;
+            uint32_t class = pci_read(0, dev, fn, 0x08);
+            if ((class >> 16) != 0x0101) continue; // mass storage / IDE
+
+            uint32_t bar4 = pci_read(0, dev, fn, 0x20);
+            if (!(bar4 & 1)) return 0; // not an I/O BAR
+            uint32_t cmd = pci_read(0, dev, fn, 0x04);
+            pci_write(0, dev, fn, 0x04, cmd | 0x05); // I/O space + bus master
+            return bar4 & 0xFFFC;
+        }
+    }
+    return 0;
+}
+
+static void ata_irq(struct irq_frame* f) {
+    (void)f;
+    inb(ATA_STATUS); // reading status acknowledges the drive
+    spin_lock(&ata_waitq.lock);
+    ata_irq_done = 1;
+    waitq_wake_locked(&ata_waitq);
+    spin_unlock(&ata_waitq.lock);
+}
+
+static void ata_timeout(void* arg) {
+    (void)arg;
+    spin_lock(&ata_waitq.lock);
+    ata_timer_armed = 0;
+    waitq_wake_locked(&ata_waitq);
+    spin_unlock(&ata_waitq.lock);
+}
+
+// Until the IRQ or the deadline; interrupts off
+static void ata_wait_irq(uint64_t deadline) {
+    while (!ata_irq_done && timer_now() < deadline) {
+        if (!sched_can_block()) {
+            __asm__ volatile ("sti; hlt; cli"); // sti shadow: no IRQ lost
+            continue;
+        }
+        if (!ata_timer_armed) { // else the one from an earlier transfer fires first
+            ata_timer.deadline = deadline;
+            ata_timer.fn = ata_timeout;
+            if (timer_add(&ata_timer) < 0) {
+                __asm__ volatile ("sti; hlt; cli");
+                continue;
+            }
+            ata_timer_armed = 1;
+        }
+        spin_lock(&ata_waitq.lock);
+        if (!ata_irq_done && ata_timer_armed) thread_wait(&ata_waitq);
+        else spin_unlock(&ata_waitq.lock);
+    }
+}
+
+// Wait for BSY to drop; -1 on error or timeout
+static int ata_wait(int need_drq) {
+    for (uint32_t spin = 0; spin < 10000000; spin++) {
+        uint8_t st = inb(ATA_STATUS);
+        if (st & ATA_SR_BSY) continue;
+        if (st & (ATA_SR_ERR | ATA_SR_DF)) return -1;
+        if (!need_drq || (st & ATA_SR_DRQ)) return 0;
+    }
+    return -1;
+}
+
+static void ata_select(uint32_t lba, uint32_t sectors) {
+    outb(ATA_DRIVE, 0xE0 | ((lba >> 24) & 0x0F)); // master, LBA28
+    outb(ATA_SECCOUNT, sectors & 0xFF);           // 0 means 256
+    outb(ATA_LBA0, lba & 0xFF);
+    outb(ATA_LBA1, (lba >> 8) & 0xFF);
+    outb(ATA_LBA2, (lba >> 16) & 0xFF);
+}
+
+void ata_init(void) {
+    ata_present = 0;
+    ata_bmide = 0;
+    ata_timer_armed = 0; // timer_init() emptied the heap
+    if (inb(ATA_STATUS) == 0xFF) return; // floating bus: no controller
+
+    outb(ATA_DRIVE, 0xA0);
+    io_wait();
+    outb(ATA_SECCOUNT, 0);
+    outb(ATA_LBA0, 0);
+    outb(ATA_LBA1, 0);
+    outb(ATA_LBA2, 0);
+    outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+    if (inb(ATA_STATUS) == 0) return; // no drive
+    if (ata_wait(0) < 0 || inb(ATA_LBA1) || inb(ATA_LBA2)) return; // error or ATAPI
+    if (ata_wait(1) < 0) return;
+
+    uint16_t id[256];
+    insw(ATA_DATA, id, 256);
+    ata_sectors = id[60] | ((uint32_t)id[61] << 16);
+    for (int i = 0; i < 20; i++) { // model string is stored byte-swapped
+        ata_model[2 * i] = id[27 + i] >> 8;
+        ata_model[2 * i + 1] = id[27 + i] & 0xFF;
+    }
+    ata_model[40] = 0;
+    for (int i = 39; i >= 0 && ata_model[i] == ' '; i--) ata_model[i] = 0;
+
+    ata_present = ata_sectors != 0;
+    ata_bmide = ata_find_bmide();
+    outb(ATA_CTRL, 0); // nIEN = 0: let the drive raise IRQ14
+    irq_install_handler(14, ata_irq);
+    klog(KLOG_INFO, "ata: %s, %u MiB, %s", ata_model, ata_sectors / 2048, ata_bmide ? "DMA" : "PIO");
+}
+
+static int ata_pio(uint32_t lba, int nblocks, uint8_t* const* bufs, int write) {
+    ata_select(lba, nblocks * BLOCK_SECTORS);
+    outb(ATA_COMMAND, write ? ATA_CMD_WRITE_PIO : ATA_CMD_READ_PIO);
+
+    for (int b = 0; b < nblocks; b++) {
+        for (int s = 0; s < BLOCK_SECTORS; s++) {
+            if (ata_wait(1) < 0) return -1;
+            uint16_t* p = (uint16_t*)(bufs[b] + s * SECTOR_SIZE);
+            if (write) outsw(ATA_DATA, p, SECTOR_SIZE / 2);
+            else insw(ATA_DATA, p, SECTOR_SIZE / 2);
+        }
+    }
+    return ata_wait(0);
+}
+
+// One scatter/gather DMA command; each block buffer gets its own PRD entry
+static int ata_dma(uint32_t lba, int nblocks, uint8_t* const* bufs, int write) {
+    for (int b = 0; b < nblocks; b++) {
+        ata_prdt[b].addr = (uint32_t)bufs[b];
+        ata_prdt[b].bytes = BLOCK_SIZE;
+        ata_prdt[b].flags = (b == nblocks - 1) ? 0x8000 : 0;
+    }
+
+    outl(ata_bmide + BMIDE_PRDT, (uint32_t)ata_prdt);
+    outb(ata_bmide + BMIDE_CMD, write ? 0x00 : 0x08); // bit 3: device -> memory
+    outb(ata_bmide + BMIDE_STATUS, inb(ata_bmide + BMIDE_STATUS) | 0x06); // clear irq/error
+
+    uint32_t flags = irq_save();
+    ata_irq_done = 0;
+    ata_select(lba, nblocks * BLOCK_SECTORS);
+    outb(ATA_COMMAND, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+    outb(ata_bmide + BMIDE_CMD, (write ? 0x00 : 0x08) | 0x01); // start
+
+    ata_wait_irq(timer_now() + 2000);
+    irq_restore(flags);
+
+    outb(ata_bmide + BMIDE_CMD, write ? 0x00 : 0x08); // stop
+    uint8_t bm = inb(ata_bmide + BMIDE_STATUS);
+    outb(ata_bmide + BMIDE_STATUS, bm | 0x06);
+    if (!ata_irq_done || (bm & 0x02) || (inb(ATA_STATUS) & (ATA_SR_ERR | ATA_SR_DF)))
+        return -1;
+    return 0;
+}
+
+// Move nblocks BLOCK_SIZE buffers to/from consecutive blocks starting at block
+int ata_xfer(uint32_t block, int nblocks, uint8_t* const* bufs, int write) {
+    if (!ata_present || nblocks <= 0 || nblocks > ATA_MAX_BLOCKS) return -1;
+    uint32_t lba = block * BLOCK_SECTORS;
+    if (lba + nblocks * BLOCK_SECTORS > ata_sectors) return -1;
+
+    if (ata_bmide && ata_dma(lba, nblocks, bufs, write) == 0) return 0;
+    if (ata_pio(lba, nblocks, bufs, write) == 0) return 0; // no DMA, or DMA failed: PIO
+    klog(KLOG_ERR, "ata: %s error at block %u (+%u)", write ? "write" : "read", block, nblocks);
+    return -1;
+}
+
+int ata_flush_cache(void) {
+    if (!ata_present) return -1;
+    outb(ATA_DRIVE, 0xE0);
+    outb(ATA_COMMAND, ATA_CMD_FLUSH);
+    return ata_wait(0);
+}
+
+// ---------- block cache ----------
+// BCACHE_BUFS block buffers on hash chains plus an LRU list. Writes only
+// mark a buffer dirty; bflush() sorts the dirty ones and writes each run of
+// consecutive blocks with a single command. A miss right after the previous
+// block reads BCACHE_READAHEAD blocks in one go.
+
+#define BCACHE_BUFS 64
+#define BCACHE_HASH 64
+#define BCACHE_READAHEAD 8
+#define BCACHE_FLUSH_MS 5000
+
+#define B_VALID 1
+#define B_DIRTY 2
+
+struct buf {
+    uint32_t blockno;
+    uint8_t* data; // BLOCK_SIZE bytes, page aligned
+    uint16_t flags;
+    uint16_t refcnt;
+    struct buf* hnext;
+    struct buf* lru_prev;
+    struct buf* lru_next;
+};
+
+struct bcache_stats {
+    uint32_t hits, misses, readahead, reads, writes, flushes;
+};
+
+static struct buf bcache[BCACHE_BUFS];
+static struct buf* bcache_hash[BCACHE_HASH];
+static struct buf* bcache_mru = 0;
+static struct buf* bcache_lru = 0;
+static uint32_t bcache_last = 0xFFFFFFFF; // last block handed out
+static uint32_t bcache_dirty = 0;
+static uint64_t bcache_dirty_since = 0; // when the oldest dirty buffer got dirty
+static struct bcache_stats bcache_stats;
+static int bcache_ready = 0;
+
+static void bcache_lru_unlink(struct buf* b) {
+    if (b->lru_prev) b->lru_prev->lru_next = b->lru_next;
+    else bcache_mru = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev;
+    else bcache_lru = b->lru_prev;
+}
+
+static void bcache_lru_push_front(struct buf* b) {
+    b->lru_prev = 0;
+    b->lru_next = bcache_mru;
+    if (bcache_mru) bcache_mru->lru_prev = b;
+    bcache_mru = b;
+    if (!bcache_lru) bcache_lru = b;
+}
+
+static struct buf** bcache_find(uint32_t blockno) {
+    struct buf** link = &bcache_hash[blockno % BCACHE_HASH];
+    while (*link && (*link)->blockno != blockno) link = &(*link)->hnext;
+    return link;
+}
+
+void bcache_init(void) {
+    bcache_ready = 0;
+    memset(bcache_hash, 0, sizeof(bcache_hash));
+    memset(&bcache_stats, 0, sizeof(bcache_stats));
+    bcache_mru = bcache_lru = 0;
+    bcache_dirty = 0;
+    if (!ata_present) return;
+
+    uint8_t* mem = (uint8_t*)pmm_alloc_frames(BCACHE_BUFS * BLOCK_SIZE / PAGE_SIZE);
+    if (!mem) return;
+    for (int i = 0; i < BCACHE_BUFS; i++) {
+        memset(&bcache[i], 0, sizeof(struct buf));
+        bcache[i].data = mem + i * BLOCK_SIZE;
+        bcache_lru_push_front(&bcache[i]);
+    }
+    bcache_ready = 1;
+}
+
+static int bcache_cmp_block(struct buf* a, struct buf* b) {
+    return a->blockno < b->blockno ? -1 : a->blockno > b->blockno;
+}
+
+// Write every dirty buffer, one command per run of consecutive blocks
+int bflush(void) {
+    struct buf* dirty[BCACHE_BUFS];
+    int n = 0, err = 0;
+    if (!bcache_dirty) return 0;
+
+    for (int i = 0; i < BCACHE_BUFS; i++)
+        if (bcache[i].flags & B_DIRTY) dirty[n++] = &bcache[i];
+    for (int i = 1; i < n; i++) { // insertion sort by block number
+        struct buf* b = dirty[i];
+        int j = i;
+        while (j > 0 && bcache_cmp_block(dirty[j - 1], b) > 0) {
+            dirty[j] = dirty[j - 1];
+            j--;
+        }
+        dirty[j] = b;
+    }
+
+    for (int i = 0; i < n; ) {
+        uint8_t* bufs[ATA_MAX_BLOCKS];
+        int run = 0;
+        while (i + run < n && run < ATA_MAX_BLOCKS &&
+               dirty[i + run]->blockno == dirty[i]->blockno + run) {
+            bufs[run] = dirty[i + run]->data;
+            run++;
+        }
+        if (ata_xfer(dirty[i]->blockno, run, bufs, 1) < 0) {
+            err = -1;
+        } else {
+            for (int k = 0; k < run; k++) dirty[i + k]->flags &= ~B_DIRTY;
+            bcache_dirty -= run;
+            bcache_stats.writes += run;
+        }
+        bcache_stats.flushes++;
+        i += run;
+    }
+    ata_flush_cache();
+    return err;
+}
+
+// Flush if something has been dirty for longer than BCACHE_FLUSH_MS
+void bflush_if_due(void) {
+    if (bcache_dirty && timer_now() - bcache_dirty_since >= BCACHE_FLUSH_MS)
+        bflush();
+}
+
+// Background writeback, so dirty blocks reach the disk while the shell
+// sits at the prompt
+static void bflush_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        delay_ms(BCACHE_FLUSH_MS / 4);
+        mutex_lock(&kernel_lock);
+        bflush_if_due();
+        mutex_unlock(&kernel_lock);
+    }
+}
+
+// Least recently used buffer nobody holds; dirty victims force a flush first
+static struct buf* bcache_victim(void) {
+    int flushed = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (struct buf* b = bcache_lru; b; b = b->lru_prev) {
+            if (b->refcnt) continue;
+            if (b->flags & B_DIRTY) {
+                if (pass == 0) continue; // prefer clean buffers
+                if (!flushed) {
+                    bflush(); // one try; what stays dirty could not be written
+                    flushed = 1;
+                }
+                if (b->flags & B_DIRTY) continue;
+            }
+            if (b->flags & B_VALID) {
+                struct buf** link = bcache_find(b->blockno);
+                if (*link == b) *link = b->hnext;
+            }
+            b->flags = 0;
+            return b;
+        }
+    }
+    return 0;
+}
+
+static struct buf* bcache_get(uint32_t blockno, int read) {
+    if (!bcache_ready) return 0;
+
+    struct buf* b = *bcache_find(blockno);
+    if (b) {
+        bcache_stats.hits++;
+        bcache_lru_unlink(b);
+        bcache_lru_push_front(b);
+        b->refcnt++;
+        bcache_last = blockno;
+        return b;
+    }
+    bcache_stats.misses++;
+
+    // sequential access: pull in the following blocks with the same command
+    int want = 1;
+    if (read && blockno == bcache_last + 1) {
+        while (want < BCACHE_READAHEAD && !*bcache_find(blockno + want) &&
+               (blockno + want + 1) * BLOCK_SECTORS <= ata_sectors)
+            want++;
+    }
+
+    struct buf* got[BCACHE_READAHEAD];
+    uint8_t* bufs[BCACHE_READAHEAD];
+    int n = 0;
+    for (; n < want; n++) {
+        got[n] = bcache_victim();
+        if (!got[n]) break;
+        got[n]->refcnt = 1; // keep it from being picked again for this run
+        bufs[n] = got[n]->data;
+        bcache_lru_unlink(got[n]);
+        bcache_lru_push_front(got[n]);
+    }
+    if (!n) return 0;
+
+    if (read && ata_xfer(blockno, n, bufs, 0) < 0) {
+        for (int i = 0; i < n; i++) got[i]->refcnt = 0;
+        return 0;
+    }
+    if (read) {
+        bcache_stats.reads += n;
+        bcache_stats.readahead += n - 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        got[i]->blockno = blockno + i;
+        got[i]->flags = B_VALID;
+        got[i]->refcnt = i == 0; // only the requested block is handed out
+        struct buf** head = &bcache_hash[(blockno + i) % BCACHE_HASH];
+        got[i]->hnext = *head;
+        *head = got[i];
+    }
+    bcache_last = blockno;
+    return got[0];
+}
+
+// Block contents from disk (or the cache); release with brelse()
+struct buf* bread(uint32_t blockno) {
+    return bcache_get(blockno, 1);
+}
+
+// Zeroed buffer for a block that is about to be overwritten completely:
+// no read, and a cached copy is cleared too
+struct buf* bget(uint32_t blockno) {
+    struct buf* b = bcache_get(blockno, 0);
+    if (b) memset(b->data, 0, BLOCK_SIZE);
+    return b;
+}
+
+void bdirty(struct buf* b) {
+    if (b->flags & B_DIRTY) return;
+    if (!bcache_dirty) bcache_dirty_since = timer_now();
+    b->flags |= B_DIRTY;
+    bcache_dirty++;
+}
+
+void brelse(struct buf* b) {
+    if (b && b->refcnt) b->refcnt--;
+}
+
+// ---------- on-disk filesystem (ibfs) ----------
+// Layout in BLOCK_SIZE blocks:
+//   0: superblock | block bitmap | inode table | data
+// Inodes are 128 bytes and describe their data with up to IBFS_MAX_EXTENTS
+// (start, length) runs. A directory's data is dir_buckets entry blocks and
+// an entry lives in block (name hash % dir_buckets); a full bucket doubles
+// the bucket count and splits every bucket in two.
+
+#define IBFS_MAGIC 0x53464249 // "IBFS"
+#define IBFS_VERSION 1
+#define IBFS_INODE_SIZE 128
+#define IBFS_INODES_PER_BLOCK (BLOCK_SIZE / IBFS_INODE_SIZE)
+#define IBFS_MAX_EXTENTS 14
+#define IBFS_ROOT_INO 1 // inode 0 is never used
+#define IBFS_FREE 0
+#define IBFS_FILE 1
+#define IBFS_DIR  2
+
+struct ibfs_super {
+    uint32_t magic, version;
+    uint32_t blocks; // on the whole volume
+    uint32_t bitmap_start, bitmap_blocks;
+    uint32_t inode_start, inode_blocks, inodes;
+    uint32_t data_start;
+    uint32_t free_blocks, free_inodes;
+};
+
+struct ibfs_extent {
+    uint32_t start, len;
+};
+
+struct ibfs_inode {
+    uint16_t type;
+    uint16_t nextents;
+    uint32_t size;        // bytes
+    uint32_t parent;
+    uint32_t dir_buckets; // directories only
+    struct ibfs_extent ext[IBFS_MAX_EXTENTS];
+};
+
+struct ibfs_dirent {
+    uint32_t ino;
+    uint32_t hash; // fs_hash(name)
+    char name[MAX_NAME_LEN];
+};
+
+#define IBFS_DIRENTS_PER_BLOCK ((BLOCK_SIZE - 8) / sizeof(struct ibfs_dirent))
+
+struct ibfs_dirblock {
+    uint32_t count;
+    uint32_t reserved;
+    struct ibfs_dirent e[IBFS_DIRENTS_PER_BLOCK];
+};
+
+static struct ibfs_super ibfs_sb;
+static int ibfs_mounted = 0;
+static uint32_t ibfs_block_hint = 0;
+static uint32_t ibfs_inode_hint = 0;
+
+static void ibfs_write_super(void) {
+    struct buf* b = bread(0);
+    if (!b) return;
+    memcpy(b->data, &ibfs_sb, sizeof(ibfs_sb));
+    bdirty(b);
+    brelse(b);
+}
+
+int ibfs_iget(uint32_t ino, struct ibfs_inode* out) {
+    if (ino < IBFS_ROOT_INO || ino >= ibfs_sb.inodes) return -1;
+    struct buf* b = bread(ibfs_sb.inode_start + ino / IBFS_INODES_PER_BLOCK);
+    if (!b) return -1;
+    memcpy(out, b->data + (ino % IBFS_INODES_PER_BLOCK) * IBFS_INODE_SIZE, sizeof(*out));
+    brelse(b);
+    // a corrupt disk must not send anyone past ext[] or into a division by 0
+    if (out->nextents > IBFS_MAX_EXTENTS || (out->type == IBFS_DIR && !out->dir_buckets)) {
+        klog(KLOG_ERR, "ibfs: inode %u is corrupt", ino);
+        return -1;
+    }
+    return 0;
+}
+
+int ibfs_iput(uint32_t ino, const struct ibfs_inode* in) {
+    if (ino < IBFS_ROOT_INO || ino >= ibfs_sb.inodes) return -1;
+    struct buf* b = bread(ibfs_sb.inode_start + ino / IBFS_INODES_PER_BLOCK);
+    if (!b) return -1;
+    memcpy(b->data + (ino % IBFS_INODES_PER_BLOCK) * IBFS_INODE_SIZE, in, sizeof(*in));
+    bdirty(b);
+    brelse(b);
+    return 0;
+}
+
+// Test or change one bit of the block bitmap; returns the old value (-1 on I/O error)
+static int ibfs_bitmap(uint32_t block, int op) { // op: 0 test, 1 set, 2 clear
+    struct buf* b = bread(ibfs_sb.bitmap_start + block / (BLOCK_SIZE * 8));
+    if (!b) return -1;
+    uint32_t bit = block % (BLOCK_SIZE * 8);
+    uint8_t* byte = &b->data[bit >> 3];
+    int old = (*byte >> (bit & 7)) & 1;
+    if (op == 1) *byte |= 1 << (bit & 7);
+    if (op == 2) *byte &= ~(1 << (bit & 7));
+    if (op && old != (op == 1)) {
+        bdirty(b);
+        ibfs_sb.free_blocks += op == 1 ? -1 : 1;
+    }
+    brelse(b);
+    return old;
+}
+
+// First run of want free blocks; failing that, the first free run of any
+// length. Returns the start (0 if the disk is full) and the length in *got.
+static uint32_t ibfs_alloc_run(uint32_t want, uint32_t* got) {
+    for (int exact = 1; exact >= 0; exact--) {
+        uint32_t run_start = 0, run = 0;
+        for (uint32_t i = 0; i < ibfs_sb.blocks - ibfs_sb.data_start; i++) {
+            uint32_t blk = ibfs_sb.data_start +
+                (ibfs_block_hint + i) % (ibfs_sb.blocks - ibfs_sb.data_start);
+            if (blk == ibfs_sb.data_start) run = 0; // runs do not wrap
+            if (ibfs_bitmap(blk, 0)) {
+                if (!exact && run) break;
+                run = 0;
+                continue;
+            }
+            if (!run++) run_start = blk;
+            if (run == want) break;
+        }
+        if (run && (run == want || !exact)) {
+            for (uint32_t k = 0; k < run; k++) ibfs_bitmap(run_start + k, 1);
+            ibfs_block_hint = run_start + run - ibfs_sb.data_start;
+            *got = run;
+            return run_start;
+        }
+    }
+    *got = 0;
+    return 0;
+}
+
+static uint32_t ibfs_inode_blocks(const struct ibfs_inode* in) {
+    uint32_t n = 0;
+    for (int i = 0; i < in->nextents; i++) n += in->ext[i].len;
+    return n;
+}
+
+// Physical block holding logical block n of the inode (0 if past the end)
+uint32_t ibfs_bmap(const struct ibfs_inode* in, uint32_t n) {
+    for (int i = 0; i < in->nextents; i++) {
+        if (n < in->ext[i].len) return in->ext[i].start + n;
+        n -= in->ext[i].len;
+    }
+    return 0;
+}
+
+// Grow or shrink the inode to nblocks data blocks. Growth extends the last
+// extent in place when the next block is free, otherwise adds extents.
+int ibfs_set_blocks(struct ibfs_inode* in, uint32_t nblocks) {
+    uint32_t have = ibfs_inode_blocks(in);
+
+    while (have > nblocks) {
+        struct ibfs_extent* e = &in->ext[in->nextents - 1];
+        uint32_t drop = have - nblocks < e->len ? have - nblocks : e->len;
+        for (uint32_t k = 0; k < drop; k++) ibfs_bitmap(e->start + e->len - 1 - k, 2);
+        e->len -= drop;
+        have -= drop;
+        if (!e->len) in->nextents--;
+    }
+
+    uint32_t orig = have;
+    while (have < nblocks) {
+        if (in->nextents) {
+            struct ibfs_extent* e = &in->ext[in->nextents - 1];
+            uint32_t next = e->start + e->len;
+            if (next < ibfs_sb.blocks && ibfs_bitmap(next, 0) == 0) {
+                ibfs_bitmap(next, 1);
+                e->len++;
+                have++;
+                continue;
+            }
+        }
+        uint32_t got;
+        uint32_t start = in->nextents < IBFS_MAX_EXTENTS ? ibfs_alloc_run(nblocks - have, &got) : 0;
+        if (!start) {
+            ibfs_set_blocks(in, orig); // give back what this call took
+            ibfs_write_super();
+            return -1;
+        }
+        in->ext[in->nextents].start = start;
+        in->ext[in->nextents].len = got;
+        in->nextents++;
+        have += got;
+    }
+    ibfs_write_super();
+    return 0;
+}
+
+// Zero-filled fresh block (through the cache, written back later)
+static int ibfs_zero_block(uint32_t blk) {
+    struct buf* b = bget(blk);
+    if (!b) return -1;
+    bdirty(b);
+    brelse(b);
+    return 0;
+}
+
+uint32_t ibfs_ialloc(uint16_t type, uint32_t parent) {
+    for (uint32_t i = 0; i < ibfs_sb.inodes; i++) {
+        uint32_t ino = (ibfs_inode_hint + i) % ibfs_sb.inodes;
+        if (ino < IBFS_ROOT_INO) continue;
+
+        struct ibfs_inode in;
+        if (ibfs_iget(ino, &in) < 0) return 0;
+        if (in.type != IBFS_FREE) continue;
+
+        memset(&in, 0, sizeof(in));
+        in.type = type;
+        in.parent = parent;
+        if (type == IBFS_DIR) {
+            in.dir_buckets = 1;
+            if (ibfs_set_blocks(&in, 1) < 0 || ibfs_zero_block(in.ext[0].start) < 0)
+                return 0;
+            in.size = BLOCK_SIZE;
+        }
+        ibfs_iput(ino, &in);
+        ibfs_inode_hint = ino + 1;
+        ibfs_sb.free_inodes--;
+        ibfs_write_super();
+        return ino;
+    }
+    return 0;
+}
+
+void ibfs_ifree(uint32_t ino) {
+    struct ibfs_inode in;
+    if (ibfs_iget(ino, &in) < 0) return;
+    ibfs_set_blocks(&in, 0);
+    in.type = IBFS_FREE;
+    ibfs_iput(ino, &in);
+    ibfs_sb.free_inodes++;
+    ibfs_write_super();
+}
+
+// Entry block i of a directory; 0 on I/O error, or if the block is missing
+// or claims more entries than it can hold
+static struct buf* ibfs_dirblock_read(const struct ibfs_inode* di, uint32_t i) {
+    uint32_t blk = ibfs_bmap(di, i);
+    struct buf* b = blk ? bread(blk) : 0;
+    if (b && ((struct ibfs_dirblock*)b->data)->count > IBFS_DIRENTS_PER_BLOCK) {
+        klog(KLOG_ERR, "ibfs: directory block %u is corrupt", blk);
+        brelse(b);
+        return 0;
+    }
+    return b;
+}
+
+// Look name up in directory inode dir_ino; fills *out and returns 0 if found
+int ibfs_dir_find(uint32_t dir_ino, const char* name, uint32_t hash, struct ibfs_dirent* out) {
+    struct ibfs_inode di;
+    if (ibfs_iget(dir_ino, &di) < 0 || di.type != IBFS_DIR) return -1;
+
+    struct buf* b = ibfs_dirblock_read(&di, hash % di.dir_buckets);
+    if (!b) return -1;
+    struct ibfs_dirblock* db = (struct ibfs_dirblock*)b->data;
+    for (uint32_t i = 0; i < db->count; i++) {
+        if (db->e[i].hash == hash && strcmp(db->e[i].name, name) == 0) {
+            *out = db->e[i];
+            brelse(b);
+            return 0;
+        }
+    }
+    brelse(b);
+    return -1;
+}
+
+// Double the bucket count; bucket i splits into i and i + old count
+static int ibfs_dir_grow(uint32_t dir_ino, struct ibfs_inode* di) {
+    uint32_t n = di->dir_buckets;
+    if (ibfs_set_blocks(di, 2 * n) < 0) return -1;
+    di->dir_buckets = 2 * n;
+    di->size = 2 * n * BLOCK_SIZE;
+
+    for (uint32_t i = 0; i < n; i++) {
+        struct buf* lo = ibfs_dirblock_read(di, i);
+        struct buf* hi = bget(ibfs_bmap(di, i + n));
+        if (!lo || !hi) {
+            brelse(lo);
+            brelse(hi);
+            return -1;
+        }
+        struct ibfs_dirblock* a = (struct ibfs_dirblock*)lo->data;
+        struct ibfs_dirblock* b = (struct ibfs_dirblock*)hi->data;
+        uint32_t keep = 0;
+        for (uint32_t k = 0; k < a->count; k++) {
+            if (a->e[k].hash % (2 * n) == i) a->e[keep++] = a->e[k];
+            else b->e[b->count++] = a->e[k];
+        }
+        a->count = keep;
+        bdirty(lo);
+        bdirty(hi);
+        brelse(lo);
+        brelse(hi);
+    }
+    return ibfs_iput(dir_ino, di);
+}
+
+int ibfs_dir_add(uint32_t dir_ino, uint32_t ino, const char* name, uint32_t hash) {
+    struct ibfs_inode di;
+    if (ibfs_iget(dir_ino, &di) < 0 || di.type != IBFS_DIR) return -1;
+
+    while (1) {
+        struct buf* b = ibfs_dirblock_read(&di, hash % di.dir_buckets);
+        if (!b) return -1;
+        struct ibfs_dirblock* db = (struct ibfs_dirblock*)b->data;
+        if (db->count < IBFS_DIRENTS_PER_BLOCK) {
+            struct ibfs_dirent* e = &db->e[db->count++];
+            memset(e, 0, sizeof(*e));
+            e->ino = ino;
+            e->hash = hash;
+            strncpy(e->name, name, MAX_NAME_LEN - 1);
+            bdirty(b);
+            brelse(b);
+            return 0;
+        }
+        brelse(b);
+        if (ibfs_dir_grow(dir_ino, &di) < 0) return -1;
+    }
+}
+
+int ibfs_dir_remove(uint32_t dir_ino, const char* name, uint32_t hash) {
+    struct ibfs_inode di;
+    if (ibfs_iget(dir_ino, &di) < 0 || di.type != IBFS_DIR) return -1;
+
+    struct buf* b = ibfs_dirblock_read(&di, hash % di.dir_buckets);
+    if (!b) return -1;
+    struct ibfs_dirblock* db = (struct ibfs_dirblock*)b->data;
+    for (uint32_t i = 0; i < db->count; i++) {
+        if (db->e[i].hash == hash && strcmp(db->e[i].name, name) == 0) {
+            db->e[i] = db->e[--db->count];
+            bdirty(b);
+            brelse(b);
+            return 0;
+        }
+    }
+    brelse(b);
+    return -1;
+}
+
+int ibfs_mount(void) {
+    ibfs_mounted = 0;
+    struct buf* b = bread(0);
+    if (!b) return -1;
+    memcpy(&ibfs_sb, b->data, sizeof(ibfs_sb));
+    brelse(b);
+
+    if (ibfs_sb.magic != IBFS_MAGIC || ibfs_sb.version != IBFS_VERSION ||
+        ibfs_sb.blocks > ata_sectors / BLOCK_SECTORS || ibfs_sb.data_start >= ibfs_sb.blocks)
+        return -1;
+    ibfs_block_hint = ibfs_inode_hint = 0;
+    ibfs_mounted = 1;
+    return 0;
+}
+
+// Write an empty filesystem over the whole disk
+int ibfs_mkfs(void) {
+    if (!bcache_ready) return -1;
+    ibfs_mounted = 0;
+
+    struct ibfs_super sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = IBFS_MAGIC;
+    sb.version = IBFS_VERSION;
+    sb.blocks = ata_sectors / BLOCK_SECTORS;
+    sb.bitmap_start = 1;
+    sb.bitmap_blocks = (sb.blocks + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+    sb.inodes = sb.blocks / 4 > 64 ? sb.blocks / 4 : 64; // one inode per 16 KiB
+    sb.inodes = (sb.inodes + IBFS_INODES_PER_BLOCK - 1) / IBFS_INODES_PER_BLOCK * IBFS_INODES_PER_BLOCK;
+    sb.inode_start = sb.bitmap_start + sb.bitmap_blocks;
+    sb.inode_blocks = sb.inodes / IBFS_INODES_PER_BLOCK;
+    sb.data_start = sb.inode_start + sb.inode_blocks;
+    if (sb.data_start + 16 > sb.blocks) return -1; // too small to be useful
+    sb.free_blocks = sb.blocks;
+    sb.free_inodes = sb.inodes - IBFS_ROOT_INO;
+
+    for (uint32_t blk = 0; blk < sb.data_start; blk++)
+        if (ibfs_zero_block(blk) < 0) return -1;
+    ibfs_sb = sb;
+    for (uint32_t blk = 0; blk < sb.data_start; blk++)
+        ibfs_bitmap(blk, 1);
+
+    ibfs_inode_hint = IBFS_ROOT_INO;
+    ibfs_block_hint = 0;
+    if (ibfs_ialloc(IBFS_DIR, IBFS_ROOT_INO) != IBFS_ROOT_INO) return -1;
+    ibfs_write_super();
+    if (bflush() < 0) return -1;
+    ibfs_mounted = 1;
+    return 0;
+}
+
+void diskinfo_command(struct cmd_args* a) {
+    (void)a;
+    if (!ata_present) {
+        vga_write("\nno ATA disk on the primary channel\n");
+        return;
+    }
+    vga_write("\ndisk: ");
+    vga_write(ata_model);
+    vga_write(", ");
+    vga_write_uint(ata_sectors / 2048);
+    vga_write(" MiB, ");
+    vga_write(ata_bmide ? "bus-master DMA\n" : "PIO\n");
+    vga_write("cache: ");
+    vga_write_uint(bcache_stats.hits);
+    vga_write(" hits, ");
+    vga_write_uint(bcache_stats.misses);
+    vga_write(" misses, ");
+    vga_write_uint(bcache_stats.reads);
+    vga_write(" blocks read (");
+    vga_write_uint(bcache_stats.readahead);
+    vga_write(" read-ahead)\n       ");
+    vga_write_uint(bcache_stats.writes);
+    vga_write(" blocks written in ");
+    vga_write_uint(bcache_stats.flushes);
+    vga_write(" commands, ");
+    vga_write_uint(bcache_dirty);
+    vga_write(" dirty now\n");
+    if (!ibfs_mounted) {
+        vga_write("fs: not formatted (mkfs)\n");
+        return;
+    }
+    vga_write("fs: ");
+    vga_write_uint(ibfs_sb.free_blocks);
+    vga_write(" of ");
+    vga_write_uint(ibfs_sb.blocks);
+    vga_write(" blocks free, ");
+    vga_write_uint(ibfs_sb.free_inodes);
+    vga_write(" inodes free\n");
+}
+
+static void sync_command(struct cmd_args* a) {
+    (void)a;
+    if (bflush() < 0) vga_write("\nsync: write error\n");
+}
+
+COMMAND(sync, "sync", "", "write cached disk blocks now", cmd_arg_none, sync_command);
+COMMAND(diskinfo, "diskinfo", "", "disk, block cache and fs stats", cmd_arg_none, diskinfo_command);
+
+static int fs_edit_mode = 0;
+static fs_node* fs_edit_file = 0;
+
+void ed_open(fs_node* f);
+
+// The tree itself (nodes, directory tables, dentry cache, paths) is in
+// fs.c; from here on it gets hooked up to ibfs and the boot modules.
+
+// ---------- disk-backed nodes ----------
+// A node with an ino stands in for an ibfs inode and is made on the first
+// lookup that reaches it. A disk directory's table only holds what has been
+// looked up so far, until a listing calls fs_dir_load().
+
+static fs_node* fs_disk_node(fs_node* dir, const struct ibfs_dirent* e) {
+    struct ibfs_inode in;
+    if (ibfs_iget(e->ino, &in) < 0 || in.type == IBFS_FREE) return 0;
+
+    fs_node* n = fs_create_node(e->name, in.type == IBFS_DIR);
+    if (!n) return 0;
+    n->ino = e->ino;
+    n->size = in.type == IBFS_FILE ? in.size : 0;
+    if (fs_dir_insert(dir, n) < 0) {
+        kfree(n);
+        return 0;
+    }
+    return n;
+}
+
+fs_node* fs_disk_lookup(fs_node* dir, const char* name, uint32_t hash) {
+    struct ibfs_dirent e;
+    if (ibfs_dir_find(dir->ino, name, hash, &e) < 0) return 0;
+    return fs_disk_node(dir, &e);
+}
+
+// Bring every entry of a disk directory into its table
+void fs_dir_load(fs_node* dir) {
+    struct ibfs_inode di;
+    if (!dir->ino || dir->loaded || ibfs_iget(dir->ino, &di) < 0 || di.type != IBFS_DIR) return;
+
+    for (uint32_t i = 0; i < di.dir_buckets; i++) {
+        struct buf* b = ibfs_dirblock_read(&di, i);
+        if (!b) return;
+        struct ibfs_dirblock* db = (struct ibfs_dirblock*)b->data;
+        for (uint32_t k = 0; k < db->count; k++)
+            if (!fs_dir_get(dir, db->e[k].name, db->e[k].hash))
+                fs_disk_node(dir, &db->e[k]);
+        brelse(b);
+    }
+    dir->loaded = 1;
+}
+
+int fs_disk_create(fs_node* dir, fs_node* n) {
+    uint32_t ino = ibfs_ialloc(n->is_dir ? IBFS_DIR : IBFS_FILE, dir->ino);
+    if (!ino) return -1;
+    if (ibfs_dir_add(dir->ino, ino, n->name, n->hash) < 0) {
+        ibfs_ifree(ino);
+        return -1;
+    }
+    n->ino = ino;
+    n->loaded = 1; // nothing on disk yet that the table lacks
+    return 0;
+}
+
+void fs_disk_unlink(fs_node* dir, fs_node* n) {
+    ibfs_dir_remove(dir->ino, n->name, n->hash);
+    ibfs_ifree(n->ino);
+}
+
+// ---------- file contents ----------
+// RAM files keep a NUL-terminated heap copy in data; disk files are read and
+// written block by block through the buffer cache.
+
+size_t fs_file_read(fs_node* f, size_t off, void* buf, size_t len) {
+    if (off >= f->size) return 0;
+    if (len > f->size - off) len = f->size - off;
+    if (!f->ino) {
+        memcpy(buf, f->data + off, len);
+        return len;
+    }
+
+    struct ibfs_inode in;
+    if (ibfs_iget(f->ino, &in) < 0) return 0;
+    size_t done = 0;
+    while (done < len) {
+        size_t pos = off + done;
+        size_t boff = pos % BLOCK_SIZE;
+        size_t n = BLOCK_SIZE - boff < len - done ? BLOCK_SIZE - boff : len - done;
+        uint32_t blk = ibfs_bmap(&in, pos / BLOCK_SIZE);
+        struct buf* b = blk ? bread(blk) : 0;
+        if (!b) break;
+        memcpy((uint8_t*)buf + done, b->data + boff, n);
+        brelse(b);
+        done += n;
+    }
+    return done;
+}
+
+// Set the file length to len; the first min(old, new) bytes are kept
+int fs_file_resize(fs_node* f, size_t len) {
+    if (f->readonly) return -1;
+    if (f->ino) {
+        struct ibfs_inode in;
+        if (ibfs_iget(f->ino, &in) < 0) return -1;
+        if (ibfs_set_blocks(&in, (len + BLOCK_SIZE - 1) / BLOCK_SIZE) < 0) return -1;
+        in.size = len;
+        f->size = len;
+        return ibfs_iput(f->ino, &in);
+    }
+
+    uint8_t* data = f->data;
+    if (!data || ksize(data) < len + 1 || ksize(data) > 4 * (len + 1) + HEAP_MAX_SMALL) {
+        data = kmalloc(len + 1);
+        if (!data) return -1;
+        if (f->data) memcpy(data, f->data, f->size < len ? f->size : len);
+        kfree(f->data);
+        f->data = data;
+    }
+    data[len] = 0;
+    f->size = len;
+    return 0;
+}
+
+// Overwrite bytes inside the file (fs_file_resize() first to grow it)
+int fs_file_write(fs_node* f, size_t off, const void* buf, size_t len) {
+    if (f->readonly || off + len > f->size) return -1;
+    if (!f->ino) {
+        memcpy(f->data + off, buf, len);
+        return 0;
+    }
+
+    struct ibfs_inode in;
+    if (ibfs_iget(f->ino, &in) < 0) return -1;
+    size_t done = 0;
+    while (done < len) {
+        size_t pos = off + done;
+        size_t boff = pos % BLOCK_SIZE;
+        size_t n = BLOCK_SIZE - boff < len - done ? BLOCK_SIZE - boff : len - done;
+        uint32_t blk = ibfs_bmap(&in, pos / BLOCK_SIZE);
+        // nothing worth keeping in the block: skip the read
+        int whole = boff == 0 && (n == BLOCK_SIZE || pos + n == f->size);
+        struct buf* b = !blk ? 0 : whole ? bget(blk) : bread(blk);
+        if (!b) return -1;
+        memcpy(b->data + boff, (const uint8_t*)buf + done, n);
+        bdirty(b);
+        brelse(b);
+        done += n;
+    }
+    return 0;
+}
+
+// ---------- initrd (Multiboot modules, ustar archives) ----------
+// Each module GRUB loaded is mounted read-only at ~/<module name>. The
+// archive stays where it was loaded (pmm keeps those frames reserved) and
+// file nodes point straight into it, so nothing is copied.
+
+#define TAR_BLOCK 512
+
+static uint32_t tar_octal(const char* p, int len) {
+    uint32_t v = 0;
+    for (int i = 0; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+        v = v * 8 + (p[i] - '0');
+    return v;
+}
+
+static int tar_header_ok(const uint8_t* h) {
+    if (strncmp((const char*)h + 257, "ustar", 5) != 0) return 0;
+    uint32_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : h[i]; // checksum field counts as spaces
+    return sum == tar_octal((const char*)h + 148, 8);
+}
+
+// Existing child of the right kind, or a new read-only one
+static fs_node* initrd_node(fs_node* dir, const char* name, int is_dir) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return dir; // stay inside
+    fs_node* n = fs_lookup(dir, name);
+    // only reuse our own nodes: never adopt something that lives on disk
+    if (n) return n->readonly && !n->ino && n->is_dir == is_dir ? n : 0;
+
+    n = fs_create_node(name, is_dir);
+    if (!n) return 0;
+    n->readonly = 1;
+    if (fs_dir_insert(dir, n) < 0) {
+        kfree(n);
+        return 0;
+    }
+    return n;
+}
+
+// Add path (directories on the way are created) below root
+static fs_node* initrd_add(fs_node* root, const char* path, int is_dir) {
+    char name[MAX_NAME_LEN], next[MAX_NAME_LEN];
+    fs_node* dir = root;
+    if (!fs_next_component(&path, name)) return 0;
+    while (fs_next_component(&path, next)) {
+        dir = initrd_node(dir, name, 1);
+        if (!dir) return 0;
+        memcpy(name, next, MAX_NAME_LEN);
+    }
+    return initrd_node(dir, name, is_dir);
+}
+
+// "/boot/initrd.tar initrd" -> "initrd": last word, no directory, no extension
+static void initrd_mount_name(const char* cmdline, char* name) {
+    const char* p = cmdline ? cmdline : "";
+    const char* word = p;
+    for (; *p; p++) {
+        if (*p == ' ' || *p == '/') word = p + 1;
+    }
+    int i = 0;
+    while (word[i] && word[i] != '.' && i < MAX_NAME_LEN - 1) {
+        name[i] = word[i];
+        i++;
+    }
+    name[i] = 0;
+    if (!i) strncpy(name, "initrd", MAX_NAME_LEN);
+}
+
+// Link every entry of the archive at [p, end) below root
+static void initrd_unpack(fs_node* root, const uint8_t* p, const uint8_t* end) {
+    while (p + TAR_BLOCK <= end && p[0] && tar_header_ok(p)) {
+        const char* h = (const char*)p;
+        uint32_t size = tar_octal(h + 124, 12);
+        const uint8_t* data = p + TAR_BLOCK;
+        if (data + size > end) break;
+
+        char path[155 + 1 + 100 + 1]; // prefix '/' name
+        int len = 0;
+        for (int i = 0; i < 155 && h[345 + i]; i++) path[len++] = h[345 + i];
+        if (len) path[len++] = '/';
+        for (int i = 0; i < 100 && h[i]; i++) path[len++] = h[i];
+        path[len] = 0;
+
+        char type = h[156];
+        if (type == '5') {
+            initrd_add(root, path, 1);
+        } else if (type == '0' || type == 0) {
+            fs_node* f = initrd_add(root, path, 0);
+            if (f) {
+                f->data = (uint8_t*)data;
+                f->size = size;
+            }
+        } // links and specials are skipped
+
+        p = data + (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    }
+}
+
+static void initrd_mount(const struct multiboot_module* mod) {
+    char name[MAX_NAME_LEN];
+    initrd_mount_name((const char*)mod->string, name);
+    fs_node* root = initrd_node(fs_root, name, 1);
+    for (int i = 1; !root && i < 10; i++) { // ~/initrd is taken: ~/initrd1, ...
+        char alt[MAX_NAME_LEN];
+        int len = strlen(name) < MAX_NAME_LEN - 2 ? strlen(name) : MAX_NAME_LEN - 2;
+        memcpy(alt, name, len);
+        alt[len] = '0' + i;
+        alt[len + 1] = 0;
+        root = initrd_node(fs_root, alt, 1);
+    }
+    if (root) initrd_unpack(root, (const uint8_t*)mod->mod_start, (const uint8_t*)mod->mod_end);
+    // the module string stays put (pmm_init reserves it); root->name is heap
+    klog(KLOG_INFO, "initrd: %u bytes from %s", mod->mod_end - mod->mod_start,
+         mod->string ? (const char*)mod->string : "?");
+}
+
+void fs_init(void) {
+    fs_init_root();
+    if (bcache_ready && ibfs_mount() == 0) {
+        fs_root->ino = IBFS_ROOT_INO;
+        klog(KLOG_INFO, "fs: mounted, %u blocks and %u inodes free", ibfs_sb.free_blocks, ibfs_sb.free_inodes);
+    } else if (bcache_ready) {
+        klog(KLOG_WARN, "fs: disk not formatted, files stay in RAM");
+    }
+
+    if (multiboot_info && (multiboot_info->flags & (1 << 3))) {
+        struct multiboot_module* mods = (struct multiboot_module*)multiboot_info->mods_addr;
+        for (uint32_t i = 0; i < multiboot_info->mods_count; i++)
+            initrd_mount(&mods[i]);
+    }
+}
+
+void fs_edfile_start(const char* path) {
+    fs_node* f = fs_resolve(path);
+    if (f && f->readonly) {
+        vga_write("\nread-only file\n");
+        return;
+    }
+    if (f && !f->is_dir) {
+        ed_open(f);
+        return;
+    }
+    vga_write("file was not found.\n");
+    klog(KLOG_DEBUG, "fs: edfile: file not found");
+}
+void fs_rdfile(const char* path) {
+    fs_node* f = fs_resolve(path);
+    if (f && !f->is_dir) {
+        char chunk[513];
+        size_t n;
+        for (size_t off = 0; (n = fs_file_read(f, off, chunk, 512)) > 0; off += n) {
+            chunk[n] = 0;
+            vga_write(chunk);
+        }
+        vga_write("\n");
+        return;
+    }
+    vga_write("file was not found.\n");
+    klog(KLOG_DEBUG, "fs: rdfile: file not found");
+}
+
+// Format the disk and start over with an empty tree on it
+void mkfs_command(struct cmd_args* a) {
+    (void)a;
+    if (!bcache_ready) {
+        vga_write("\nno disk to format\n");
+        return;
+    }
+    if (ibfs_mkfs() < 0) {
+        vga_write("\nmkfs failed\n");
+        return;
+    }
+    fs_free_tree(fs_root);
+    fs_init();
+    vga_write("\nformatted: ");
+    vga_write_uint(ibfs_sb.free_blocks);
+    vga_write(" free blocks, ");
+    vga_write_uint(ibfs_sb.free_inodes);
+    vga_write(" free inodes\n");
+}
+
+// shell side of the fs commands (the colours are part of the look)
+static void edfile_command(struct cmd_args* a) {
+    vga_set_color(0x01, 0x07); //blue on white
+    fs_edfile_start(a->str);
+    vga_set_color(0x00, 0x07); //default black on white
+}
+
+static void cd_command(struct cmd_args* a) {
+    vga_set_color(0x0E, 0x07); //yellow on white
+    fs_cd(a->str);
+    vga_set_color(0x01, 0x07); //blue on white
+}
+
+static void ls_command(struct cmd_args* a) {
+    (void)a;
+    vga_set_color(0x0E, 0x07); //yellow on white
+    fs_ls();
+    vga_set_color(0x01, 0x07); //blue on white
+}
+
+static void mkfile_command(struct cmd_args* a) {
+    vga_set_color(0x0E, 0x07); //yellow on black
+    fs_mkfile(a->str);
+    vga_write("\nMade new file: ");
+    vga_write(a->str);
+    vga_write(" in dir: ");
+    vga_write(fs_cwd->name);
+    vga_write("\n");
+    vga_set_color(0x01, 0x07); //blue on white
+}
+
+static void mkdir_command(struct cmd_args* a) {
+    vga_set_color(0x0E, 0x07); //blue on white
+    fs_mkdir(a->str);
+    vga_write("\nMade new directory: ");
+    vga_write(a->str);
+    vga_write(" in dir: ");
+    vga_write(fs_cwd->name);
+    vga_write("\n");
+    vga_set_color(0x01, 0x07); //blue on white
+}
+
+static void rdfile_command(struct cmd_args* a) {
+    vga_set_color(0x0E, 0x07); //default
+    fs_rdfile(a->str);
+    vga_set_color(0x01, 0x07); //blue on white
+}
+
+// dir = directories here, dir <path> = directories there (dir ~ for the root)
+static void dir_command(struct cmd_args* a) {
+    if (!*a->str) {
+        fs_dir_from(fs_cwd);
+        return;
+    }
+    fs_node* d = fs_resolve(a->str);
+    if (!d || !d->is_dir) {
+        vga_write("folder/dir doesnt exist\n");
+        return;
+    }
+    vga_set_color(0x0E, 0x07); //blue on white
+    fs_dir_from(d);
+    vga_set_color(0x01, 0x07); //blue on white
+}
+
+static void delfile_command(struct cmd_args* a) {
+    fs_delfile(a->str);
+}
+
+COMMAND(mkdir, "mkdir", "<dirname>", "make new folder/directory", cmd_arg_str, mkdir_command);
+COMMAND(mkfile, "mkfile", "<filename>", "make new file", cmd_arg_str, mkfile_command);
+COMMAND(edfile, "edfile", "<filename>", "edit your files contents", cmd_arg_str, edfile_command);
+COMMAND(rdfile, "rdfile", "<filename>", "read file contents", cmd_arg_str, rdfile_command);
+COMMAND(delfile, "delfile", "<filename>", "delete file", cmd_arg_str, delfile_command);
+COMMAND(dir, "dir", "[path]", "show directories in the current one (dir ~ for the root)", cmd_arg_any, dir_command);
+COMMAND(cd, "cd", "<directory>", "change directory", cmd_arg_str, cd_command);
+COMMAND(ls, "ls", "", "list everything", cmd_arg_none, ls_command);
+COMMAND(mkfs, "mkfs", "", "format the disk (erases everything on it)", cmd_arg_none, mkfs_command);
+
+
+uint16_t vga_entry(char c, uint8_t color)
+{
+    return (uint16_t)c | (uint16_t)color << 8;
+}
+
+// Get default color based on SP8LF mode
+static uint8_t vga_get_default_color(void) {
+    if (sp8lf_mode) {
+        return 0x70;  // SP8LF mode: black on white (fg=0x00, bg=0x07)
+    }
+    return 0x07;  // Normal mode: white on black (fg=0x07, bg=0x00)
+}
+
+static inline void vga_mark_dirty(int lo, int hi)
+{
+    if (lo < vga_dirty_lo) vga_dirty_lo = lo;
+    if (hi > vga_dirty_hi) vga_dirty_hi = hi;
+}
+
+// Scrollback: rows that scrolled off the top, kept in a ring of frames
+#define SCROLLBACK_LINES 4000
+static uint16_t* sb_buf = 0;
+static int sb_head = 0;  // next row to overwrite
+static int sb_count = 0; // rows stored
+static int vga_view = 0; // rows scrolled back, 0 = live screen
+
+void vga_scrollback_init(void)
+{
+    uint32_t bytes = SCROLLBACK_LINES * VGA_WIDTH * sizeof(uint16_t);
+    sb_buf = (uint16_t*)pmm_alloc_frames((bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+    sb_head = sb_count = 0;
+    vga_view = 0;
+}
+
+static uint16_t* sb_row(int i) // 0 = oldest stored row
+{
+    return sb_buf + ((sb_head - sb_count + i + SCROLLBACK_LINES) % SCROLLBACK_LINES) * VGA_WIDTH;
+}
+
+static void vga_copy_row(int vram_row, const uint16_t* src)
+{
+    volatile uint32_t* dst = (volatile uint32_t*)(vga_buffer + vram_row * VGA_WIDTH);
+    const uint32_t* s = (const uint32_t*)src;
+    for (int i = 0; i < VGA_WIDTH / 2; i++)
+        dst[i] = s[i]; // two cells per store
+}
+
+static void vga_set_start(void)
+{
+    if (vga_top == vga_hw_top) return;
+    vga_hw_top = vga_top;
+    uint16_t pos = vga_top * VGA_WIDTH;
+    outb(0x3D4, 0x0C);       // Start address high byte
+    outb(0x3D5, (pos >> 8) & 0xFF);
+    outb(0x3D4, 0x0D);       // Start address low byte
+    outb(0x3D5, pos & 0xFF);
+}
+
+// Copy dirty rows to VGA memory, then move the display start and cursor once
+void vga_flush(void)
+{
+    if (vga_view) return; // showing history; live output waits in the shadow
+
+    for (int r = vga_dirty_lo; r <= vga_dirty_hi; r++)
+        vga_copy_row(vga_top + r, VGA_ROW(r));
+    gfx_console_flush(vga_dirty_lo, vga_dirty_hi);
+    vga_dirty_lo = VGA_HEIGHT;
+    vga_dirty_hi = -1;
+
+    vga_set_start();
+    update_cursor();
+}
+
+// Page through history: dir > 0 goes back in time, dir < 0 forward
+void vga_scrollback_page(int dir)
+{
+    int view = vga_view + dir * (VGA_HEIGHT / 2);
+    if (view > sb_count) view = sb_count;
+    if (view < 0) view = 0;
+    if (view == vga_view) return;
+
+    vga_view = view;
+    if (!vga_view) {
+        vga_mark_dirty(0, VGA_HEIGHT - 1);
+        vga_flush();
+        return;
+    }
+    const uint16_t* rows[VGA_HEIGHT];
+    for (int r = 0; r < VGA_HEIGHT; r++) {
+        rows[r] = r < vga_view ? sb_row(sb_count - vga_view + r) : VGA_ROW(r - vga_view);
+        vga_copy_row(vga_top + r, rows[r]);
+    }
+    gfx_console_rows(rows);
+}
+
+void vga_clear(void)
+{
+    uint8_t default_color = vga_get_default_color();
+    for (int i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++)
+        vga_shadow[i] = vga_entry(' ', default_color);
+
+    vga_shadow_head = 0;
+    vga_top = 0;
+    vga_view = 0;
+    cursor_x = 0;
+    cursor_y = 0;
+    vga_mark_dirty(0, VGA_HEIGHT - 1);
+    vga_flush();
+}
+
+static void vga_scroll(void)
+{
+    uint8_t default_color = vga_get_default_color();
+
+    cpu_stats_this()->vga_scrolls++;
+    if (sb_buf) {
+        memcpy(sb_buf + sb_head * VGA_WIDTH, VGA_ROW(0), VGA_WIDTH * sizeof(uint16_t));
+        sb_head = (sb_head + 1) % SCROLLBACK_LINES;
+        if (sb_count < SCROLLBACK_LINES) sb_count++;
+    }
+
+    // old top row becomes the new bottom row
+    vga_shadow_head = (vga_shadow_head + 1) % VGA_HEIGHT;
+    uint16_t* row = VGA_ROW(VGA_HEIGHT - 1);
+    for (int x = 0; x < VGA_WIDTH; x++)
+        row[x] = vga_entry(' ', default_color);
+
+    // rows already in VGA memory ride along with the start address; only
+    // when the window hits the end of text memory is everything rewritten
+    if (vga_top + VGA_HEIGHT < VGA_VRAM_ROWS) {
+        vga_top++;
+        if (vga_dirty_lo > 0) vga_dirty_lo--;
+        if (vga_dirty_hi >= 0) vga_dirty_hi--;
+        vga_mark_dirty(VGA_HEIGHT - 1, VGA_HEIGHT - 1);
+    } else {
+        vga_top = 0;
+        vga_mark_dirty(0, VGA_HEIGHT - 1);
+    }
+
+    cursor_y = VGA_HEIGHT - 1;
+}
+
+// Put one character into the shadow buffer without touching the hardware
+static void vga_emit(char c)
+{
+    serial_putc(c); // mirror for headless use
+
+    if (vga_view) { // new output snaps back to the live screen
+        vga_view = 0;
+        vga_mark_dirty(0, VGA_HEIGHT - 1);
+    }
+
+    if (c == '\n')
+    {
+        cursor_x = 0;
+        cursor_y++;
+    }
+    else
+    {
+        VGA_ROW(cursor_y)[cursor_x] = vga_entry(c, vga_color);
+        vga_mark_dirty(cursor_y, cursor_y);
+        cursor_x++;
+    }
+
+    if (cursor_x >= VGA_WIDTH)
+    {
+        cursor_x = 0;
+        cursor_y++;
+    }
+
+    if (cursor_y >= VGA_HEIGHT)
+        vga_scroll();
+}
+
+void vga_putc(char c)
+{
+    vga_emit(c);
+    vga_flush();
+}
+
+void vga_write(const char* str)
+{
+    while (*str)
+        vga_emit(*str++);
+    vga_flush();
+}
+
+// Direct cell access for full-screen views such as the editor
+void vga_put_at(int x, int y, char c, uint8_t color)
+{
+    if (vga_view) {
+        vga_view = 0;
+        vga_mark_dirty(0, VGA_HEIGHT - 1);
+    }
+    VGA_ROW(y)[x] = vga_entry(c, color);
+    vga_mark_dirty(y, y);
+}
+
+void vga_save_screen(uint16_t* out)
+{
+    for (int r = 0; r < VGA_HEIGHT; r++)
+        memcpy(out + r * VGA_WIDTH, VGA_ROW(r), VGA_WIDTH * sizeof(uint16_t));
+}
+
+void vga_restore_screen(const uint16_t* in)
+{
+    for (int r = 0; r < VGA_HEIGHT; r++)
+        memcpy(VGA_ROW(r), in + r * VGA_WIDTH, VGA_WIDTH * sizeof(uint16_t));
+    vga_mark_dirty(0, VGA_HEIGHT - 1);
+}
+
+void vga_write_uint(uint32_t v)
+{
+    char buf[11];
+    int i = 10;
+    buf[i] = 0;
+    do {
+        buf[--i] = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+    vga_write(&buf[i]);
+}
+
+void vga_write_hex(uint32_t v)
+{
+    char buf[11] = "0x";
+    for (int i = 0; i < 8; i++)
+        buf[2 + i] = "0123456789abcdef"[(v >> (28 - 4 * i)) & 0xF];
+    buf[10] = 0;
+    vga_write(buf);
+}
+
+void vga_set_color(uint8_t fg, uint8_t bg)
+{
+    vga_color = fg | bg << 4;
+}
+
+void testascii()
+{
+    vga_write("test ascii nie istnieje.\n");
+}
+
+void uptime_command(struct cmd_args* a)
+{
+    (void)a;
+    uint32_t ms;
+    uint32_t sec = (uint32_t)udiv64(timer_now(), 1000, &ms);
+
+    vga_write("\nup ");
+    vga_write_uint(sec / 3600);
+    vga_write("h ");
+    vga_write_uint((sec / 60) % 60);
+    vga_write("m ");
+    vga_write_uint(sec % 60);
+    vga_write(".");
+    if (ms < 100) vga_write("0");
+    if (ms < 10) vga_write("0");
+    vga_write_uint(ms);
+    vga_write("s\n");
+}
+
+static void sleep_command(struct cmd_args* a) {
+    delay_ms(a->num);
+}
+
+COMMAND(uptime, "uptime", "", "time since boot", cmd_arg_none, uptime_command);
+COMMAND(sleep, "sleep", "<ms>", "wait <ms> milliseconds", cmd_arg_uint, sleep_command);
+
+static void threads_command(struct cmd_args* a) {
+    (void)a;
+    static const char* const state_names[] = { "free", "ready", "blocked", "dead" };
+    vga_write("\n");
+    for (int i = 0; i < THREAD_MAX; i++) {
+        struct thread* t = &threads[i];
+        if (t->state == T_FREE || t->state == T_DEAD) continue;
+        vga_write("  ");
+        vga_write_uint(t->id);
+        vga_write(" ");
+        vga_write(t->name);
+        vga_write(" (");
+        vga_write(t->on_cpu && t->state == T_RUNNABLE ? "running" : state_names[t->state]);
+        vga_write(", cpu ");
+        vga_write_uint(t->cpu);
+        vga_write("): ");
+        vga_write_uint((uint32_t)t->ticks);
+        vga_write(" ms, ");
+        vga_write_uint(t->switches);
+        vga_write(" switches\n");
+    }
+}
+
+COMMAND(threads, "threads", "", "list kernel threads", cmd_arg_none, threads_command);
+
+// ---------- membench: string/memory routines vs. plain byte loops ----------
+
+// Reference byte loops; keep GCC from turning them back into memcpy calls
+#define BYTE_LOOP __attribute__((noinline, optimize("no-tree-loop-distribute-patterns")))
+
+static BYTE_LOOP void* membench_memcpy_bytes(void* dest, const void* src, size_t n) {
+    unsigned char* d = (unsigned char*)dest;
+    const unsigned char* s = (const unsigned char*)src;
+    for (size_t i = 0; i < n; i++) d[i] = s[i];
+    return dest;
+}
+
+static BYTE_LOOP void* membench_memset_bytes(void* dest, int val, size_t n) {
+    unsigned char* d = (unsigned char*)dest;
+    for (size_t i = 0; i < n; i++) d[i] = (unsigned char)val;
+    return dest;
+}
+
+static BYTE_LOOP int membench_strlen_bytes(const char* s) {
+    int len = 0;
+    while (s[len]) len++;
+    return len;
+}
+
+static BYTE_LOOP int membench_strcmp_bytes(const char* a, const char* b) {
+    while (*a && (*a == *b)) { a++; b++; }
+    return *(unsigned char*)a - *(unsigned char*)b;
+}
+
+#define MEMBENCH_MAX (64 * 1024)
+#define MEMBENCH_BYTES (256 * 1024) // per measurement
+
+static volatile int membench_sink;
+
+// Cycles to push MEMBENCH_BYTES through op (0 memcpy, 1 memset, 2 strlen,
+// 3 strcmp) in chunks of size, using the fast or the byte-loop version
+static uint32_t membench_run(int op, int fast, char* a, char* b, size_t size) {
+    uint32_t iters = MEMBENCH_BYTES / size;
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < iters; i++) {
+        switch (op) {
+            case 0: if (fast) memcpy(a, b, size); else membench_memcpy_bytes(a, b, size); break;
+            case 1: if (fast) memset(a, i, size); else membench_memset_bytes(a, i, size); break;
+            case 2: membench_sink += fast ? strlen(b) : membench_strlen_bytes(b); break;
+            case 3: membench_sink += fast ? strcmp(a, b) : membench_strcmp_bytes(a, b); break;
+        }
+    }
+    return (uint32_t)(rdtsc() - start);
+}
+
+static void membench_report(uint32_t cycles, uint32_t khz) {
+    uint32_t bytes = MEMBENCH_BYTES;
+    if (!cycles) cycles = 1;
+    uint32_t mbs = (uint32_t)udiv64((uint64_t)bytes * khz, cycles, 0) / 1000;
+    uint32_t cpb = (uint32_t)udiv64((uint64_t)cycles * 100, bytes, 0); // cycles/byte * 100
+
+    vga_write_uint(mbs);
+    vga_write(" MB/s ");
+    vga_write_uint(cpb / 100);
+    vga_write(".");
+    if (cpb % 100 < 10) vga_write("0");
+    vga_write_uint(cpb % 100);
+    vga_write(" c/B");
+}
+
+void membench_command(struct cmd_args* args) {
+    (void)args;
+    static const char* const names[4] = { "memcpy", "memset", "strlen", "strcmp" };
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 16384, MEMBENCH_MAX };
+
+    char* a = kmalloc(MEMBENCH_MAX);
+    char* b = kmalloc(MEMBENCH_MAX);
+    if (!a || !b) {
+        kfree(a);
+        kfree(b);
+        return;
+    }
+    uint32_t khz = tsc_get_khz();
+
+    vga_write("\nTSC: ");
+    vga_write_uint(khz / 1000);
+    vga_write(" MHz, ");
+    vga_write_uint(MEMBENCH_BYTES / 1024);
+    vga_write(" KiB per run (fast | byte loop)\n");
+
+    for (int op = 0; op < 4; op++) {
+        for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            size_t size = sizes[s];
+            // the string ops get two equal strings of size - 1 characters
+            memset(a, 'a', size);
+            memset(b, 'a', size);
+            a[size - 1] = b[size - 1] = 0;
+
+            membench_run(op, 1, a, b, size); // warm the caches
+            uint32_t fast = membench_run(op, 1, a, b, size);
+            uint32_t slow = membench_run(op, 0, a, b, size);
+
+            vga_write(names[op]);
+            vga_write(" ");
+            vga_write_uint(size);
+            vga_write("B: ");
+            membench_report(fast, khz);
+            vga_write(" | ");
+            membench_report(slow, khz);
+            vga_write("\n");
+        }
+    }
+    kfree(a);
+    kfree(b);
+}
+COMMAND(membench, "membench", "", "benchmark memcpy/memset/strlen/strcmp", cmd_arg_none, membench_command);
+
+// ---------- command handling ----------
+// Commands are found through a perfect hash of their name: cmd_init() tries
+// seeds until every registered name lands in its own slot, so a lookup is
+// one hash of the first word and one compare.
+
+#define CMD_SLOTS 256 // power of two, a few times the command count
+
+static const struct command* cmd_slots[CMD_SLOTS];
+static uint32_t cmd_seed = 0;
+static int cmd_ready = 0;
+
+static uint32_t cmd_hash(const char* s, uint32_t len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (uint32_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return (h ^ h >> 16) & (CMD_SLOTS - 1);
+}
+
+void cmd_init(void) {
+    cmd_ready = 0;
+    for (uint32_t seed = 0; seed < 4096; seed++) {
+        memset(cmd_slots, 0, sizeof(cmd_slots));
+        const struct command* c = __start_commands;
+        for (; c < __stop_commands; c++) {
+            const struct command** slot = &cmd_slots[cmd_hash(c->name, strlen(c->name), seed)];
+            if (*slot) break;
+            *slot = c;
+        }
+        if (c == __stop_commands) {
+            cmd_seed = seed;
+            cmd_ready = 1;
             return;
         }
+    }
+    // only a duplicate name gets here; dispatch falls back to a scan
+}
+
+static const struct command* cmd_find(const char* name, uint32_t len) {
+    if (cmd_ready) {
+        const struct command* c = cmd_slots[cmd_hash(name, len, cmd_seed)];
+        return c && strncmp(c->name, name, len) == 0 && !c->name[len] ? c : 0;
+    }
+    for (const struct command* c = __start_commands; c < __stop_commands; c++)
+        if (strncmp(c->name, name, len) == 0 && !c->name[len]) return c;
+    return 0;
+}
+
+// argument parsers: 0 = fine, -1 = print usage
+int cmd_arg_none(struct cmd_args* a) {
+    return *a->str ? -1 : 0;
+}
+
+int cmd_arg_any(struct cmd_args* a) {
+    (void)a;
+    return 0;
+}
+
+int cmd_arg_str(struct cmd_args* a) {
+    return *a->str ? 0 : -1;
+}
+
+int cmd_arg_uint(struct cmd_args* a) {
+    const char* p = a->str;
+    if (*p < '0' || *p > '9') return -1;
+    a->num = 0;
+    while (*p >= '0' && *p <= '9') a->num = a->num * 10 + (*p++ - '0');
+    return *p ? -1 : 0;
+}
+
+// ---------- command stats ----------
+// handle_command times every run with the TSC into a log-linear histogram
+// per command: values below 8 cycles get a bucket each, after that every
+// power of two is split into 8 sub-buckets, so a percentile read back from
+// the bucket midpoint is within ~6% of the real value.
+
+#define CMD_STATS_MAX 64
+#define LAT_SUB_BITS 3
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_MAX_LOG 40 // 2^40 cycles is minutes; longer runs land in the top bucket
+#define LAT_BUCKETS (LAT_SUB + (LAT_MAX_LOG - LAT_SUB_BITS) * LAT_SUB)
+
+struct cmd_stat {
+    uint32_t count;
+    uint64_t max;
+    uint32_t hist[LAT_BUCKETS];
+};
+
+static struct cmd_stat cmd_lat[CMD_STATS_MAX];
+
+static uint32_t lat_bucket(uint64_t v) {
+    if (v < LAT_SUB) return (uint32_t)v;
+    int log = 63 - __builtin_clzll(v);
+    if (log >= LAT_MAX_LOG) return LAT_BUCKETS - 1;
+    uint32_t sub = (uint32_t)(v >> (log - LAT_SUB_BITS)) & (LAT_SUB - 1);
+    return LAT_SUB + (log - LAT_SUB_BITS) * LAT_SUB + sub;
+}
+
+// Middle of the range bucket b covers
+static uint64_t lat_value(uint32_t b) {
+    if (b < LAT_SUB) return b;
+    int shift = (b - LAT_SUB) / LAT_SUB;
+    uint64_t low = (uint64_t)(LAT_SUB + (b & (LAT_SUB - 1))) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+static void cmd_stat_record(const struct command* c, uint64_t cycles) {
+    uint32_t i = c - __start_commands;
+    if (i >= CMD_STATS_MAX) return;
+    struct cmd_stat* st = &cmd_lat[i];
+    st->count++;
+    if (cycles > st->max) st->max = cycles;
+    st->hist[lat_bucket(cycles)]++;
+}
+
+// Smallest bucket value with at least pct percent of the samples at or below it
+static uint64_t cmd_stat_percentile(const struct cmd_stat* st, uint32_t pct) {
+    uint32_t want = (uint32_t)udiv64((uint64_t)st->count * pct + 99, 100, 0);
+    uint32_t seen = 0;
+    for (uint32_t b = 0; b < LAT_BUCKETS; b++) {
+        seen += st->hist[b];
+        if (seen >= want) return lat_value(b) < st->max ? lat_value(b) : st->max;
+    }
+    return st->max;
+}
+
+// Counters summed over every CPU
+static void cpu_stats_sum(struct cpu_stats* sum) {
+    memset(sum, 0, sizeof(*sum));
+    for (int i = 0; i < cpu_count; i++) {
+        const struct cpu_stats* st = &cpus[i].stats;
+        sum->kmalloc_calls += st->kmalloc_calls;
+        sum->kmalloc_bytes += st->kmalloc_bytes;
+        sum->vga_scrolls += st->vga_scrolls;
+        sum->cursor_outs += st->cursor_outs;
+        sum->fs_lookups += st->fs_lookups;
+        sum->fs_misses += st->fs_misses;
+    }
+}
+
+static void stats_write_us(uint64_t cycles, uint32_t khz) {
+    vga_write_uint((uint32_t)udiv64(cycles * 1000, khz, 0));
+    vga_write("us");
+}
+
+static void stats_command(struct cmd_args* a) {
+    if (strcmp(a->str, "-c") == 0) {
+        memset(cmd_lat, 0, sizeof(cmd_lat));
+        for (int i = 0; i < cpu_count; i++) memset(&cpus[i].stats, 0, sizeof(cpus[i].stats));
+        vga_write("\n");
+        return;
+    }
+    if (*a->str) {
+        vga_write("\nusage: stats [-c]\n");
+        return;
+    }
+
+    uint32_t khz = tsc_get_khz();
+    vga_write("\ncommand   runs  p50  p99  max\n");
+    for (const struct command* c = __start_commands; c < __stop_commands; c++) {
+        uint32_t i = c - __start_commands;
+        if (i >= CMD_STATS_MAX || !cmd_lat[i].count) continue;
+        const struct cmd_stat* st = &cmd_lat[i];
+        vga_write(c->name);
+        for (int pad = strlen(c->name); pad < 9; pad++) vga_write(" ");
+        vga_write(" ");
+        vga_write_uint(st->count);
+        vga_write("  ");
+        stats_write_us(cmd_stat_percentile(st, 50), khz);
+        vga_write("  ");
+        stats_write_us(cmd_stat_percentile(st, 99), khz);
+        vga_write("  ");
+        stats_write_us(st->max, khz);
+        vga_write("\n");
+    }
+
+    struct cpu_stats sum;
+    cpu_stats_sum(&sum);
+    vga_write("kmalloc: ");
+    vga_write_uint(sum.kmalloc_calls);
+    vga_write(" calls, ");
+    vga_write_uint((uint32_t)udiv64(sum.kmalloc_bytes, 1024, 0));
+    vga_write(" KiB\nvga: ");
+    vga_write_uint(sum.vga_scrolls);
+    vga_write(" scrolls, ");
+    vga_write_uint(sum.cursor_outs);
+    vga_write(" cursor port writes\nfs: ");
+    vga_write_uint(sum.fs_lookups);
+    vga_write(" lookups, ");
+    vga_write_uint(sum.fs_misses);
+    vga_write(" misses\n");
+}
+
+COMMAND(stats, "stats", "[-c]", "command latency percentiles and event counters (-c clears)", cmd_arg_any, stats_command);
+
+void handle_command(const char* line)
+{
+    while (*line == ' ') line++;
+    const char* end = line;
+    while (*end && *end != ' ') end++;
+    if (end == line) return; // empty line
+
+    const struct command* c = cmd_find(line, end - line);
+    if (!c) {
+        vga_write("\nUnknown command. Type help for commands.\n");
+        return;
+    }
+
+    struct cmd_args a;
+    a.str = end;
+    while (*a.str == ' ') a.str++;
+    a.num = 0;
+    if (c->parse(&a) < 0) {
+        vga_write("\nusage: ");
+        vga_write(c->name);
+        if (*c->args) vga_write(" ");
+        vga_write(c->args);
+        vga_write("\n");
+        return;
+    }
+    uint64_t t0 = rdtsc();
+    c->run(&a);
+    cmd_stat_record(c, rdtsc() - t0);
+}
+
+static void help_command(struct cmd_args* a) {
+    (void)a;
+    vga_write("\nexisting commands:\n");
+    for (const struct command* c = __start_commands; c < __stop_commands; c++) {
+        vga_write(c->name);
+        if (*c->args) vga_write(" ");
+        vga_write(c->args);
+        vga_write(" - ");
+        vga_write(c->help);
+        vga_write("\n");
+    }
+    vga_write("(file and dir names can be paths like ~/a/b or ../c)\n");
+    vga_write("shift+pgup/pgdn - scroll back through earlier output");
+}
+
+static void clear_command(struct cmd_args* a) {
+    (void)a;
+    vga_clear();
+}
+
+static void vgatest_command(struct cmd_args* a) {
+    (void)a;
+    testascii();
+}
+
+static void about_command(struct cmd_args* a) {
+    (void)a;
+    vga_set_color(0x04, 0x07);
+    vga_write("\niBANT-OS: x86 aka: (i386) OS.\n");
+    vga_write("Made by Julian Dziubak.\n");
+    vga_write("Made in C\n");
+    vga_set_color(0x01, 0x00); //blue on black
+}
+
+static void version_command(struct cmd_args* a) {
+    (void)a;
+    vga_write("\niBANT-OS Version 1.6 ENGLISH\n");
+}
+
+static void halt_command(struct cmd_args* a) {
+    (void)a;
+    bflush();
+    smp_stop_others(0);
+    __asm__ volatile ("cli");
+    while (1) { __asm__ volatile ("hlt"); } // hang
+}
+
+static void reboot_command(struct cmd_args* a) {
+    (void)a;
+    bflush();
+    smp_stop_others(1);
+    kernel_restart(); // restart
+}
+
+static void bgcolor_command(struct cmd_args* a) {
+    if (a->num <= 15) vga_set_color(vga_color & 0x0F, a->num);
+    else vga_write("\nInvalid color. Use 0-15.\n");
+}
+
+static void fgcolor_command(struct cmd_args* a) {
+    if (a->num <= 15) vga_set_color(a->num, vga_color >> 4);
+    else vga_write("\nInvalid color. Use 0-15.\n");
+}
+
+static void echo_command(struct cmd_args* a) {
+    vga_write("\n");
+    vga_write(a->str);
+    vga_write("\n");
+}
+
+static void calc_shell_command(struct cmd_args* a) {
+    vga_set_color(0x0A, 0x00); //blue on black
+    calc_command(a->str);
+    vga_set_color(0x01, 0x00); //blue on black
+}
+
+COMMAND(help, "help", "", "list of all commands", cmd_arg_none, help_command);
+COMMAND(calc, "calc", "<a> <operator> <b>", "very easy and dumb calculator", cmd_arg_str, calc_shell_command);
+COMMAND(clear, "clear", "", "clear screen", cmd_arg_none, clear_command);
+COMMAND(vgatest, "vgatest", "", "VGA character test", cmd_arg_none, vgatest_command);
+COMMAND(about, "about", "", "about ibant-os", cmd_arg_none, about_command);
+COMMAND(version, "version", "", "show version", cmd_arg_none, version_command);
+COMMAND(halt, "halt", "", "stop/halt CPU", cmd_arg_none, halt_command);
+COMMAND(reboot, "reboot", "", "go back to kernel_main();", cmd_arg_none, reboot_command);
+COMMAND(bgcolor, "bgcolor", "<0-15>", "change background color", cmd_arg_uint, bgcolor_command);
+COMMAND(fgcolor, "fgcolor", "<0-15>", "change foreground color", cmd_arg_uint, fgcolor_command);
+COMMAND(echo, "echo", "<text>", "echo your text!", cmd_arg_any, echo_command);
+
+// ---------- editor (gap buffer) ----------
+// edfile text lives in ed_buf with a gap at the cursor:
+//   [0, ed_gap_start) text | gap | [ed_gap_end, ed_cap) text
+// Typing or deleting at the cursor is O(1) and moving the cursor carries
+// one byte across the gap; the buffer doubles when the gap runs out.
+
+#define ED_MIN_CAP 256
+#define ED_TEXT_ROWS (VGA_HEIGHT - 1) // row 0 is the header
+#define ED_COLOR 0x71                 // blue on white
+#define ED_HEADER_COLOR 0x1F          // white on blue
+
+static char* ed_buf = 0;
+static size_t ed_cap = 0;
+static size_t ed_gap_start = 0; // == cursor offset
+static size_t ed_gap_end = 0;
+static size_t ed_top = 0;        // offset of the first line on screen
+static size_t ed_dirty_from = 0; // first offset changed since the last save
+static uint16_t ed_saved_screen[VGA_WIDTH * VGA_HEIGHT];
+static int ed_saved_x = 0, ed_saved_y = 0;
+
+static inline size_t ed_len(void) {
+    return ed_cap - (ed_gap_end - ed_gap_start);
+}
+
+static inline char ed_at(size_t i) {
+    return i < ed_gap_start ? ed_buf[i] : ed_buf[i + (ed_gap_end - ed_gap_start)];
+}
+
+static int ed_grow(void) {
+    size_t cap = ed_cap * 2;
+    size_t tail = ed_cap - ed_gap_end;
+    char* buf = kmalloc(cap);
+    if (!buf) return -1;
+
+    memcpy(buf, ed_buf, ed_gap_start);
+    memcpy(buf + cap - tail, ed_buf + ed_gap_end, tail);
+    kfree(ed_buf);
+    ed_buf = buf;
+    ed_gap_end = cap - tail;
+    ed_cap = cap;
+    return 0;
+}
+
+static void ed_left(void) {
+    if (ed_gap_start) ed_buf[--ed_gap_end] = ed_buf[--ed_gap_start];
+}
+
+static void ed_right(void) {
+    if (ed_gap_end < ed_cap) ed_buf[ed_gap_start++] = ed_buf[ed_gap_end++];
+}
+
+static void ed_move_to(size_t pos) {
+    while (ed_gap_start > pos) ed_left();
+    while (ed_gap_start < pos) ed_right();
+}
+
+static size_t ed_line_start(size_t i) {
+    while (i > 0 && ed_at(i - 1) != '\n') i--;
+    return i;
+}
+
+static size_t ed_line_end(size_t i) {
+    size_t len = ed_len();
+    while (i < len && ed_at(i) != '\n') i++;
+    return i;
+}
+
+// Up/down: same column on the neighbouring line, clipped to its length
+static void ed_vertical(int dir) {
+    size_t start = ed_line_start(ed_gap_start);
+    size_t col = ed_gap_start - start;
+    size_t target;
+
+    if (dir < 0) {
+        if (!start) return;
+        target = ed_line_start(start - 1);
+    } else {
+        target = ed_line_end(ed_gap_start);
+        if (target == ed_len()) return;
+        target++;
+    }
+    size_t end = ed_line_end(target);
+    ed_move_to(target + col < end ? target + col : end);
+}
+
+static void ed_insert(char c) {
+    if (ed_gap_start == ed_gap_end && ed_grow() < 0) return;
+    if (ed_gap_start < ed_dirty_from) ed_dirty_from = ed_gap_start;
+    ed_buf[ed_gap_start++] = c;
+}
+
+static void ed_backspace(void) {
+    if (!ed_gap_start) return;
+    ed_gap_start--;
+    if (ed_gap_start < ed_dirty_from) ed_dirty_from = ed_gap_start;
+}
+
+static void ed_delete(void) {
+    if (ed_gap_end == ed_cap) return;
+    ed_gap_end++;
+    if (ed_gap_start < ed_dirty_from) ed_dirty_from = ed_gap_start;
+}
+
+// Screen rows taken by text [from, to) with wrapping, counting at most limit
+static int ed_rows_between(size_t from, size_t to, int limit) {
+    int rows = 0, col = 0;
+    for (size_t i = from; i < to && rows < limit; i++) {
+        if (ed_at(i) == '\n' || ++col == VGA_WIDTH) {
+            rows++;
+            col = 0;
+        }
+    }
+    return rows;
+}
 
-        if (c == '\b') { // Backspace in edit mode
-            if (fs_edit_pos > 0) {
-                fs_edit_pos--;
-                // Move cursor back
-                cursor_x--;
-                // Erase character at cursor position
-                vga_buffer[cursor_y * VGA_WIDTH + cursor_x] = vga_entry(' ', vga_color);
-                update_cursor();
-            }
-            return;
+static void ed_scroll_into_view(void) {
+    size_t cur = ed_gap_start;
+    if (cur < ed_top) {
+        ed_top = ed_line_start(cur);
+    } else if (ed_rows_between(ed_top, cur, ED_TEXT_ROWS) >= ED_TEXT_ROWS) {
+        // put the cursor line about two thirds down the screen
+        size_t top = ed_line_start(cur);
+        while (top > 0 && ed_rows_between(ed_line_start(top - 1), cur, ED_TEXT_ROWS) < ED_TEXT_ROWS * 2 / 3)
+            top = ed_line_start(top - 1);
+        ed_top = top;
+    }
+}
+
+static void ed_render(void) {
+    static const char header[] = " -- editing -- TAB = save & leave, ESC = leave without saving, arrows move";
+    ed_scroll_into_view();
+
+    for (int x = 0; x < VGA_WIDTH; x++)
+        vga_put_at(x, 0, x < (int)sizeof(header) - 1 ? header[x] : ' ', ED_HEADER_COLOR);
+
+    int x = 0, y = 1, cx = 0, cy = 1;
+    size_t len = ed_len();
+    for (size_t i = ed_top; y < VGA_HEIGHT; i++) {
+        if (i == ed_gap_start) {
+            cx = x;
+            cy = y;
         }
+        if (i >= len) break;
 
-        if (fs_edit_pos < sizeof(fs_edit_buffer) - 1) {
-            fs_edit_buffer[fs_edit_pos++] = c;
-            vga_putc(c);
+        char c = ed_at(i);
+        if (c == '\n') {
+            while (x < VGA_WIDTH) vga_put_at(x++, y, ' ', ED_COLOR);
+        } else {
+            vga_put_at(x++, y, c, ED_COLOR);
+        }
+        if (x == VGA_WIDTH) {
+            x = 0;
+            y++;
         }
+    }
+    for (; y < VGA_HEIGHT; y++, x = 0)
+        while (x < VGA_WIDTH) vga_put_at(x++, y, ' ', ED_COLOR);
+
+    cursor_x = cx;
+    cursor_y = cy < VGA_HEIGHT ? cy : VGA_HEIGHT - 1;
+    vga_flush();
+}
+
+void ed_open(fs_node* f) {
+    size_t size = f->size;
+    ed_cap = ED_MIN_CAP;
+    while (ed_cap < size * 2) ed_cap *= 2;
+    ed_buf = kmalloc(ed_cap);
+    if (!ed_buf) return;
+
+    // existing text before the gap, cursor at the end of it
+    size = fs_file_read(f, 0, ed_buf, size);
+    ed_gap_start = size;
+    ed_gap_end = ed_cap;
+    ed_top = 0;
+    ed_dirty_from = size;
+    fs_edit_mode = 1;
+    fs_edit_file = f;
+
+    vga_save_screen(ed_saved_screen);
+    ed_saved_x = cursor_x;
+    ed_saved_y = cursor_y;
+    ed_render();
+}
+
+// Write the text back into the file; only the bytes from the first change
+// onwards are copied (or written to disk).
+static int ed_save(fs_node* f) {
+    size_t len = ed_len();
+    size_t from = ed_dirty_from < len ? ed_dirty_from : len;
+    if (fs_file_resize(f, len) < 0) return -1;
+
+    if (from < ed_gap_start) {
+        if (fs_file_write(f, from, ed_buf + from, ed_gap_start - from) < 0 ||
+            fs_file_write(f, ed_gap_start, ed_buf + ed_gap_end, ed_cap - ed_gap_end) < 0)
+            return -1;
+    } else if (fs_file_write(f, from, ed_buf + from + (ed_gap_end - ed_gap_start), len - from) < 0) {
+        return -1;
+    }
+    ed_dirty_from = len;
+    return 0;
+}
+
+static void ed_close(void) {
+    kfree(ed_buf);
+    ed_buf = 0;
+    fs_edit_mode = 0;
+    fs_edit_file = 0;
+
+    vga_restore_screen(ed_saved_screen);
+    cursor_x = ed_saved_x;
+    cursor_y = ed_saved_y;
+    vga_flush();
+}
+
+void ed_key(char c) {
+    switch (c) {
+        case '\t': // TAB = zapis
+            if (ed_save(fs_edit_file) < 0) return; // out of memory or disk: keep editing
+            ed_close();
+            vga_write("\n-- SAVED --\n");
+            vga_write("[ibant]> ");
+            return;
+        case KEY_ESC:
+            ed_close();
+            vga_write("\n-- not saved --\n");
+            vga_write("[ibant]> ");
+            return;
+        case '\b':      ed_backspace(); break;
+        case KEY_DEL:   ed_delete(); break;
+        case KEY_LEFT:  ed_left(); break;
+        case KEY_RIGHT: ed_right(); break;
+        case KEY_UP:    ed_vertical(-1); break;
+        case KEY_DOWN:  ed_vertical(1); break;
+        case KEY_HOME:  ed_move_to(ed_line_start(ed_gap_start)); break;
+        case KEY_END:   ed_move_to(ed_line_end(ed_gap_start)); break;
+        default:        ed_insert(c); break;
+    }
+    ed_render();
+}
+
+// ---------- input handling ----------
+void read_input_char(char c)
+{
+    if (fs_edit_mode) {
+        ed_key(c);
         return;
     }
 
@@ -752,52 +4189,624 @@ void read_input_char(char c)
         input_buffer[input_pos] = 0;
         handle_command(input_buffer);
         input_pos = 0;
-        vga_write("\n");
+        if (!fs_edit_mode) vga_write("\n");
     }
     else if (c == '\b') {
         if (input_pos > 0) {
             input_pos--;
             cursor_x--;
+            serial_putc('\b'); // on serial: back, blank, back
             vga_putc(' ');
+            serial_putc('\b');
             cursor_x--;
             update_cursor();
         }
     }
-    else if (input_pos < MAX_CMD_LEN - 1) {
-        input_buffer[input_pos++] = c;
-        vga_putc(c);
+    else if ((c >= KEY_UP && c <= KEY_DEL) || c == KEY_ESC) {
+        // cursor keys and ESC only mean something in the editor
+    }
+    else if (input_pos < MAX_CMD_LEN - 1) {
+        input_buffer[input_pos++] = c;
+        vga_putc(c);
+    }
+}
+
+
+void grublmao(void) {
+    vga_write("RUNNING WITH GRUB!!!\n now, returning to _start...\n");
+    klog(KLOG_INFO, "boot: started by GRUB, multiboot magic %x", multiboot_magic);
+}
+
+
+// ---------- framebuffer for safe UI test ----------
+// With a VBE linear framebuffer (Multiboot flags bit 12) everything is drawn
+// into a back buffer in RAM (fb) and gfx_present() moves finished frames to
+// the screen in one copy. Without one, gfxbench still draws off-screen.
+// Plain rep stosl/movsl: the kernel does not save FPU/SSE state.
+static uint32_t *fb = 0;
+static int fb_width = 0, fb_height = 0;
+
+static uint32_t* gfx_front = 0;    // the visible framebuffer
+static uint32_t gfx_front_pitch = 0; // bytes per row
+static int gfx_console = 0;        // text console is drawn into the framebuffer
+
+void init_framebuffer(uint32_t *framebuffer, int width, int height) {
+    fb = framebuffer;
+    fb_width = width;
+    fb_height = height;
+}
+
+void putpixel_fb(int x, int y, uint32_t color) {
+    if (!fb) return;
+    if (x < 0 || x >= fb_width || y < 0 || y >= fb_height) return;
+    fb[y * fb_width + x] = color;
+}
+
+static inline void gfx_fill32(uint32_t* dst, uint32_t color, uint32_t n) {
+    __asm__ volatile ("rep stosl" : "+D"(dst), "+c"(n) : "a"(color) : "memory");
+}
+
+// Clip a rectangle to the back buffer; 0 if nothing is left
+static int gfx_clip(int* x, int* y, int* w, int* h) {
+    if (*x < 0) { *w += *x; *x = 0; }
+    if (*y < 0) { *h += *y; *y = 0; }
+    if (*x + *w > fb_width) *w = fb_width - *x;
+    if (*y + *h > fb_height) *h = fb_height - *y;
+    return fb && *w > 0 && *h > 0;
+}
+
+void gfx_fill_rect(int x, int y, int w, int h, uint32_t color) {
+    if (!gfx_clip(&x, &y, &w, &h)) return;
+    uint32_t* row = fb + y * fb_width + x;
+    if (w == fb_width) { // whole rows: one run
+        gfx_fill32(row, color, w * h);
+        return;
+    }
+    for (int i = 0; i < h; i++, row += fb_width)
+        gfx_fill32(row, color, w);
+}
+
+// Copy a sw x sh image (rows of sw pixels) to (x, y)
+void gfx_blit(const uint32_t* src, int sw, int sh, int x, int y) {
+    int w = sw, h = sh, x0 = x, y0 = y;
+    if (!gfx_clip(&x, &y, &w, &h)) return;
+    src += (y - y0) * sw + (x - x0);
+    uint32_t* row = fb + y * fb_width + x;
+    for (int i = 0; i < h; i++, row += fb_width, src += sw)
+        memcpy(row, src, w * 4);
+}
+
+// 5x7 glyphs for ' '..'~' in 6x8 cells, one byte per row, bit 7 = left
+#define GFX_FONT_W 6
+#define GFX_FONT_H 8
+static const uint8_t gfx_font[95][8] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // ' '
+    { 0x20, 0x20, 0x20, 0x20, 0x20, 0x00, 0x20, 0x00 }, // '!'
+    { 0x50, 0x50, 0x50, 0x00, 0x00, 0x00, 0x00, 0x00 }, // '"'
+    { 0x50, 0x50, 0xF8, 0x50, 0xF8, 0x50, 0x50, 0x00 }, // '#'
+    { 0x20, 0x78, 0xA0, 0x70, 0x28, 0xF0, 0x20, 0x00 }, // '$'
+    { 0xC0, 0xC8, 0x10, 0x20, 0x40, 0x98, 0x18, 0x00 }, // '%'
+    { 0x60, 0x90, 0xA0, 0x40, 0xA8, 0x90, 0x68, 0x00 }, // '&'
+    { 0x60, 0x20, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00 }, // '''
+    { 0x10, 0x20, 0x40, 0x40, 0x40, 0x20, 0x10, 0x00 }, // '('
+    { 0x40, 0x20, 0x10, 0x10, 0x10, 0x20, 0x40, 0x00 }, // ')'
+    { 0x00, 0x50, 0x20, 0xF8, 0x20, 0x50, 0x00, 0x00 }, // '*'
+    { 0x00, 0x20, 0x20, 0xF8, 0x20, 0x20, 0x00, 0x00 }, // '+'
+    { 0x00, 0x00, 0x00, 0x00, 0x60, 0x20, 0x40, 0x00 }, // ','
+    { 0x00, 0x00, 0x00, 0xF8, 0x00, 0x00, 0x00, 0x00 }, // '-'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x60, 0x60, 0x00 }, // '.'
+    { 0x00, 0x08, 0x10, 0x20, 0x40, 0x80, 0x00, 0x00 }, // '/'
+    { 0x70, 0x88, 0x98, 0xA8, 0xC8, 0x88, 0x70, 0x00 }, // '0'
+    { 0x20, 0x60, 0x20, 0x20, 0x20, 0x20, 0x70, 0x00 }, // '1'
+    { 0x70, 0x88, 0x08, 0x10, 0x20, 0x40, 0xF8, 0x00 }, // '2'
+    { 0xF8, 0x10, 0x20, 0x10, 0x08, 0x88, 0x70, 0x00 }, // '3'
+    { 0x10, 0x30, 0x50, 0x90, 0xF8, 0x10, 0x10, 0x00 }, // '4'
+    { 0xF8, 0x80, 0xF0, 0x08, 0x08, 0x88, 0x70, 0x00 }, // '5'
+    { 0x30, 0x40, 0x80, 0xF0, 0x88, 0x88, 0x70, 0x00 }, // '6'
+    { 0xF8, 0x08, 0x10, 0x20, 0x40, 0x40, 0x40, 0x00 }, // '7'
+    { 0x70, 0x88, 0x88, 0x70, 0x88, 0x88, 0x70, 0x00 }, // '8'
+    { 0x70, 0x88, 0x88, 0x78, 0x08, 0x10, 0x60, 0x00 }, // '9'
+    { 0x00, 0x60, 0x60, 0x00, 0x60, 0x60, 0x00, 0x00 }, // ':'
+    { 0x00, 0x60, 0x60, 0x00, 0x60, 0x20, 0x40, 0x00 }, // ';'
+    { 0x10, 0x20, 0x40, 0x80, 0x40, 0x20, 0x10, 0x00 }, // '<'
+    { 0x00, 0x00, 0xF8, 0x00, 0xF8, 0x00, 0x00, 0x00 }, // '='
+    { 0x40, 0x20, 0x10, 0x08, 0x10, 0x20, 0x40, 0x00 }, // '>'
+    { 0x70, 0x88, 0x08, 0x10, 0x20, 0x00, 0x20, 0x00 }, // '?'
+    { 0x70, 0x88, 0x08, 0x68, 0xA8, 0xA8, 0x70, 0x00 }, // '@'
+    { 0x70, 0x88, 0x88, 0x88, 0xF8, 0x88, 0x88, 0x00 }, // 'A'
+    { 0xF0, 0x88, 0x88, 0xF0, 0x88, 0x88, 0xF0, 0x00 }, // 'B'
+    { 0x70, 0x88, 0x80, 0x80, 0x80, 0x88, 0x70, 0x00 }, // 'C'
+    { 0xE0, 0x90, 0x88, 0x88, 0x88, 0x90, 0xE0, 0x00 }, // 'D'
+    { 0xF8, 0x80, 0x80, 0xF0, 0x80, 0x80, 0xF8, 0x00 }, // 'E'
+    { 0xF8, 0x80, 0x80, 0xE0, 0x80, 0x80, 0x80, 0x00 }, // 'F'
+    { 0x70, 0x88, 0x80, 0x80, 0x98, 0x88, 0x70, 0x00 }, // 'G'
+    { 0x88, 0x88, 0x88, 0xF8, 0x88, 0x88, 0x88, 0x00 }, // 'H'
+    { 0x70, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x00 }, // 'I'
+    { 0x38, 0x10, 0x10, 0x10, 0x10, 0x90, 0x60, 0x00 }, // 'J'
+    { 0x88, 0x90, 0xA0, 0xC0, 0xA0, 0x90, 0x88, 0x00 }, // 'K'
+    { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0xF8, 0x00 }, // 'L'
+    { 0x88, 0xD8, 0xA8, 0x88, 0x88, 0x88, 0x88, 0x00 }, // 'M'
+    { 0x88, 0x88, 0xC8, 0xA8, 0x98, 0x88, 0x88, 0x00 }, // 'N'
+    { 0x70, 0x88, 0x88, 0x88, 0x88, 0x88, 0x70, 0x00 }, // 'O'
+    { 0xF0, 0x88, 0x88, 0xF0, 0x80, 0x80, 0x80, 0x00 }, // 'P'
+    { 0x70, 0x88, 0x88, 0x88, 0xA8, 0x90, 0x68, 0x00 }, // 'Q'
+    { 0xF0, 0x88, 0x88, 0xF0, 0xA0, 0x90, 0x88, 0x00 }, // 'R'
+    { 0x78, 0x80, 0x80, 0x70, 0x08, 0x08, 0xF0, 0x00 }, // 'S'
+    { 0xF8, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00 }, // 'T'
+    { 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x70, 0x00 }, // 'U'
+    { 0x88, 0x88, 0x88, 0x88, 0x88, 0x50, 0x20, 0x00 }, // 'V'
+    { 0x88, 0x88, 0x88, 0xA8, 0xA8, 0xD8, 0x88, 0x00 }, // 'W'
+    { 0x88, 0x88, 0x50, 0x20, 0x50, 0x88, 0x88, 0x00 }, // 'X'
+    { 0x88, 0x88, 0x50, 0x20, 0x20, 0x20, 0x20, 0x00 }, // 'Y'
+    { 0xF8, 0x08, 0x10, 0x20, 0x40, 0x80, 0xF8, 0x00 }, // 'Z'
+    { 0x70, 0x40, 0x40, 0x40, 0x40, 0x40, 0x70, 0x00 }, // '['
+    { 0x00, 0x80, 0x40, 0x20, 0x10, 0x08, 0x00, 0x00 }, // backslash
+    { 0x70, 0x10, 0x10, 0x10, 0x10, 0x10, 0x70, 0x00 }, // ']'
+    { 0x20, 0x50, 0x88, 0x00, 0x00, 0x00, 0x00, 0x00 }, // '^'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF8, 0x00 }, // '_'
+    { 0x40, 0x20, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00 }, // '`'
+    { 0x00, 0x00, 0x70, 0x08, 0x78, 0x88, 0x78, 0x00 }, // 'a'
+    { 0x80, 0x80, 0xB0, 0xC8, 0x88, 0x88, 0xF0, 0x00 }, // 'b'
+    { 0x00, 0x00, 0x70, 0x80, 0x80, 0x88, 0x70, 0x00 }, // 'c'
+    { 0x08, 0x08, 0x68, 0x98, 0x88, 0x88, 0x78, 0x00 }, // 'd'
+    { 0x00, 0x00, 0x70, 0x88, 0xF8, 0x80, 0x70, 0x00 }, // 'e'
+    { 0x30, 0x48, 0x40, 0xE0, 0x40, 0x40, 0x40, 0x00 }, // 'f'
+    { 0x00, 0x00, 0x78, 0x88, 0x78, 0x08, 0x30, 0x00 }, // 'g'
+    { 0x80, 0x80, 0xB0, 0xC8, 0x88, 0x88, 0x88, 0x00 }, // 'h'
+    { 0x20, 0x00, 0x60, 0x20, 0x20, 0x20, 0x70, 0x00 }, // 'i'
+    { 0x10, 0x00, 0x30, 0x10, 0x10, 0x90, 0x60, 0x00 }, // 'j'
+    { 0x40, 0x40, 0x48, 0x50, 0x60, 0x50, 0x48, 0x00 }, // 'k'
+    { 0x60, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x00 }, // 'l'
+    { 0x00, 0x00, 0xD0, 0xA8, 0xA8, 0x88, 0x88, 0x00 }, // 'm'
+    { 0x00, 0x00, 0xB0, 0xC8, 0x88, 0x88, 0x88, 0x00 }, // 'n'
+    { 0x00, 0x00, 0x70, 0x88, 0x88, 0x88, 0x70, 0x00 }, // 'o'
+    { 0x00, 0x00, 0xF0, 0x88, 0xF0, 0x80, 0x80, 0x00 }, // 'p'
+    { 0x00, 0x00, 0x68, 0x98, 0x78, 0x08, 0x08, 0x00 }, // 'q'
+    { 0x00, 0x00, 0xB0, 0xC8, 0x80, 0x80, 0x80, 0x00 }, // 'r'
+    { 0x00, 0x00, 0x70, 0x80, 0x70, 0x08, 0xF0, 0x00 }, // 's'
+    { 0x40, 0x40, 0xE0, 0x40, 0x40, 0x48, 0x30, 0x00 }, // 't'
+    { 0x00, 0x00, 0x88, 0x88, 0x88, 0x98, 0x68, 0x00 }, // 'u'
+    { 0x00, 0x00, 0x88, 0x88, 0x88, 0x50, 0x20, 0x00 }, // 'v'
+    { 0x00, 0x00, 0x88, 0x88, 0xA8, 0xA8, 0x50, 0x00 }, // 'w'
+    { 0x00, 0x00, 0x88, 0x50, 0x20, 0x50, 0x88, 0x00 }, // 'x'
+    { 0x00, 0x00, 0x88, 0x88, 0x78, 0x08, 0x70, 0x00 }, // 'y'
+    { 0x00, 0x00, 0xF8, 0x10, 0x20, 0x40, 0xF8, 0x00 }, // 'z'
+    { 0x10, 0x20, 0x20, 0x40, 0x20, 0x20, 0x10, 0x00 }, // '{'
+    { 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00 }, // '|'
+    { 0x40, 0x20, 0x20, 0x10, 0x20, 0x20, 0x40, 0x00 }, // '}'
+    { 0x00, 0x00, 0x40, 0xA8, 0x10, 0x00, 0x00, 0x00 }, // '~'
+
+};
+
+// One character cell at (x, y), each font pixel scale x scale
+void gfx_char(int x, int y, char c, uint32_t fg, uint32_t bg, int scale) {
+    const uint8_t* glyph = gfx_font[(c < 32 || c > 126) ? 0 : c - 32];
+    uint32_t line[GFX_FONT_W * 8];
+    int w = GFX_FONT_W * scale;
+    if (scale > 8 || x < 0 || y < 0 || x + w > fb_width || y + GFX_FONT_H * scale > fb_height) return;
+
+    uint32_t* row = fb + y * fb_width + x;
+    for (int r = 0; r < GFX_FONT_H; r++) {
+        for (int i = 0; i < w; i++)
+            line[i] = (glyph[r] << (i / scale)) & 0x80 ? fg : bg;
+        for (int k = 0; k < scale; k++, row += fb_width)
+            memcpy(row, line, w * 4);
+    }
+}
+
+void gfx_text(int x, int y, const char* s, uint32_t fg, uint32_t bg, int scale) {
+    for (; *s; s++, x += GFX_FONT_W * scale)
+        gfx_char(x, y, *s, fg, bg, scale);
+}
+
+// Back buffer rows [y0, y1) to the screen; the whole frame is one copy
+// when the framebuffer has no padding at the end of its rows
+void gfx_present_rows(int y0, int y1) {
+    if (!gfx_front || y0 >= y1) return;
+    if (gfx_front_pitch == (uint32_t)fb_width * 4) {
+        memcpy((uint8_t*)gfx_front + y0 * gfx_front_pitch, fb + y0 * fb_width,
+               (y1 - y0) * gfx_front_pitch);
+        return;
+    }
+    for (int y = y0; y < y1; y++)
+        memcpy((uint8_t*)gfx_front + y * gfx_front_pitch, fb + y * fb_width, fb_width * 4);
+}
+
+void gfx_present(void) {
+    gfx_present_rows(0, fb_height);
+}
+
+void draw_test_fb(void) {
+    if (!fb) return;
+    for (int y = 0; y < fb_height; y++) // simple gradient, a row at a time
+        gfx_fill_rect(0, y, fb_width, 1, (y * 0x010101) & 0xFFFFFF);
+    gfx_present();
+}
+
+// ---------- text console on the framebuffer ----------
+// The VGA text shadow is rendered with gfx_char() whenever vga_flush() runs;
+// a CRTC-style scroll becomes one move of the rendered rows.
+
+static const uint32_t gfx_vga_palette[16] = {
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+    0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF,
+};
+static int gfx_con_scale = 1;
+static int gfx_con_top = 0;              // vga_top last rendered
+static int gfx_con_cx = 0, gfx_con_cy = 0; // where the cursor was drawn
+
+// Screen row r from cells, without the cursor
+static void gfx_console_cells(int r, const uint16_t* cells) {
+    int cw = GFX_FONT_W * gfx_con_scale, ch = GFX_FONT_H * gfx_con_scale;
+    for (int x = 0; x < VGA_WIDTH; x++) {
+        uint8_t attr = cells[x] >> 8;
+        gfx_char(x * cw, r * ch, cells[x] & 0xFF, gfx_vga_palette[attr & 0x0F],
+                 gfx_vga_palette[attr >> 4], gfx_con_scale);
+    }
+}
+
+static void gfx_console_row(int r) {
+    int cw = GFX_FONT_W * gfx_con_scale, ch = GFX_FONT_H * gfx_con_scale;
+    const uint16_t* cells = VGA_ROW(r);
+    gfx_console_cells(r, cells);
+    if (r == cursor_y) { // underline cursor
+        uint8_t attr = cells[cursor_x < VGA_WIDTH ? cursor_x : VGA_WIDTH - 1] >> 8;
+        gfx_fill_rect(cursor_x * cw, (r + 1) * ch - gfx_con_scale, cw, gfx_con_scale,
+                      gfx_vga_palette[attr & 0x0F]);
+    }
+}
+
+void gfx_console_flush(int lo, int hi) {
+    if (!gfx_console) return;
+    int ch = GFX_FONT_H * gfx_con_scale;
+    int rows_px = VGA_HEIGHT * ch;
+
+    int moved = vga_top - gfx_con_top; // lines scrolled since the last flush
+    gfx_con_top = vga_top;
+    if (moved > 0 && moved < VGA_HEIGHT) {
+        for (int y = 0; y < rows_px - moved * ch; y++)
+            memcpy(fb + y * fb_width, fb + (y + moved * ch) * fb_width, fb_width * 4);
+        gfx_con_cy -= moved;
+    } else if (moved) {
+        lo = 0;
+        hi = VGA_HEIGHT - 1;
+    }
+
+    // the rows that held the cursor and now hold it are redrawn too
+    if (gfx_con_cy >= 0 && gfx_con_cy < VGA_HEIGHT) {
+        if (gfx_con_cy < lo) lo = gfx_con_cy;
+        if (gfx_con_cy > hi) hi = gfx_con_cy;
+    }
+    if (cursor_y < lo) lo = cursor_y;
+    if (cursor_y > hi) hi = cursor_y;
+    for (int r = lo; r <= hi; r++)
+        gfx_console_row(r);
+    gfx_con_cx = cursor_x;
+    gfx_con_cy = cursor_y;
+
+    if (moved) gfx_present_rows(0, rows_px);
+    else gfx_present_rows(lo * ch, (hi + 1) * ch);
+}
+
+// A whole screen from arbitrary rows (scrollback history); the next
+// vga_flush() of the live screen redraws everything over it
+void gfx_console_rows(const uint16_t* const* rows) {
+    if (!gfx_console) return;
+    for (int r = 0; r < VGA_HEIGHT; r++)
+        gfx_console_cells(r, rows[r]);
+    gfx_con_cy = -1; // the cursor was drawn over
+    gfx_present_rows(0, VGA_HEIGHT * GFX_FONT_H * gfx_con_scale);
+}
+
+// Take over the framebuffer GRUB set up, if it is one we can draw on
+void gfx_init(void) {
+    gfx_console = 0;
+    gfx_front = 0;
+    init_framebuffer(0, 0, 0); // after a reboot: pmm_init() took the old frames back
+    if (!multiboot_info || !(multiboot_info->flags & (1 << 12))) return;
+    if (multiboot_info->framebuffer_type != 1 || multiboot_info->framebuffer_bpp != 32 ||
+        multiboot_info->framebuffer_addr >= 0x100000000ULL)
+        return;
+
+    int w = multiboot_info->framebuffer_width, h = multiboot_info->framebuffer_height;
+    int sx = w / (VGA_WIDTH * GFX_FONT_W), sy = h / (VGA_HEIGHT * GFX_FONT_H);
+    int scale = sx < sy ? sx : sy;
+    if (scale < 1) { // too small for 80x25: leave it alone
+        klog(KLOG_WARN, "gfx: %ux%u framebuffer is too small for the console", w, h);
+        return;
+    }
+    uint32_t* back = (uint32_t*)pmm_alloc_frames((w * h * 4 + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!back) return;
+    init_framebuffer(back, w, h);
+    gfx_front = (uint32_t*)(uint32_t)multiboot_info->framebuffer_addr;
+    gfx_front_pitch = multiboot_info->framebuffer_pitch;
+    gfx_con_scale = scale > 8 ? 8 : scale;
+
+    gfx_fill_rect(0, 0, w, h, 0);
+    gfx_present();
+    gfx_con_top = vga_top;
+    gfx_con_cy = -1;
+    gfx_console = 1;
+    klog(KLOG_INFO, "gfx: %ux%u framebuffer console", w, h);
+    vga_mark_dirty(0, VGA_HEIGHT - 1);
+    vga_flush();
+}
+
+// Time full-screen frames: clear, rectangles, sprite blits, text, present
+static void gfxbench_command(struct cmd_args* a) {
+    (void)a;
+    static uint32_t* offscreen = 0;
+    static uint32_t sprite[32 * 32];
+    uint32_t* saved_fb = fb;
+    int saved_w = fb_width, saved_h = fb_height;
+
+    if (!gfx_front) { // no screen: same work on a 640x480 buffer
+        if (!offscreen) offscreen = (uint32_t*)pmm_alloc_frames(640 * 480 * 4 / PAGE_SIZE);
+        if (!offscreen) {
+            vga_write("\nno memory for an off-screen buffer\n");
+            return;
+        }
+        init_framebuffer(offscreen, 640, 480);
+    }
+    for (int i = 0; i < 32 * 32; i++)
+        sprite[i] = ((i & 31) * 8) << 16 | ((i >> 5) * 8) << 8 | 0x80;
+
+    enum { FRAMES = 32 };
+    uint64_t draw = 0, present = 0;
+    for (int f = 0; f < FRAMES; f++) {
+        uint64_t t0 = rdtsc();
+        gfx_fill_rect(0, 0, fb_width, fb_height, 0x102030);
+        for (int i = 0; i < 64; i++)
+            gfx_fill_rect((i * 37 + f * 5) % fb_width, (i * 53) % fb_height, 80, 40, 0x40 * (i & 3) << 8 | 0xC0);
+        for (int i = 0; i < 64; i++)
+            gfx_blit(sprite, 32, 32, (i * 71 + f * 3) % fb_width, (i * 29) % fb_height);
+        for (int i = 0; i < 16; i++)
+            gfx_text(8, 8 + i * 20, "iBANT-OS framebuffer benchmark 0123456789", 0xFFFFFF, 0x102030, 2);
+        uint64_t t1 = rdtsc();
+        gfx_present();
+        uint64_t t2 = rdtsc();
+        draw += t1 - t0;
+        present += t2 - t1;
+    }
+
+    uint32_t khz = tsc_get_khz();
+    vga_write("\n");
+    vga_write_uint(fb_width);
+    vga_write("x");
+    vga_write_uint(fb_height);
+    vga_write(gfx_front ? " framebuffer" : " off-screen");
+    vga_write(", per frame: draw ");
+    vga_write_uint((uint32_t)udiv64(draw * 1000, khz * FRAMES, 0));
+    vga_write(" us, present ");
+    vga_write_uint((uint32_t)udiv64(present * 1000, khz * FRAMES, 0));
+    vga_write(" us\n");
+
+    init_framebuffer(saved_fb, saved_w, saved_h);
+    if (gfx_console) { // put the console back
+        gfx_fill_rect(0, 0, fb_width, fb_height, 0);
+        gfx_present();
+        gfx_con_top = vga_top + VGA_HEIGHT; // force a full redraw
+        vga_mark_dirty(0, VGA_HEIGHT - 1);
+        vga_flush();
+    }
+}
+
+COMMAND(gfxbench, "gfxbench", "", "time full-screen framebuffer redraws", cmd_arg_none, gfxbench_command);
+
+// ---------- VGA mode 13h (320x200, 256 colours) ----------
+// Drawing goes to vga13_back; vga13_present() waits for vertical retrace
+// and copies the frame to 0xA0000 in one go. Entering the mode saves what
+// mode 13h overwrites (the text font in plane 2 and the DAC palette) so
+// vga_set_text_mode() can put the console back exactly.
+
+#define VGA13_WIDTH 320
+#define VGA13_HEIGHT 200
+
+static uint8_t vga13_back[VGA13_WIDTH * VGA13_HEIGHT] __attribute__((aligned(4)));
+static uint8_t vga13_font_save[256 * 32]; // plane 2: 32-byte slot per character
+static uint8_t vga13_dac_save[256 * 3];
+static int vga13_active = 0;
+static uint32_t vga13_missed_vsync = 0;
+
+// misc, sequencer[5], CRTC[25], graphics controller[9], attribute controller[21]
+static const uint8_t vga_regs_text[61] = {
+    0x67,
+    0x03, 0x00, 0x03, 0x00, 0x02,
+    0x5F, 0x4F, 0x50, 0x82, 0x55, 0x81, 0xBF, 0x1F, 0x00, 0x4F, 0x0D, 0x0E,
+    0x00, 0x00, 0x00, 0x50, 0x9C, 0x0E, 0x8F, 0x28, 0x1F, 0x96, 0xB9, 0xA3, 0xFF,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x0E, 0x00, 0xFF,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x14, 0x07, 0x38, 0x39, 0x3A, 0x3B,
+    0x3C, 0x3D, 0x3E, 0x3F, 0x0C, 0x00, 0x0F, 0x08, 0x00,
+};
+
+static const uint8_t vga_regs_13h[61] = {
+    0x63,
+    0x03, 0x01, 0x0F, 0x00, 0x0E,
+    0x5F, 0x4F, 0x50, 0x82, 0x54, 0x80, 0xBF, 0x1F, 0x00, 0x41, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x9C, 0x0E, 0x8F, 0x28, 0x40, 0x96, 0xB9, 0xA3, 0xFF,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x05, 0x0F, 0xFF,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+    0x0C, 0x0D, 0x0E, 0x0F, 0x41, 0x00, 0x0F, 0x00, 0x00,
+};
+
+static void vga_write_regs(const uint8_t* r) {
+    outb(0x3C2, *r++);
+    for (int i = 0; i < 5; i++) {
+        outb(0x3C4, i);
+        outb(0x3C5, *r++);
+    }
+    outb(0x3D4, 0x03); // unlock CRTC 0-7
+    outb(0x3D5, inb(0x3D5) | 0x80);
+    outb(0x3D4, 0x11);
+    outb(0x3D5, inb(0x3D5) & ~0x80);
+    for (int i = 0; i < 25; i++) {
+        uint8_t v = *r++;
+        if (i == 0x03) v |= 0x80;  // keep them unlocked
+        if (i == 0x11) v &= ~0x80;
+        outb(0x3D4, i);
+        outb(0x3D5, v);
+    }
+    for (int i = 0; i < 9; i++) {
+        outb(0x3CE, i);
+        outb(0x3CF, *r++);
     }
+    for (int i = 0; i < 21; i++) {
+        inb(0x3DA); // attribute controller back to index state
+        outb(0x3C0, i);
+        outb(0x3C0, *r++);
+    }
+    inb(0x3DA);
+    outb(0x3C0, 0x20); // palette source back to the display
 }
 
+// Map plane 2 alone at 0xA0000 (text mode only), copy the font, restore
+static void vga_font_copy(int save) {
+    outb(0x3C4, 0x02); outb(0x3C5, 0x04); // write plane 2
+    outb(0x3C4, 0x04); outb(0x3C5, 0x06); // no odd/even
+    outb(0x3CE, 0x04); outb(0x3CF, 0x02); // read plane 2
+    outb(0x3CE, 0x05); outb(0x3CF, 0x00);
+    outb(0x3CE, 0x06); outb(0x3CF, 0x04); // 0xA0000, 64 KiB
+    if (save) memcpy(vga13_font_save, (void*)VGA13_MEMORY, sizeof(vga13_font_save));
+    else memcpy((void*)VGA13_MEMORY, vga13_font_save, sizeof(vga13_font_save));
+    outb(0x3C4, 0x02); outb(0x3C5, vga_regs_text[1 + 2]);
+    outb(0x3C4, 0x04); outb(0x3C5, vga_regs_text[1 + 4]);
+    outb(0x3CE, 0x04); outb(0x3CF, vga_regs_text[31 + 4]);
+    outb(0x3CE, 0x05); outb(0x3CF, vga_regs_text[31 + 5]);
+    outb(0x3CE, 0x06); outb(0x3CF, vga_regs_text[31 + 6]);
+}
 
-void grublmao(void) {
-    vga_write("RUNNING WITH GRUB!!!\n now, returning to _start...\n");
+// rgb: count entries of 6-bit r, g, b starting at DAC index first
+void vga13_set_palette(int first, int count, const uint8_t* rgb) {
+    outb(0x3C8, first);
+    for (int i = 0; i < count * 3; i++)
+        outb(0x3C9, rgb[i]);
 }
 
+static void vga_dac_save(void) {
+    outb(0x3C7, 0);
+    for (int i = 0; i < 256 * 3; i++)
+        vga13_dac_save[i] = inb(0x3C9);
+}
 
-// ---------- framebuffer for safe UI test ----------
-static uint32_t *fb = 0;
-static int fb_width = 0, fb_height = 0;
+// 3-3-2 colour cube: index = rrrgggbb
+static void vga13_palette_332(void) {
+    uint8_t rgb[256 * 3];
+    for (int i = 0; i < 256; i++) {
+        rgb[i * 3 + 0] = ((i >> 5) & 7) * 63 / 7;
+        rgb[i * 3 + 1] = ((i >> 2) & 7) * 63 / 7;
+        rgb[i * 3 + 2] = (i & 3) * 63 / 3;
+    }
+    vga13_set_palette(0, 256, rgb);
+}
 
-void init_framebuffer(uint32_t *framebuffer, int width, int height) {
-    fb = framebuffer;
-    fb_width = width;
-    fb_height = height;
+void vga_set_mode13h(void) {
+    if (vga13_active || gfx_front) return; // already there / GRUB gave us a VBE mode
+    vga_dac_save();
+    vga_font_copy(1);
+    vga_write_regs(vga_regs_13h);
+    vga13_palette_332();
+    memset(vga13_back, 0, sizeof(vga13_back));
+    memset((void*)VGA13_MEMORY, 0, sizeof(vga13_back));
+    vga13_active = 1;
 }
 
-void putpixel_fb(int x, int y, uint32_t color) {
-    if (!fb) return;
-    if (x < 0 || x >= fb_width || y < 0 || y >= fb_height) return;
-    fb[y * fb_width + x] = color;
+void vga_set_text_mode(void) {
+    if (!vga13_active) return;
+    vga_write_regs(vga_regs_text);
+    vga_font_copy(0);
+    vga13_set_palette(0, 256, vga13_dac_save);
+    vga13_active = 0;
+
+    // text memory was overwritten too: reprogram start/cursor, redraw it all
+    vga_hw_top = -1;
+    vga_hw_cursor = -1;
+    vga_mark_dirty(0, VGA_HEIGHT - 1);
+    vga_flush();
 }
 
-void draw_test_fb(void) {
-    if (!fb) return;
-    for (int y = 0; y < fb_height; y++)
-        for (int x = 0; x < fb_width; x++)
-            putpixel_fb(x, y, (x + y) & 0xFFFFFF); // simple gradient
+// Wait for the start of vertical retrace (bounded: some emulators never set it)
+static void vga13_wait_vsync(void) {
+    uint64_t until = timer_now() + 40;
+    while ((inb(0x3DA) & 0x08) && timer_now() < until); // let a retrace in progress end
+    while (!(inb(0x3DA) & 0x08)) {
+        if (timer_now() >= until) {
+            vga13_missed_vsync++;
+            return;
+        }
+    }
+}
+
+void vga13_present(void) {
+    if (!vga13_active) return;
+    vga13_wait_vsync();
+    memcpy((void*)VGA13_MEMORY, vga13_back, sizeof(vga13_back));
+}
+
+void vga13_fill_rect(int x, int y, int w, int h, uint8_t color) {
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > VGA13_WIDTH) w = VGA13_WIDTH - x;
+    if (y + h > VGA13_HEIGHT) h = VGA13_HEIGHT - y;
+    if (w <= 0 || h <= 0) return;
+    uint8_t* row = vga13_back + y * VGA13_WIDTH + x;
+    for (int i = 0; i < h; i++, row += VGA13_WIDTH)
+        memset(row, color, w);
 }
 
+void vga13_text(int x, int y, const char* s, uint8_t color) {
+    for (; *s; s++, x += GFX_FONT_W) {
+        const uint8_t* glyph = gfx_font[(*s < 32 || *s > 126) ? 0 : *s - 32];
+        for (int r = 0; r < GFX_FONT_H && y + r < VGA13_HEIGHT; r++)
+            for (int i = 0; i < GFX_FONT_W && x + i < VGA13_WIDTH; i++)
+                if (x + i >= 0 && y + r >= 0 && ((glyph[r] << i) & 0x80))
+                    vga13_back[(y + r) * VGA13_WIDTH + x + i] = color;
+    }
+}
+
+// Bouncing bars for ~2 seconds, then back to the shell
+static void mode13_command(struct cmd_args* a) {
+    (void)a;
+    if (gfx_front) {
+        vga_write("\nalready in a VBE graphics mode\n");
+        return;
+    }
+    enum { FRAMES = 120 };
+    uint64_t copy = 0;
+    uint64_t start = timer_now();
+    vga13_missed_vsync = 0;
+    vga_set_mode13h();
+    for (int f = 0; f < FRAMES; f++) {
+        for (int y = 0; y < VGA13_HEIGHT; y++) // background gradient
+            memset(vga13_back + y * VGA13_WIDTH, (y * 8 / VGA13_HEIGHT) << 2 | 0x01, VGA13_WIDTH);
+        for (int i = 0; i < 8; i++) {
+            int x = (f * (i + 1) * 3) % (VGA13_WIDTH + 40) - 40;
+            vga13_fill_rect(x, 20 + i * 20, 40, 14, (i << 5) | 0x1C);
+        }
+        vga13_text(8, 186, "iBANT-OS mode 13h", 0xFF);
+        uint64_t t0 = rdtsc();
+        vga13_present();
+        copy += rdtsc() - t0;
+    }
+    uint32_t ms = (uint32_t)(timer_now() - start);
+    vga_set_text_mode();
+
+    vga_write("\n");
+    vga_write_uint(FRAMES);
+    vga_write(" frames in ");
+    vga_write_uint(ms);
+    vga_write(" ms, present (vsync wait + copy) ");
+    vga_write_uint((uint32_t)udiv64(copy * 1000, tsc_get_khz() * FRAMES, 0));
+    vga_write(" us/frame");
+    if (vga13_missed_vsync) {
+        vga_write(", no retrace seen ");
+        vga_write_uint(vga13_missed_vsync);
+        vga_write("x");
+    }
+    vga_write("\n");
+}
+
+COMMAND(mode13, "mode13", "", "mode 13h graphics demo (back to text after ~2 s)", cmd_arg_none, mode13_command);
+
 void bootimage() { // DO NOT TOUCH THIS AT ALL
     vga_clear();
     vga_set_color(0x00, 0x00); //blacl
@@ -848,18 +4857,876 @@ void bootimage() { // DO NOT TOUCH THIS AT ALL
    vga_write("(c) iBANT-DEV - Julian Dziubak\n2025-2026\n\nBooting..");
    vga_set_color(0x07, 0x00);
 }
+// ---------- SMP (ACPI MADT, local/IO APIC, AP startup) ----------
+// smp_init() finds the APICs in the ACPI MADT, moves the ISA IRQs from the
+// 8259s to the IO APIC (all delivered to the boot CPU) and wakes every other
+// CPU with INIT-SIPI-SIPI. An AP starts in real mode on the trampoline page,
+// loads our GDT, and ends up in ap_main() as the idle thread of its own run
+// queue, with the local APIC timer driving its scheduler tick.
+
+struct acpi_sdt {
+    char sig[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[6];
+    char oem_table[8];
+    uint32_t oem_rev;
+    uint32_t creator;
+    uint32_t creator_rev;
+} __attribute__((packed));
+
+static uint32_t lapic_timer_per_ms = 0;
+volatile uint32_t ap_boot_stack = 0; // top of the stack for the AP being started
+static volatile int smp_restart_pending = 0;
+static const char* const cpu_idle_names[CPU_MAX] = {
+    "idle0", "idle1", "idle2", "idle3", "idle4", "idle5", "idle6", "idle7"
+};
+
+void ap_main(void);
+
+// Copied to a free page below 1 MiB; the SIPI starts it at offset 0 with
+// CS = page >> 4. The far jump goes straight to ap_entry32 in the kernel.
+__asm__(
+    ".text\n"
+    ".code16\n"
+    ".global ap_tramp, ap_tramp_gdtr, ap_tramp_end\n"
+    "ap_tramp:\n"
+    "    cli\n"
+    "    mov %cs, %ax\n"
+    "    mov %ax, %ds\n"
+    "    lgdtl ap_tramp_gdtr - ap_tramp\n"
+    "    mov %cr0, %eax\n"
+    "    or $1, %eax\n"
+    "    mov %eax, %cr0\n"
+    "    ljmpl *(ap_tramp_jump - ap_tramp)\n"
+    ".align 4\n"
+    "ap_tramp_jump:\n"
+    "    .long ap_entry32\n"
+    "    .word 0x08\n"
+    "ap_tramp_gdtr:\n" // filled in by smp_init()
+    "    .word 0\n"
+    "    .long 0\n"
+    "ap_tramp_end:\n"
+    ".code32\n"
+    "ap_entry32:\n"
+    "    mov $0x10, %ax\n"
+    "    mov %ax, %ds\n"
+    "    mov %ax, %es\n"
+    "    mov %ax, %fs\n"
+    "    mov %ax, %gs\n"
+    "    mov %ax, %ss\n"
+    "    mov ap_boot_stack, %esp\n"
+    "    call ap_main\n"
+    "1:  cli\n"
+    "    hlt\n"
+    "    jmp 1b\n"
+);
+extern const uint8_t ap_tramp[], ap_tramp_gdtr[], ap_tramp_end[];
+
+static int acpi_checksum_ok(const void* p, uint32_t len) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += ((const uint8_t*)p)[i];
+    return sum == 0;
+}
+
+// "RSD PTR " sits on a 16-byte boundary in the first KiB of the EBDA or
+// in the BIOS area
+static uint32_t acpi_find_rsdp(void) {
+    uint16_t ebda_seg;
+    __asm__ volatile ("movw 0x40E, %0" : "=r"(ebda_seg)); // BDA word; GCC balks at a pointer this low
+    uint32_t ebda = (uint32_t)ebda_seg << 4;
+    uint32_t from[2] = { ebda, 0xE0000 };
+    uint32_t to[2] = { ebda + 1024, 0x100000 };
+    for (int r = 0; r < 2; r++) {
+        for (uint32_t p = from[r]; p + 20 <= to[r]; p += 16)
+            if (strncmp((const char*)p, "RSD PTR ", 8) == 0 && acpi_checksum_ok((void*)p, 20))
+                return p;
+    }
+    return 0;
+}
+
+static struct acpi_sdt* acpi_find_table(const char* sig) {
+    uint32_t rsdp = acpi_find_rsdp();
+    if (!rsdp) return 0;
+    struct acpi_sdt* rsdt = (struct acpi_sdt*)*(uint32_t*)(rsdp + 16);
+    if (!rsdt || strncmp(rsdt->sig, "RSDT", 4) != 0) return 0;
+
+    uint32_t* entries = (uint32_t*)(rsdt + 1);
+    uint32_t n = (rsdt->length - sizeof(*rsdt)) / 4;
+    for (uint32_t i = 0; i < n; i++) {
+        struct acpi_sdt* t = (struct acpi_sdt*)entries[i];
+        if (strncmp(t->sig, sig, 4) == 0 && acpi_checksum_ok(t, t->length)) return t;
+    }
+    return 0;
+}
+
+// Enabled CPUs' APIC IDs into ids[], the IO APIC and the ISA overrides into
+// the interrupt globals. Returns the number of CPUs, 0 without a MADT.
+static int smp_parse_madt(uint8_t* ids, uint32_t* lapic_addr, uint32_t* ioapic_addr) {
+    struct acpi_sdt* madt = acpi_find_table("APIC");
+    if (!madt) return 0;
+
+    for (int i = 0; i < 16; i++) {
+        isa_gsi[i] = i;
+        isa_flags[i] = 0;
+    }
+    *lapic_addr = *(uint32_t*)((uint8_t*)madt + 36);
+    *ioapic_addr = 0;
+
+    int n = 0;
+    uint8_t* p = (uint8_t*)madt + 44;
+    uint8_t* end = (uint8_t*)madt + madt->length;
+    while (p + 2 <= end && p[1] >= 2) {
+        switch (p[0]) {
+            case 0: // processor local APIC: acpi id, apic id, flags
+                if ((*(uint32_t*)(p + 4) & 1) && n < CPU_MAX) ids[n++] = p[3];
+                break;
+            case 1: // IO APIC: id, reserved, address, first GSI
+                if (!*ioapic_addr) {
+                    *ioapic_addr = *(uint32_t*)(p + 4);
+                    ioapic_gsi_base = *(uint32_t*)(p + 8);
+                }
+                break;
+            case 2: // interrupt source override: bus, irq, gsi, flags
+                if (p[2] == 0 && p[3] < 16) {
+                    isa_gsi[p[3]] = *(uint32_t*)(p + 4);
+                    isa_flags[p[3]] = *(uint16_t*)(p + 8);
+                }
+                break;
+        }
+        p += p[1];
+    }
+    return n;
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint32_t icr) {
+    uint32_t flags = irq_save();
+    lapic_write(LAPIC_ICR_HI, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, icr);
+    while (lapic_read(LAPIC_ICR_LO) & (1 << 12)) // delivery pending
+        __asm__ volatile ("pause");
+    irq_restore(flags);
+}
+
+static void lapic_enable(void) {
+    lapic_write(LAPIC_SVR, 0x100 | SPURIOUS_VECTOR);
+    lapic_write(LAPIC_TPR, 0);
+}
+
+// Count the timer down against 10 ms of PIT ticks (divider 16)
+static void lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_TIMER, 1 << 16); // masked one-shot
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    delay_ms(10);
+    lapic_timer_per_ms = (0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR)) / 10;
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    if (!lapic_timer_per_ms) lapic_timer_per_ms = 1;
+}
+
+// 1 kHz periodic tick on this CPU
+static void lapic_timer_start(void) {
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_TIMER, (IRQ_BASE + IRQ_LAPIC_TIMER) | 0x20000);
+    lapic_write(LAPIC_TIMER_INIT, lapic_timer_per_ms);
+}
+
+static void lapic_timer_irq(struct irq_frame* f) {
+    perf_sample(f->eip);
+    sched_tick();
+}
+
+static void resched_irq(struct irq_frame* f) {
+    (void)f;
+    cpu_this()->need_resched = 1; // acted on in sched_irq_exit()
+}
+
+static void stop_irq(struct irq_frame* f) {
+    (void)f;
+    lapic_write(LAPIC_EOI, 0); // kernel_restart must not leave this in service
+    if (cpu_this() == &cpus[0] && smp_restart_pending) kernel_restart();
+    while (1) __asm__ volatile ("cli; hlt");
+}
+
+// Stop every other CPU before halting or rebooting. A restart asked for on
+// an AP is handed to the boot CPU, and the caller stops instead.
+void smp_stop_others(int restart) {
+    if (!lapic || cpu_count == 1) return;
+    __asm__ volatile ("cli");
+    smp_restart_pending = restart;
+    lapic_write(LAPIC_ICR_HI, 0);
+    lapic_write(LAPIC_ICR_LO, (IRQ_BASE + IRQ_STOP) | (3 << 18)); // all but self
+    while (lapic_read(LAPIC_ICR_LO) & (1 << 12)) __asm__ volatile ("pause");
+    if (restart && cpu_this() != &cpus[0])
+        while (1) __asm__ volatile ("hlt");
+}
+
+void ap_main(void) {
+    struct idt_ptr ip = { sizeof(idt) - 1, (uint32_t)idt };
+    __asm__ volatile ("lidt %0" : : "m"(ip));
+    lapic_enable();
+
+    struct cpu* c = &cpus[cpu_by_apic[lapic_read(LAPIC_ID) >> 24]];
+    cpu_fs_load(c->id);
+    sched_init_cpu(c, cpu_idle_names[c->id], ap_boot_stack - THREAD_STACK_SIZE);
+    lapic_timer_start();
+    c->online = 1;
+
+    while (1) __asm__ volatile ("sti; hlt"); // idle
+}
+
+static int smp_overlaps(uint32_t page, uint32_t addr, uint32_t len) {
+    return len && addr < page + PAGE_SIZE && page < addr + len;
+}
+
+// A page below 1 MiB for the trampoline that holds nothing reboot needs
+static uint32_t smp_tramp_page(void) {
+    struct multiboot_info* mbi = (struct multiboot_info*)multiboot_info_addr;
+    int mb = multiboot_magic == MULTIBOOT_BOOTLOADER_MAGIC;
+    for (uint32_t page = 0x8000; page < 0x9F000; page += PAGE_SIZE) {
+        if (mb) {
+            if (smp_overlaps(page, multiboot_info_addr, sizeof(*mbi))) continue;
+            if ((mbi->flags & (1 << 2)) && mbi->cmdline &&
+                smp_overlaps(page, mbi->cmdline, strlen((char*)mbi->cmdline) + 1)) continue;
+            if ((mbi->flags & (1 << 6)) && smp_overlaps(page, mbi->mmap_addr, mbi->mmap_length))
+                continue;
+            if (mbi->flags & (1 << 3)) {
+                struct multiboot_module* mods = (struct multiboot_module*)mbi->mods_addr;
+                int hit = smp_overlaps(page, mbi->mods_addr, mbi->mods_count * sizeof(*mods));
+                for (uint32_t i = 0; i < mbi->mods_count && !hit; i++)
+                    hit = mods[i].string &&
+                          smp_overlaps(page, mods[i].string, strlen((char*)mods[i].string) + 1);
+                if (hit) continue;
+            }
+        }
+        return page;
+    }
+    return 0;
+}
+
+// Returns the number of CPUs running
+int smp_init(void) {
+    uint8_t ids[CPU_MAX];
+    uint32_t lapic_addr, ioapic_addr;
+    int n = smp_parse_madt(ids, &lapic_addr, &ioapic_addr);
+    if (!n || !lapic_addr) return 1;
+
+    uint32_t flags = irq_save();
+    lapic = (volatile uint32_t*)lapic_addr;
+    lapic_enable();
+    uint8_t self = lapic_read(LAPIC_ID) >> 24;
+    cpus[0].apic_id = self;
+    cpu_by_apic[self] = 0;
+    irq_install_handler(IRQ_LAPIC_TIMER, lapic_timer_irq);
+    irq_install_handler(IRQ_RESCHED, resched_irq);
+    irq_install_handler(IRQ_STOP, stop_irq);
+
+    if (ioapic_addr) {
+        ioapic = (volatile uint32_t*)ioapic_addr;
+        ioapic_dest = self;
+        for (int pin = 0; pin < ioapic_pins(); pin++)
+            ioapic_write(0x10 + 2 * pin, 1 << 16);
+        for (int irq = 0; irq < 16; irq++)
+            if (irq_handlers[irq]) ioapic_route(irq, 0);
+        outb(PIC1_DATA, 0xFF); // the 8259s are done
+        outb(PIC2_DATA, 0xFF);
+    }
+    irq_restore(flags);
+
+    uint32_t page = smp_tramp_page();
+    if (!ioapic || !page) return 1; // APs would get no timer routing sorted out; stay UP
+    lapic_timer_calibrate();
+
+    uint32_t size = ap_tramp_end - ap_tramp;
+    memcpy((void*)page, ap_tramp, size);
+    struct gdt_ptr gp = { sizeof(gdt) - 1, (uint32_t)gdt };
+    memcpy((uint8_t*)page + (ap_tramp_gdtr - ap_tramp), &gp, sizeof(gp));
+
+    for (int i = 0; i < n && cpu_count < CPU_MAX; i++) {
+        if (ids[i] == self) continue;
+        uint32_t stack = pmm_alloc_frames(THREAD_STACK_SIZE / PAGE_SIZE);
+        if (!stack) break;
+
+        struct cpu* c = &cpus[cpu_count];
+        c->id = cpu_count;
+        c->apic_id = ids[i];
+        cpu_by_apic[ids[i]] = cpu_count;
+        ap_boot_stack = stack + THREAD_STACK_SIZE;
+
+        lapic_send_ipi(ids[i], 0x4500); // INIT
+        delay_ms(10);
+        for (int k = 0; k < 2 && !c->online; k++) {
+            lapic_send_ipi(ids[i], 0x4600 | (page >> 12)); // SIPI
+            delay_ms(1);
+        }
+        uint64_t until = timer_now() + 100;
+        while (!c->online && timer_now() < until) __asm__ volatile ("hlt");
+        if (!c->online) { // a late AP would reuse the next one's stack
+            klog(KLOG_WARN, "smp: APIC %u did not start", ids[i]);
+            break;
+        }
+        cpu_count++;
+    }
+    klog(KLOG_INFO, "smp: %u of %u CPUs online", cpu_count, n);
+    return cpu_count;
+}
+
+static void cpus_command(struct cmd_args* a) {
+    (void)a;
+    vga_write("\n");
+    for (int i = 0; i < cpu_count; i++) {
+        struct cpu* c = &cpus[i];
+        vga_write("  cpu ");
+        vga_write_uint(i);
+        vga_write(" (apic ");
+        vga_write_uint(c->apic_id);
+        vga_write("): ");
+        vga_write(c->current ? c->current->name : "-");
+        vga_write(", ");
+        vga_write_uint(c->nrun);
+        vga_write(" queued, idle ");
+        vga_write_uint((uint32_t)c->idle->ticks);
+        vga_write(" ms, ");
+        vga_write_uint(c->steals);
+        vga_write(" steals\n");
+    }
+}
+
+COMMAND(cpus, "cpus", "", "per-CPU scheduler state", cmd_arg_none, cpus_command);
+
+// ---------- smpbench: one CPU-bound job, on one thread and on all CPUs ----------
+
+static struct {
+    uint32_t limit;
+    uint32_t step;
+    uint32_t found[CPU_MAX];
+    int remaining;
+    struct waitq done;
+} smpbench;
+
+static int smpbench_is_prime(uint32_t n) {
+    if (n < 2) return 0;
+    for (uint32_t d = 2; d * d <= n; d++)
+        if (n % d == 0) return 0;
+    return 1;
+}
+
+// Worker w takes every step-th number starting at w
+static void smpbench_worker(void* arg) {
+    uint32_t w = (uint32_t)arg;
+    uint32_t found = 0;
+    for (uint32_t n = w; n < smpbench.limit; n += smpbench.step)
+        found += smpbench_is_prime(n);
+    smpbench.found[w] = found;
+
+    uint32_t flags = irq_save();
+    spin_lock(&smpbench.done.lock);
+    smpbench.remaining--;
+    waitq_wake_locked(&smpbench.done);
+    spin_unlock(&smpbench.done.lock);
+    irq_restore(flags);
+}
+
+static void smpbench_command(struct cmd_args* a) {
+    uint32_t khz = tsc_get_khz();
+    vga_write("\n");
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t workers = pass ? cpu_count : 1;
+        smpbench.limit = a->num;
+        smpbench.step = workers;
+        smpbench.remaining = workers;
+
+        uint64_t t0 = rdtsc();
+        for (uint32_t w = 0; w < workers; w++) {
+            smpbench.found[w] = 0;
+            if (thread_create("smpbench", smpbench_worker, (void*)w) < 0) {
+                vga_write("out of threads\n");
+                return; // the ones already started finish on their own
+            }
+        }
+        uint32_t flags = irq_save();
+        spin_lock(&smpbench.done.lock);
+        while (smpbench.remaining) {
+            thread_wait(&smpbench.done);
+            spin_lock(&smpbench.done.lock);
+        }
+        spin_unlock(&smpbench.done.lock);
+        irq_restore(flags);
+        uint64_t cycles = rdtsc() - t0;
+
+        uint32_t found = 0;
+        for (uint32_t w = 0; w < workers; w++) found += smpbench.found[w];
+        vga_write_uint(workers);
+        vga_write(workers == 1 ? " thread:  " : " threads: ");
+        vga_write_uint(found);
+        vga_write(" primes below ");
+        vga_write_uint(a->num);
+        vga_write(" in ");
+        vga_write_uint((uint32_t)udiv64(cycles, khz, 0));
+        vga_write(" ms\n");
+    }
+}
+
+COMMAND(smpbench, "smpbench", "<n>", "count primes below <n> on 1 thread, then on every CPU", cmd_arg_uint, smpbench_command);
+
+// ---------- dmesg ----------
+
+// Expand a record's format: %u %d %x %c %s and %%, no widths
+static void klog_format(const struct klog_rec* r, char* out, int size) {
+    int n = 0, a = 0;
+    for (const char* f = r->fmt; *f && n < size - 1; f++) {
+        if (*f != '%' || !f[1]) {
+            out[n++] = *f;
+            continue;
+        }
+        f++;
+        if (*f == '%') {
+            out[n++] = '%';
+            continue;
+        }
+        uint32_t v = a < r->nargs ? r->arg[a] : 0;
+        a++;
+
+        char tmp[12];
+        const char* s = tmp;
+        int len = 0;
+        switch (*f) {
+            case 'd':
+                if ((int32_t)v < 0) {
+                    out[n++] = '-';
+                    v = -v;
+                }
+                // fall through
+            case 'u':
+            case 'x': {
+                uint32_t base = *f == 'x' ? 16 : 10;
+                int i = sizeof(tmp);
+                do {
+                    tmp[--i] = "0123456789abcdef"[v % base];
+                    v /= base;
+                } while (v);
+                s = tmp + i;
+                len = sizeof(tmp) - i;
+                break;
+            }
+            case 'c':
+                tmp[0] = v;
+                len = 1;
+                break;
+            case 's':
+                s = v ? (const char*)v : "(null)";
+                while (len < 48 && s[len]) len++;
+                break;
+            default:
+                tmp[0] = '%';
+                tmp[1] = *f;
+                len = 2;
+                break;
+        }
+        for (int i = 0; i < len && n < size - 1; i++) out[n++] = s[i];
+    }
+    out[n] = 0;
+}
+
+static void dmesg_command(struct cmd_args* a) {
+    int clear = strcmp(a->str, "-c") == 0;
+    if (*a->str && !clear) {
+        vga_write("\nusage: dmesg [-c]\n");
+        return;
+    }
+    static const char* const level_names[] = { "err", "warn", "info", "debug" };
+    uint32_t khz = tsc_get_khz();
+    uint32_t head = klog_head;
+    uint32_t from = klog_tail;
+    if (head - from > KLOG_SIZE) {
+        vga_write("\n(");
+        vga_write_uint(head - from - KLOG_SIZE);
+        vga_write(" older records overwritten)");
+        from = head - KLOG_SIZE;
+    }
+
+    vga_write("\n");
+    for (uint32_t pos = from; pos != head; pos++) {
+        struct klog_rec r;
+        if (!klog_read(pos, &r)) continue; // still being written, or lapped
+
+        uint32_t us;
+        uint32_t sec = (uint32_t)udiv64(udiv64((r.tsc - boot_tsc_start) * 1000, khz, 0), 1000000, &us);
+        char line[160];
+        klog_format(&r, line, sizeof(line));
+
+        vga_write("[");
+        vga_write_uint(sec);
+        vga_write(".");
+        for (uint32_t d = 100000; d > 1 && us < d; d /= 10) vga_write("0");
+        vga_write_uint(us);
+        vga_write("] cpu");
+        vga_write_uint(r.cpu);
+        vga_write(" ");
+        vga_write(level_names[r.level & 3]);
+        vga_write(": ");
+        vga_write(line);
+        vga_write("\n");
+    }
+    if (clear) klog_tail = head;
+}
+
+COMMAND(dmesg, "dmesg", "[-c]", "show the kernel log (-c: then clear it)", cmd_arg_any, dmesg_command);
+
+// ---------- sampling profiler ----------
+// Every timer tick (IRQ0 on the boot CPU, the local APIC timer elsewhere)
+// drops the interrupted EIP into a histogram of PERF_GRAIN-byte buckets
+// over the kernel text, so sampling costs one atomic increment. perf maps
+// the buckets to functions through the address-ordered name table the
+// Makefile links in (boot/ksyms.awk), or, in a kernel linked without it,
+// through the ELF symbol table GRUB loaded with us, sorted on first use.
+
+#define PERF_TEXT_START 0x100000 // -Ttext
+#define PERF_SHIFT 4             // 16-byte buckets; gcc aligns functions to 16
+#define PERF_BUCKETS 8192        // 128 KiB of text
+#define PERF_TOP 15
+
+struct perf_sym {
+    uint32_t addr;
+    const char* name;
+};
+
+extern char _etext[]; // end of .text, provided by the linker
+
+// generated at link time; weak, so a plain one-pass link still works
+extern const struct perf_sym perf_ksyms[] __attribute__((weak));
+extern const uint32_t perf_ksyms_count __attribute__((weak));
+
+static uint32_t perf_hist[PERF_BUCKETS];
+static volatile int perf_running = 0;
+static uint32_t perf_samples = 0;
+static uint32_t perf_outside = 0; // samples past the histogram (AP trampoline, ...)
+static const struct perf_sym* perf_syms = 0;
+static int perf_nsyms = -1; // -1 = not loaded yet, 0 = no symbols
+
+void perf_sample(uint32_t eip) {
+    if (!perf_running) return;
+    uint32_t b = (eip - PERF_TEXT_START) >> PERF_SHIFT;
+    if (eip < (uint32_t)_etext && b < PERF_BUCKETS) __atomic_fetch_add(&perf_hist[b], 1, __ATOMIC_RELAXED);
+    else __atomic_fetch_add(&perf_outside, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&perf_samples, 1, __ATOMIC_RELAXED);
+}
+
+// Function symbols from the linked table, else from .symtab sorted by address
+static void perf_load_syms(void) {
+    perf_nsyms = 0;
+    if (&perf_ksyms_count && perf_ksyms_count) {
+        perf_syms = perf_ksyms;
+        perf_nsyms = perf_ksyms_count;
+        return;
+    }
+    if (multiboot_magic != MULTIBOOT_BOOTLOADER_MAGIC) return;
+    uint32_t nsec;
+    struct elf_shdr* sec = mb_elf_sections((struct multiboot_info*)multiboot_info_addr, &nsec);
+    for (uint32_t i = 0; sec && i < nsec && !perf_syms; i++) {
+        if (sec[i].type != SHT_SYMTAB || !sec[i].addr || sec[i].link >= nsec) continue;
+        struct elf_sym* sym = (struct elf_sym*)sec[i].addr;
+        const char* str = (const char*)sec[sec[i].link].addr;
+        uint32_t n = sec[i].size / sizeof(*sym);
+
+        int count = 0;
+        for (uint32_t k = 0; k < n; k++)
+            if ((sym[k].info & 0xF) == STT_FUNC) count++;
+        struct perf_sym* syms = kmalloc(count * sizeof(*syms));
+        if (!syms) return;
+        for (uint32_t k = 0; k < n; k++) {
+            if ((sym[k].info & 0xF) != STT_FUNC) continue;
+            struct perf_sym p = { sym[k].value, str + sym[k].name };
+            int j = perf_nsyms++;
+            while (j > 0 && syms[j - 1].addr > p.addr) {
+                syms[j] = syms[j - 1];
+                j--;
+            }
+            syms[j] = p;
+        }
+        perf_syms = syms;
+    }
+}
+
+// Index of the function containing addr, or -1
+static int perf_find_sym(uint32_t addr) {
+    int lo = 0, hi = perf_nsyms - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (perf_syms[mid].addr <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+static void perf_report(void) {
+    uint32_t total = perf_samples;
+    vga_write("\n");
+    vga_write_uint(total);
+    vga_write(perf_running ? " samples so far\n" : " samples\n");
+    if (!total) return;
+    if (perf_nsyms < 0) perf_load_syms();
+
+    // fold the buckets into per-function counts (raw buckets without symbols)
+    int nslots = perf_nsyms > 0 ? perf_nsyms : PERF_BUCKETS;
+    uint32_t* count = kmalloc(nslots * sizeof(uint32_t));
+    if (!count) return;
+    memset(count, 0, nslots * sizeof(uint32_t));
+    uint32_t unknown = perf_outside;
+    for (int b = 0; b < PERF_BUCKETS; b++) {
+        if (!perf_hist[b]) continue;
+        int i = perf_nsyms > 0 ? perf_find_sym(PERF_TEXT_START + (b << PERF_SHIFT)) : b;
+        if (i < 0) unknown += perf_hist[b];
+        else count[i] += perf_hist[b];
+    }
+
+    for (int shown = 0; shown < PERF_TOP; shown++) {
+        int best = -1;
+        for (int i = 0; i < nslots; i++)
+            if (count[i] && (best < 0 || count[i] > count[best])) best = i;
+        if (best < 0) break;
+
+        uint32_t pct10 = (uint32_t)udiv64((uint64_t)count[best] * 1000, total, 0);
+        vga_write("  ");
+        if (pct10 < 100) vga_write(" ");
+        vga_write_uint(pct10 / 10);
+        vga_write(".");
+        vga_write_uint(pct10 % 10);
+        vga_write("%  ");
+        vga_write_uint(count[best]);
+        vga_write("  ");
+        if (perf_nsyms > 0) vga_write(perf_syms[best].name);
+        else vga_write_hex(PERF_TEXT_START + (best << PERF_SHIFT));
+        vga_write("\n");
+        count[best] = 0;
+    }
+    if (unknown) {
+        vga_write("  (");
+        vga_write_uint(unknown);
+        vga_write(" outside known functions)\n");
+    }
+    kfree(count);
+}
+
+static void perf_command(struct cmd_args* a) {
+    if (strcmp(a->str, "start") == 0) {
+        perf_running = 1;
+        vga_write("\nprofiling\n");
+    } else if (strcmp(a->str, "stop") == 0) {
+        perf_running = 0;
+        perf_report();
+    } else if (strcmp(a->str, "reset") == 0) {
+        int was = perf_running;
+        perf_running = 0;
+        memset(perf_hist, 0, sizeof(perf_hist));
+        perf_samples = perf_outside = 0;
+        perf_running = was;
+        vga_write("\n");
+    } else if (!*a->str || strcmp(a->str, "top") == 0) {
+        perf_report();
+    } else {
+        vga_write("\nusage: perf [start|stop|reset|top]\n");
+    }
+}
+
+COMMAND(perf, "perf", "[start|stop|reset|top]", "sample where the CPUs spend their time", cmd_arg_any, perf_command);
+
+// ---------- scripted benchmarks ----------
+// bench/run.py boots us in QEMU and types scenarios into COM1. Each one is
+// wrapped in "bench begin <name>" / "bench end"; the end line reports the
+// cycles the shell spent handling input in between (time spent waiting on
+// the line does not count) and how the event counters moved. "exit" then
+// leaves QEMU through its isa-debug-exit port.
+
+#define QEMU_EXIT_PORT 0xF4 // -device isa-debug-exit,iobase=0xf4,iosize=0x04
+
+static uint64_t shell_busy_cycles = 0; // added up by shell_thread
+
+static struct {
+    char name[MAX_NAME_LEN];
+    uint64_t busy;
+    struct cpu_stats stats;
+} bench_run;
+
+static void bench_command(struct cmd_args* a) {
+    if (strncmp(a->str, "begin ", 6) == 0 && a->str[6]) {
+        strncpy(bench_run.name, a->str + 6, MAX_NAME_LEN - 1);
+        bench_run.name[MAX_NAME_LEN - 1] = 0;
+        cpu_stats_sum(&bench_run.stats);
+        bench_run.busy = shell_busy_cycles;
+        vga_write("\n");
+        return;
+    }
+    if (strcmp(a->str, "end") != 0 || !bench_run.name[0]) {
+        vga_write("\nusage: bench begin <name> | bench end\n");
+        return;
+    }
+
+    // one line, easy to pick out of the console stream
+    struct cpu_stats now;
+    cpu_stats_sum(&now);
+    vga_write("\nBENCH ");
+    vga_write(bench_run.name);
+    vga_write(" kcycles=");
+    vga_write_uint((uint32_t)udiv64(shell_busy_cycles - bench_run.busy, 1000, 0));
+    vga_write(" kmalloc=");
+    vga_write_uint(now.kmalloc_calls - bench_run.stats.kmalloc_calls);
+    vga_write(" scrolls=");
+    vga_write_uint(now.vga_scrolls - bench_run.stats.vga_scrolls);
+    vga_write(" cursor=");
+    vga_write_uint(now.cursor_outs - bench_run.stats.cursor_outs);
+    vga_write(" lookups=");
+    vga_write_uint(now.fs_lookups - bench_run.stats.fs_lookups);
+    vga_write("\n");
+    bench_run.name[0] = 0;
+}
+
+COMMAND(bench, "bench", "begin <name> | end", "time a scripted scenario (see bench/run.py)", cmd_arg_str, bench_command);
+
+static void exit_command(struct cmd_args* a) {
+    vga_write("\n");
+    bflush();
+    serial_drain();
+    outb(QEMU_EXIT_PORT, a->num); // QEMU exits with (num << 1) | 1
+    vga_write("not running under QEMU with isa-debug-exit\n");
+}
+
+COMMAND(exit, "exit", "<status>", "leave QEMU through isa-debug-exit", cmd_arg_uint, exit_command);
+
+// ---------- boot stages ----------
+// boot_mark() stamps the TSC at the end of each step of kernel_main; the
+// first stamp is taken by kernel_restart itself.
+
+#define BOOT_MAX_STAGES 24
+
+struct boot_stage {
+    const char* name;
+    uint64_t tsc;
+};
+
+static struct boot_stage boot_stages[BOOT_MAX_STAGES];
+static int boot_stage_count = 0;
+static int boot_fast = 0;
+
+void boot_mark(const char* name) {
+    if (boot_stage_count == 0) {
+        boot_stages[0].name = "_start";
+        boot_stages[0].tsc = boot_tsc_start;
+        boot_stage_count = 1;
+    }
+    if (boot_stage_count < BOOT_MAX_STAGES) {
+        boot_stages[boot_stage_count].name = name;
+        boot_stages[boot_stage_count].tsc = rdtsc();
+        boot_stage_count++;
+    }
+}
+
+// Is opt one of the words on the Multiboot command line?
+static int boot_option(const char* opt) {
+    if (multiboot_magic != MULTIBOOT_BOOTLOADER_MAGIC) return 0;
+    struct multiboot_info* mbi = (struct multiboot_info*)multiboot_info_addr;
+    if (!(mbi->flags & (1 << 2)) || !mbi->cmdline) return 0;
+
+    size_t len = strlen(opt);
+    const char* p = (const char*)mbi->cmdline;
+    while (*p) {
+        while (*p == ' ') p++;
+        const char* word = p;
+        while (*p && *p != ' ') p++;
+        if ((size_t)(p - word) == len && strncmp(word, opt, len) == 0) return 1;
+    }
+    return 0;
+}
+
+static void boot_write_us(uint64_t cycles, uint32_t khz) {
+    vga_write_uint((uint32_t)udiv64(cycles * 1000, khz, 0));
+    vga_write(" us");
+}
+
+static void boottime_command(struct cmd_args* a) {
+    (void)a;
+    uint32_t khz = tsc_get_khz();
+    vga_write("\nboot stages (took / since _start):\n");
+    for (int i = 1; i < boot_stage_count; i++) {
+        vga_write("  ");
+        vga_write(boot_stages[i].name);
+        vga_write(": ");
+        boot_write_us(boot_stages[i].tsc - boot_stages[i - 1].tsc, khz);
+        vga_write(" / ");
+        boot_write_us(boot_stages[i].tsc - boot_stages[0].tsc, khz);
+        vga_write("\n");
+    }
+    vga_write(boot_fast ? "fast boot (splash delays skipped)\n" : "normal boot\n");
+}
+
+COMMAND(boottime, "boottime", "", "how long each boot stage took", cmd_arg_none, boottime_command);
+
 // ---------- main loop ----------
-void _start(void)
+// The shell is a thread like any other; commands run under kernel_lock
+static void shell_thread(void* arg) {
+    (void)arg;
+    vga_write("[ibant]> ");
+    boot_mark("prompt");
+
+    while (1) {
+        char c = get_char();
+        mutex_lock(&kernel_lock);
+        uint64_t t0 = rdtsc();
+        read_input_char(c);
+        if (c == '\n' && !fs_edit_mode)
+            vga_write("[ibant]> ");
+        shell_busy_cycles += rdtsc() - t0;
+        mutex_unlock(&kernel_lock);
+    }
+}
+
+void kernel_main(void)
 {
+    boot_stage_count = 0;
+    interrupts_init(); // first: cpu_this() reads %fs, which gdt_init() sets up
+    klog_init();
+    boot_fast = boot_option("fastboot");
+    sched_init();
+    boot_mark("interrupts");
+    timer_init();
+    boot_mark("timer");
+    kbd_init();
+    serial_init();
+    irq_enable();
+    boot_mark("input");
     grublmao();
     vga_clear();
     bootimage();
-    // loop bootimage for 10 seconds, then do a black screen for 5 and then go return at the next below vga_clear
-    delay_ms(100000);  // Display bootimage for 10 seconds
-    vga_clear();      // Black screen
-    delay_ms(50000);   // Wait 5 seconds
+    if (!boot_fast) {
+        // loop bootimage for 10 seconds, then do a black screen for 5 and then go return at the next below vga_clear
+        delay_ms(100000);  // Display bootimage for 10 seconds
+        vga_clear();      // Black screen
+        delay_ms(50000);   // Wait 5 seconds
+    }
     vga_clear();      // Clear again before continuing
+    boot_mark("splash");
+    pmm_init(multiboot_magic, multiboot_info_addr);
+    boot_mark("pmm");
+    vga_scrollback_init();
+    gfx_init();
+    boot_mark("console");
+    kheap_init();
+    boot_mark("heap");
+    ata_init();
+    boot_mark("ata");
+    bcache_init();
+    boot_mark("bcache");
     fs_init();
+    boot_mark("fs");
+    cmd_init();
+    boot_mark("commands");
+    smp_init();
+    boot_mark("smp");
     vga_set_color(0x07, 0x01); //white on blue
     vga_write("iBANT-OS 1.6 beta ENGLISH\n");
     vga_write("this is a unfished version of iBANT-OS so there may be errors. if you do find them, contact the creator (aka: me)");
@@ -869,14 +5736,10 @@ void _start(void)
     vga_set_color(0x01, 0x00);
     vga_write("write 'help' for help!\n\n");
 
-    // Start command prompt
-    vga_write("[ibant]> ");
+    thread_create("shell", shell_thread, 0);
+    thread_create("bflush", bflush_thread, 0);
+    boot_mark("threads");
 
-    while (1) {
-        char c = get_char();
-        read_input_char(c);
-        if (c == '\n') {
-            vga_write("[ibant]> ");
-        }
-    }
+    // from here on this is the idle thread
+    while (1) __asm__ volatile ("sti; hlt");
 }
@@ -0,0 +1,25 @@
+# nm -n kernel.elf | awk -f ksyms.awk > ksyms.S
+# Function symbols as an address-ordered table for the profiler, in the
+# layout of struct perf_sym: { uint32_t addr; const char* name; }. It goes
+# into .rodata, behind .text, so linking it in moves no function.
+
+BEGIN { n = 0 }
+
+$2 ~ /^[tT]$/ && $1 != last {
+    addr[n] = $1
+    name[n] = $3
+    n++
+    last = $1
+}
+
+END {
+    print "    .section .note.GNU-stack, \"\", @progbits"
+    print "    .section .rodata"
+    print "    .balign 4"
+    print "    .globl perf_ksyms, perf_ksyms_count"
+    print "perf_ksyms_count:"
+    print "    .long " n
+    print "perf_ksyms:"
+    for (i = 0; i < n; i++) print "    .long 0x" addr[i] ", .Lname" i
+    for (i = 0; i < n; i++) print ".Lname" i ": .asciz \"" name[i] "\""
+}
@@ -0,0 +1,109 @@
+// The hardware-independent part of the kernel: string routines, the heap,
+// the in-memory file tree and the calculator. These files only reach the
+// rest of the world through platform.h, so they build for the kernel and
+// for the host alike.
+
+#ifndef LIB_H
+#define LIB_H
+
+#include "platform.h"
+
+#define MAX_CMD_LEN 128
+
+// ---------- string.c ----------
+int strncmp(const char* s1, const char* s2, int n);
+int strlen(const char* s);
+int strcmp(const char* a, const char* b);
+char* strncpy(char* dst, const char* src, size_t n);
+int atoi(const char* str);
+void* memset(void* dest, int val, size_t n);
+void* memcpy(void* dest, const void* src, size_t n);
+
+// ---------- heap.c ----------
+#define HEAP_MAX_SMALL 512 // largest request served from a size class
+
+struct heap_stats {
+    size_t total;      // bytes under management
+    size_t in_use;     // bytes in handed-out blocks (headers included)
+    size_t high_water; // peak of in_use
+    size_t cached;     // bytes parked on size-class lists
+    uint32_t regions;  // chunks added with heap_add_region
+    uint32_t allocs, frees, failed;
+};
+
+extern struct heap_stats heap_stats;
+
+void kheap_init(void);
+void heap_add_region(void* base, size_t len);
+void* kmalloc(size_t size);
+void kfree(void* p);
+size_t ksize(void* p);
+void heap_free_space(size_t* free_large, size_t* largest);
+
+// ---------- fs.c ----------
+#define MAX_NAME_LEN 32
+#define FS_DIR_MIN_SLOTS 8
+
+struct fs_dir;
+
+typedef struct fs_node {
+    char name[MAX_NAME_LEN];
+    uint32_t hash; // fs_hash(name)
+    int is_dir;
+
+    struct fs_node* parent;
+    struct fs_dir* dir; // entry table, directories only (allocated on first insert)
+
+    uint8_t* data; // RAM files only
+    size_t size;
+
+    uint32_t ino; // backing ibfs inode, 0 = lives in RAM only
+    int loaded;   // disk directory: every entry is in the table
+    int readonly; // initrd: data points into the boot module
+} fs_node;
+
+// Directory entries: open addressing with linear probing, keyed by name hash.
+// cap is a power of two; deleted slots hold FS_TOMBSTONE until the next rebuild.
+typedef struct fs_dir {
+    fs_node** slots;
+    uint32_t cap;
+    uint32_t used;
+    uint32_t tomb;
+} fs_dir;
+
+#define FS_TOMBSTONE ((fs_node*)1)
+
+#define FS_FOR_EACH_CHILD(dirnode, n) \
+    for (uint32_t _i = 0; (dirnode)->dir && _i < (dirnode)->dir->cap; _i++) \
+        for (fs_node* n = (dirnode)->dir->slots[_i]; n && n != FS_TOMBSTONE; n = 0)
+
+extern fs_node* fs_root;
+extern fs_node* fs_cwd;
+
+void fs_init_root(void);
+uint32_t fs_hash(const char* name);
+fs_node* fs_create_node(const char* name, int is_dir);
+fs_node* fs_dir_get(fs_node* dir, const char* name, uint32_t hash);
+fs_node* fs_lookup(fs_node* dir, const char* name);
+int fs_dir_insert(fs_node* dir, fs_node* child);
+void fs_dir_remove(fs_node* dir, fs_node* child);
+void fs_free_tree(fs_node* n);
+
+void dcache_invalidate(fs_node* parent, const char* name);
+fs_node* fs_lookup_cached(fs_node* parent, const char* name);
+
+int fs_next_component(const char** path, char* name);
+fs_node* fs_resolve(const char* path);
+fs_node* fs_resolve_parent(const char* path, char* leaf);
+
+void fs_mkdir(const char* path);
+void fs_ls(void);
+void fs_cd(const char* path);
+void fs_dir_from(fs_node* dir);
+void fs_mkfile(const char* path);
+void fs_delfile(const char* path);
+
+// ---------- calc.c ----------
+void calc_command(const char* cmd);
+
+#endif
@@ -0,0 +1,67 @@
+// What the portable parts (string.c, heap.c, fs.c, calc.c) need from the
+// machine they run on. kernel.c provides it on real hardware; host/platform.c
+// provides it when the same files are built as a Linux library (IBANT_HOST)
+// for benchmarks and fuzzing.
+
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <stdint.h>
+
+#ifdef IBANT_HOST
+#include <stddef.h>
+// our string routines next to libc's: give them names of their own
+#define strncmp ibant_strncmp
+#define strlen  ibant_strlen
+#define strcmp  ibant_strcmp
+#define strncpy ibant_strncpy
+#define atoi    ibant_atoi
+#define memset  ibant_memset
+#define memcpy  ibant_memcpy
+// word-at-a-time scans read up to 3 bytes past the NUL on purpose
+#define NO_ASAN __attribute__((no_sanitize_address))
+#else
+#define NULL ((void*)0)
+typedef unsigned int size_t;
+#define NO_ASAN
+#endif
+
+#define PAGE_SIZE 4096
+
+// console (VGA text plus the serial mirror in the kernel)
+void vga_write(const char* str);
+void vga_write_uint(uint32_t v);
+
+// count contiguous pages for the heap, 0 if there are none
+void* pmm_alloc_pages(uint32_t count);
+
+// Kernel log: klog(level, fmt, up to 3 x 32-bit args); %s arguments must
+// stay valid until dmesg reads them. More than 3 arguments does not compile.
+enum { KLOG_ERR, KLOG_WARN, KLOG_INFO, KLOG_DEBUG };
+#define KLOG_NARGS(...) KLOG_NARGS_(0, ##__VA_ARGS__, klog_too_many_args, klog_too_many_args, 3, 2, 1, 0)
+#define KLOG_NARGS_(_0, _1, _2, _3, _4, _5, n, ...) n
+#define klog(level, fmt, ...) klog_write(level, fmt, KLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)
+void klog_write(int level, const char* fmt, int nargs, ...);
+
+// Per-CPU event counters for the stats command. Plain increments: a thread
+// migrating mid-update can drop a count, which is fine for statistics.
+struct cpu_stats {
+    uint32_t kmalloc_calls;
+    uint64_t kmalloc_bytes;
+    uint32_t vga_scrolls;
+    uint32_t cursor_outs; // port writes by update_cursor
+    uint32_t fs_lookups;  // path components looked up
+    uint32_t fs_misses;   // ... that named nothing
+};
+
+struct cpu_stats* cpu_stats_this(void);
+
+// Disk backing for the file tree (ibfs in the kernel). Only nodes with an
+// ino reach these, so a platform without a disk can make them no-ops.
+struct fs_node;
+struct fs_node* fs_disk_lookup(struct fs_node* dir, const char* name, uint32_t hash);
+void fs_dir_load(struct fs_node* dir);
+int fs_disk_create(struct fs_node* dir, struct fs_node* n);
+void fs_disk_unlink(struct fs_node* dir, struct fs_node* n);
+
+#endif
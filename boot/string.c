@@ -0,0 +1,100 @@
+// ---------- minimal string functions ----------
+// No libc here. The word-at-a-time routines assume nothing faults between a
+// terminator and the next 4-byte boundary, which holds for any page size.
+
+#include "lib.h"
+
+int strncmp(const char* s1, const char* s2, int n) {
+    for (int i = 0; i < n; i++) {
+        if (s1[i] != s2[i] || s1[i] == 0 || s2[i] == 0) return s1[i] - s2[i];
+    }
+    return 0;
+}
+
+// word-sized loads over char data; may_alias keeps the optimizer honest
+typedef uint32_t __attribute__((may_alias)) word_alias;
+#define HAS_ZERO_BYTE(w) (((w) - 0x01010101) & ~(w) & 0x80808080)
+
+// Scan a word at a time once aligned (reading up to the next 4-byte boundary
+// past the terminator never crosses into another page)
+NO_ASAN int strlen(const char* s) {
+    const char* p = s;
+    while ((uintptr_t)p & 3) {
+        if (!*p) return p - s;
+        p++;
+    }
+    const word_alias* w = (const word_alias*)p;
+    while (!HAS_ZERO_BYTE(*w)) w++;
+    p = (const char*)w;
+    while (*p) p++;
+    return p - s;
+}
+
+int atoi(const char* str) {
+    int res = 0;
+    int i = 0;
+    while (str[i] >= '0' && str[i] <= '9') {
+        res = res * 10 + (str[i] - '0');
+        i++;
+    }
+    return res;
+}
+
+// Big fills/copies: align the destination with single bytes, move dwords
+// with rep stos/movs, then finish the tail. DF is always clear here.
+void* memset(void* dest, int val, size_t n) {
+    void* ret = dest;
+    uint32_t v = (uint8_t)val;
+    v |= v << 8;
+    v |= v << 16;
+
+    if (n >= 16) {
+        size_t head = -(uintptr_t)dest & 3;
+        size_t words;
+        n -= head;
+        words = n >> 2;
+        n &= 3;
+        __asm__ volatile ("rep stosb" : "+D"(dest), "+c"(head) : "a"(v) : "memory");
+        __asm__ volatile ("rep stosl" : "+D"(dest), "+c"(words) : "a"(v) : "memory");
+    }
+    __asm__ volatile ("rep stosb" : "+D"(dest), "+c"(n) : "a"(v) : "memory");
+    return ret;
+}
+void* memcpy(void* dest, const void* src, size_t n) {
+    void* ret = dest;
+
+    if (n >= 16) {
+        size_t head = -(uintptr_t)dest & 3;
+        size_t words;
+        n -= head;
+        words = n >> 2;
+        n &= 3;
+        __asm__ volatile ("rep movsb" : "+D"(dest), "+S"(src), "+c"(head) : : "memory");
+        __asm__ volatile ("rep movsl" : "+D"(dest), "+S"(src), "+c"(words) : : "memory");
+    }
+    __asm__ volatile ("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+    return ret;
+}
+
+NO_ASAN int strcmp(const char* a, const char* b) {
+    // same alignment: compare a word at a time until a difference or a NUL
+    if (!(((uintptr_t)a ^ (uintptr_t)b) & 3)) {
+        while (((uintptr_t)a & 3) && *a && *a == *b) { a++; b++; }
+        if (!((uintptr_t)a & 3)) {
+            const word_alias* wa = (const word_alias*)a;
+            const word_alias* wb = (const word_alias*)b;
+            while (*wa == *wb && !HAS_ZERO_BYTE(*wa)) { wa++; wb++; }
+            a = (const char*)wa;
+            b = (const char*)wb;
+        }
+    }
+    while (*a && (*a == *b)) { a++; b++; }
+    return *(unsigned char*)a - *(unsigned char*)b;
+}
+
+char* strncpy(char* dst, const char* src, size_t n) {
+    size_t i;
+    for (i = 0; i < n && src[i]; i++) dst[i] = src[i];
+    for (; i < n; i++) dst[i] = 0;
+    return dst;
+}
@@ -0,0 +1,170 @@
+// Microbenchmarks for the portable kernel code, run as a Linux program:
+// directory lookups per second, heap allocation rate, and path resolution
+// latency on trees of thousands of nodes.
+//   host/bench [scale]    scale multiplies every size (default 1)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "host.h"
+
+static int scale = 1;
+static volatile uintptr_t sink; // keeps results alive
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char* name, long ops, double ns) {
+    printf("%-34s %10ld ops %9.1f ns/op %9.2f Mops/s\n", name, ops, ns / ops, ops * 1e3 / ns);
+}
+
+// xorshift, so runs are repeatable
+static uint32_t rng = 2463534242u;
+static uint32_t rnd(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+// n files f0..f<n-1> in a fresh directory under ~
+static fs_node* make_flat_dir(const char* name, int n) {
+    fs_node* dir = fs_create_node(name, 1);
+    fs_dir_insert(fs_root, dir);
+    char leaf[MAX_NAME_LEN];
+    for (int i = 0; i < n; i++) {
+        snprintf(leaf, sizeof(leaf), "f%d", i);
+        fs_dir_insert(dir, fs_create_node(leaf, 0));
+    }
+    return dir;
+}
+
+static void bench_lookup(int n) {
+    char label[64];
+    host_reset();
+    fs_node* dir = make_flat_dir("flat", n);
+
+    enum { NAMES = 4096 };
+    static char names[NAMES][MAX_NAME_LEN];
+    for (int i = 0; i < NAMES; i++) snprintf(names[i], MAX_NAME_LEN, "f%u", rnd() % n);
+
+    long ops = 2000000L * scale;
+    double t0 = now_ns();
+    for (long i = 0; i < ops; i++) sink += (uintptr_t)fs_lookup(dir, names[i & (NAMES - 1)]);
+    snprintf(label, sizeof(label), "fs_lookup hit, %d entries", n);
+    report(label, ops, now_ns() - t0);
+
+    for (int i = 0; i < NAMES; i++) snprintf(names[i], MAX_NAME_LEN, "g%u", rnd() % n);
+    t0 = now_ns();
+    for (long i = 0; i < ops; i++) sink += (uintptr_t)fs_lookup(dir, names[i & (NAMES - 1)]);
+    snprintf(label, sizeof(label), "fs_lookup miss, %d entries", n);
+    report(label, ops, now_ns() - t0);
+
+    // 64 hot names stay in the dentry cache; 4096 keep evicting each other
+    for (int i = 0; i < NAMES; i++) snprintf(names[i], MAX_NAME_LEN, "f%u", rnd() % n);
+    int sets[] = { 64, NAMES };
+    for (int s = 0; s < 2; s++) {
+        t0 = now_ns();
+        for (long i = 0; i < ops; i++) sink += (uintptr_t)fs_lookup_cached(dir, names[i & (sets[s] - 1)]);
+        snprintf(label, sizeof(label), "fs_lookup_cached, %d names", sets[s]);
+        report(label, ops, now_ns() - t0);
+    }
+}
+
+static void bench_alloc(void) {
+    enum { LIVE = 1024 };
+    static void* live[LIVE];
+    struct { const char* name; uint32_t min, max; } mixes[] = {
+        { "kmalloc/kfree 1-512 bytes", 1, 512 },
+        { "kmalloc/kfree 513-8192 bytes", 513, 8192 },
+        { "kmalloc/kfree 1-65536 bytes", 1, 65536 },
+    };
+    for (unsigned m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+        host_reset();
+        for (int i = 0; i < LIVE; i++) live[i] = 0;
+        long ops = 1000000L * scale;
+        double t0 = now_ns();
+        for (long i = 0; i < ops; i++) {
+            int slot = rnd() % LIVE;
+            kfree(live[slot]);
+            live[slot] = kmalloc(mixes[m].min + rnd() % (mixes[m].max - mixes[m].min + 1));
+        }
+        report(mixes[m].name, ops, now_ns() - t0);
+    }
+}
+
+// Complete tree with the given fanout and depth; directories are d0..d<fanout-1>
+static int make_tree(fs_node* dir, int fanout, int depth) {
+    if (!depth) return 0;
+    int made = 0;
+    char leaf[MAX_NAME_LEN];
+    for (int i = 0; i < fanout; i++) {
+        snprintf(leaf, sizeof(leaf), "d%d", i);
+        fs_node* n = fs_create_node(leaf, 1);
+        fs_dir_insert(dir, n);
+        made += 1 + make_tree(n, fanout, depth - 1);
+    }
+    return made;
+}
+
+static void bench_resolve(void) {
+    char label[64];
+    struct { int fanout, depth; } shapes[] = { { 10, 4 }, { 32, 3 }, { 2, 14 } };
+    for (unsigned s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        host_reset();
+        int nodes = make_tree(fs_root, shapes[s].fanout, shapes[s].depth);
+
+        enum { PATHS = 1024 };
+        static char paths[PATHS][MAX_CMD_LEN];
+        for (int p = 0; p < PATHS; p++) {
+            int len = snprintf(paths[p], MAX_CMD_LEN, "~");
+            for (int d = 0; d < shapes[s].depth; d++)
+                len += snprintf(paths[p] + len, MAX_CMD_LEN - len, "/d%u", rnd() % shapes[s].fanout);
+        }
+
+        long ops = 500000L * scale;
+        double t0 = now_ns();
+        for (long i = 0; i < ops; i++) sink += (uintptr_t)fs_resolve(paths[i & (PATHS - 1)]);
+        snprintf(label, sizeof(label), "fs_resolve depth %d, %d nodes", shapes[s].depth, nodes);
+        report(label, ops, now_ns() - t0);
+    }
+}
+
+// The shell path end to end: resolve parent, check, create, print
+static void bench_mkfile(int n) {
+    char label[64], path[MAX_CMD_LEN];
+    host_reset();
+    fs_mkdir("~/m");
+    double t0 = now_ns();
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "~/m/file%d", i);
+        fs_mkfile(path);
+    }
+    snprintf(label, sizeof(label), "fs_mkfile into ~/m, %d files", n);
+    report(label, n, now_ns() - t0);
+
+    t0 = now_ns();
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "~/m/file%d", i);
+        fs_delfile(path);
+    }
+    snprintf(label, sizeof(label), "fs_delfile from ~/m, %d files", n);
+    report(label, n, now_ns() - t0);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) scale = atoi(argv[1]) > 0 ? atoi(argv[1]) : 1;
+    host_console_echo = 0;
+
+    bench_lookup(1000);
+    bench_lookup(10000);
+    bench_lookup(100000);
+    bench_alloc();
+    bench_resolve();
+    bench_mkfile(10000 * scale);
+    return 0;
+}
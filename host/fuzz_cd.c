@@ -0,0 +1,47 @@
+// libFuzzer target: fs_cd() and the path walk under it (fs_resolve,
+// fs_next_component, the dentry cache) on arbitrary bytes.
+
+#include <stdlib.h>
+
+#include "host.h"
+
+#define FUZZ_PATH_MAX 1024
+
+static void check(int ok) {
+    if (!ok) abort();
+}
+
+// ~/a/b/c, ~/a/file, ~/x and a long-named directory, built once
+static void setup(void) {
+    host_reset();
+    host_console_echo = 0;
+    fs_mkdir("~/a");
+    fs_mkdir("~/a/b");
+    fs_mkdir("~/a/b/c");
+    fs_mkfile("~/a/file");
+    fs_mkdir("~/x");
+    fs_mkdir("~/abcdefghijklmnopqrstuvwxyz012345"); // longer than a name can be
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static int ready = 0;
+    if (!ready) {
+        setup();
+        ready = 1;
+    }
+
+    char path[FUZZ_PATH_MAX + 1];
+    if (size > FUZZ_PATH_MAX) size = FUZZ_PATH_MAX;
+    memcpy(path, data, size);
+    path[size] = 0;
+
+    fs_cwd = fs_root;
+    fs_node* n = fs_resolve(path);
+    fs_cd(path);
+
+    check(fs_cwd && fs_cwd->is_dir);
+    check(fs_cwd == (n && n->is_dir ? n : fs_root));
+    for (fs_node* p = fs_cwd; p != fs_root; p = p->parent)
+        check(p->parent && fs_lookup(p->parent, p->name) == p);
+    return 0;
+}
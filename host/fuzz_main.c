@@ -0,0 +1,36 @@
+// Stand-in for libFuzzer where clang is not around: runs each file named on
+// the command line through LLVMFuzzerTestOneInput, or with no arguments
+// feeds it random paths built from the characters that matter to the parser.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "host.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+int main(int argc, char** argv) {
+    static uint8_t buf[4096];
+    for (int i = 1; i < argc; i++) {
+        FILE* f = fopen(argv[i], "rb");
+        if (!f) {
+            perror(argv[i]);
+            return 1;
+        }
+        size_t n = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+        LLVMFuzzerTestOneInput(buf, n);
+    }
+    if (argc > 1) return 0;
+
+    static const char alphabet[] = "~/..//abcx~file.";
+    srand(1);
+    for (int iter = 0; iter < 200000; iter++) {
+        size_t n = rand() % 48;
+        for (size_t k = 0; k < n; k++)
+            buf[k] = rand() % 8 ? alphabet[rand() % (sizeof(alphabet) - 1)] : rand() % 256;
+        LLVMFuzzerTestOneInput(buf, n);
+    }
+    printf("200000 random inputs ok\n");
+    return 0;
+}
@@ -0,0 +1,47 @@
+// libFuzzer target: fs_resolve_parent() through fs_mkfile() and
+// fs_delfile(), which split a path into directory and leaf name.
+
+#include <stdlib.h>
+
+#include "host.h"
+
+#define FUZZ_PATH_MAX 1024
+
+static void check(int ok) {
+    if (!ok) abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static int ready = 0;
+    if (!ready) {
+        host_reset();
+        host_console_echo = 0;
+        fs_mkdir("~/a");
+        fs_mkdir("~/a/b");
+        ready = 1;
+    }
+
+    char path[FUZZ_PATH_MAX + 1];
+    if (size > FUZZ_PATH_MAX) size = FUZZ_PATH_MAX;
+    memcpy(path, data, size);
+    path[size] = 0;
+
+    fs_cwd = fs_root;
+    char leaf[MAX_NAME_LEN];
+    fs_node* dir = fs_resolve_parent(path, leaf);
+    fs_node* before = dir ? fs_lookup(dir, leaf) : 0;
+    check(!dir || (dir->is_dir && strlen(leaf) > 0 && strlen(leaf) < MAX_NAME_LEN));
+
+    fs_mkfile(path);
+    fs_node* made = dir ? fs_lookup(dir, leaf) : 0;
+    check(!dir || made); // made now, or there already
+    check(!before || made == before);
+    check(!made || fs_resolve(path) == made);
+
+    if (made && !before) {
+        fs_delfile(path);
+        check(!fs_lookup(dir, leaf));
+        check(!fs_resolve(path));
+    }
+    return 0;
+}
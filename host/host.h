@@ -0,0 +1,16 @@
+// Host build of the portable kernel files: what host/platform.c adds on
+// top of platform.h. Include system headers before this one; lib.h renames
+// the string routines so they do not collide with libc's.
+
+#ifndef HOST_H
+#define HOST_H
+
+#include "lib.h"
+
+extern int host_console_echo;          // 1 = vga_write() goes to stdout
+extern uint64_t host_console_bytes;    // everything vga_write() was given
+
+// empty heap and a tree holding just ~
+void host_reset(void);
+
+#endif
@@ -0,0 +1,68 @@
+// platform.h on Linux: the console is stdout (or nowhere), heap pages come
+// from aligned_alloc, klog is dropped and there is no disk.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "host.h"
+
+int host_console_echo = 1;
+uint64_t host_console_bytes = 0;
+
+static struct cpu_stats host_stats;
+
+void vga_write(const char* str) {
+    size_t n = strlen(str);
+    host_console_bytes += n;
+    if (host_console_echo) fwrite(str, 1, n, stdout);
+}
+
+void vga_write_uint(uint32_t v) {
+    char buf[11];
+    snprintf(buf, sizeof(buf), "%u", v);
+    vga_write(buf);
+}
+
+void* pmm_alloc_pages(uint32_t count) {
+    return aligned_alloc(PAGE_SIZE, (size_t)count * PAGE_SIZE);
+}
+
+void klog_write(int level, const char* fmt, int nargs, ...) {
+    (void)level;
+    (void)fmt;
+    (void)nargs;
+}
+
+struct cpu_stats* cpu_stats_this(void) {
+    return &host_stats;
+}
+
+// no ibfs here, so no node ever has an ino and these are never reached
+struct fs_node* fs_disk_lookup(struct fs_node* dir, const char* name, uint32_t hash) {
+    (void)dir;
+    (void)name;
+    (void)hash;
+    return 0;
+}
+
+void fs_dir_load(struct fs_node* dir) {
+    (void)dir;
+}
+
+int fs_disk_create(struct fs_node* dir, struct fs_node* n) {
+    (void)dir;
+    (void)n;
+    return -1;
+}
+
+void fs_disk_unlink(struct fs_node* dir, struct fs_node* n) {
+    (void)dir;
+    (void)n;
+}
+
+// The old heap's pages are simply leaked; this runs once per benchmark
+void host_reset(void) {
+    kheap_init();
+    fs_init_root();
+    memset(&host_stats, 0, sizeof(host_stats));
+}